@@ -0,0 +1,70 @@
+#include "AliasTable.h"
+
+AliasTable::AliasTable(const float* weights, int size)
+{
+	Build(weights, size);
+}
+
+void AliasTable::Build(const float* weights, int size)
+{
+	threshold.assign(size, 1.0f);
+	alias.resize(size);
+	pmf.assign(size, 0.0f);
+
+	double sum = 0.0;
+	for (int i = 0; i < size; i++)
+		sum += weights[i];
+	total = (float)sum;
+
+	for (int i = 0; i < size; i++)
+	{
+		alias[i] = i;
+		pmf[i] = (sum > 0.0) ? (float)(weights[i] / sum) : 1.0f / (float)size;
+	}
+
+	// Scaled probabilities: below one borrows from an entry above one.
+	std::vector<double> scaled(size);
+	std::vector<int> small, large;
+	for (int i = 0; i < size; i++)
+	{
+		scaled[i] = (double)pmf[i] * size;
+		if (scaled[i] < 1.0)
+			small.push_back(i);
+		else
+			large.push_back(i);
+	}
+
+	while (!small.empty() && !large.empty())
+	{
+		int s = small.back();
+		int l = large.back();
+		small.pop_back();
+
+		threshold[s] = (float)scaled[s];
+		alias[s] = l;
+
+		scaled[l] -= 1.0 - scaled[s];
+		if (scaled[l] < 1.0)
+		{
+			large.pop_back();
+			small.push_back(l);
+		}
+	}
+
+	// Whatever is left is one up to rounding.
+	for (int i : small)
+		threshold[i] = 1.0f;
+	for (int i : large)
+		threshold[i] = 1.0f;
+}
+
+int AliasTable::Sample(float u) const
+{
+	const int size = Size();
+	const float scaled = u * size;
+	int i = (int)scaled;
+	if (i >= size)
+		i = size - 1;
+
+	return (scaled - i < threshold[i]) ? i : alias[i];
+}
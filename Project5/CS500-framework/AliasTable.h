@@ -0,0 +1,28 @@
+#pragma once
+#include <vector>
+
+////////////////////////////////////////////////////////////////////////
+// AliasTable: Walker/Vose alias method.  Picks an index with
+// probability proportional to its weight from one uniform number in
+// constant time.
+////////////////////////////////////////////////////////////////////////
+class AliasTable
+{
+public:
+	AliasTable() = default;
+	AliasTable(const float* weights, int size);
+
+	void Build(const float* weights, int size);
+
+	int Sample(float u) const;
+	float Pdf(int index) const { return pmf[index]; }
+	int Size() const { return (int)pmf.size(); }
+	bool Empty() const { return pmf.empty(); }
+	float Total() const { return total; }
+
+private:
+	std::vector<float> threshold;
+	std::vector<int> alias;
+	std::vector<float> pmf;
+	float total = 0.0f;
+};
@@ -1,12 +1,13 @@
 #pragma once
 #include "geom.h"
+#include "FastMath.h"
 #include "Helper.h"
 #include "Intersection.h"
 #include "StaticRayTrace.h"
 
 inline vec3 SampleLobe(vec3 A, float theta, float phi)
 {
-	float s = sqrtf(1.0f - powf(theta, 2));
+	float s = sqrtf(1.0f - Square(theta));
 	vec3 K = vec3(s * cos(phi), s * sin(phi), theta);	// vector centered around z-axis
 
 	if (abs(A.z - 1.0f) < epsilon)	// A=z no rotation
@@ -21,8 +22,16 @@ inline vec3 SampleLobe(vec3 A, float theta, float phi)
 
 inline float GeometryFactor(Intersection A, Intersection B)
 {
-	vec3 D = normalize(A.point - B.point);
-	return abs(dot(A.normal, D) * dot(B.normal, D) / powf(dot(D, D), 2));
+	vec3 D = A.point - B.point;
+	return abs(dot(A.normal, D) * dot(B.normal, D) / Square(dot(D, D)));
+}
+
+// Turns an area density at B into a solid angle density as seen from A.
+inline float AreaToSolidAngle(const Intersection& A, const Intersection& B)
+{
+	vec3 D = A.point - B.point;
+	float d2 = dot(D, D);
+	return d2 * sqrtf(d2) / abs(dot(B.normal, D));
 }
 
 inline float CharacteristicFactor(float d)
@@ -40,19 +49,17 @@ inline float GetDistributionCos(Material* mat, float theta)
 		return powf(theta, 1.0f / (mat->alpha_phong + 1));
 	}
 
+	// cos(atan(x)) = 1 / sqrt(1 + x^2)
 	if (type == DistributionType::GGX)
 	{
-		const float numerator = mat->alpha_other * sqrtf(theta);
-		const float denominator = sqrtf(1 - theta);
-		const float aTan = atanf(numerator / denominator);
-		return cosf(aTan);
+		const float square_alpha = Square(mat->alpha_other);
+		return sqrtf((1.0f - theta) / (1.0f - theta + square_alpha * theta));
 	}
 
 	if (type == DistributionType::Beckman)
 	{
-		const float factor = sqrtf(-powf(mat->alpha_other, 2) * log(1 - theta));
-		const float aTan = atanf(factor);
-		return cosf(aTan);
+		const float square_tan = -Square(mat->alpha_other) * FastLog(1.0f - theta);
+		return FastRsqrt(1.0f + square_tan);
 	}
 
 	return 0.0f;
@@ -60,27 +67,27 @@ inline float GetDistributionCos(Material* mat, float theta)
 
 inline vec3 F_Factor(float d, Material* mat)
 {
-	return mat->Ks + (1.0f - mat->Ks) * powf(1.0f - abs(d), 5);
+	return mat->Ks + (1.0f - mat->Ks) * Pow5(1.0f - abs(d));
 }
 
 inline float D_Factor(vec3 m, vec3 normal, Material* mat)
 {
 	float mDotN = dot(m, normal);
-	float tanTheta = sqrtf(1.0f - powf(mDotN, 2)) / mDotN;
+	float square_cos = Square(mDotN);
+	float square_tan_m = (1.0f - square_cos) / square_cos;
 	float cFactor = CharacteristicFactor(mDotN);
 
 	if (type == DistributionType::Phong)
 	{
-		return cFactor * (mat->alpha_phong + 2.0f) * pow(mDotN, mat->alpha_phong) / (2.0f * PI);
+		return cFactor * (mat->alpha_phong + 2.0f) * powf(mDotN, mat->alpha_phong) / (2.0f * PI);
 	}
 
 	if (type == DistributionType::GGX)
 	{
-		float square_alpha = powf(mat->alpha_other, 2);
-		float square_tan_m = powf(tanTheta, 2);
+		float square_alpha = Square(mat->alpha_other);
 
-		float left_denom = powf(mDotN, 4);
-		float right_denom = powf(square_alpha + square_tan_m, 2);
+		float left_denom = Square(square_cos);
+		float right_denom = Square(square_alpha + square_tan_m);
 		float f1 = square_alpha / (PI * left_denom * right_denom);
 
 		return cFactor * f1;
@@ -88,8 +95,9 @@ inline float D_Factor(vec3 m, vec3 normal, Material* mat)
 
 	if (type == DistributionType::Beckman)
 	{
-		float f1 = 1.0f / (PI * powf(mat->alpha_other, 2) * powf(mDotN, 4));
-		float f2 = std::expf(-powf(tanTheta, 2) / powf(mat->alpha_other, 2));
+		float square_alpha = Square(mat->alpha_other);
+		float f1 = 1.0f / (PI * square_alpha * Square(square_cos));
+		float f2 = FastExp(-square_tan_m / square_alpha);
 
 		return cFactor * f1 * f2;
 	}
@@ -103,7 +111,7 @@ inline float GetG(vec3 v, vec3 m, vec3 normal, Material* mat)
 	if (vDotN > 1.0f)
 		return 1.0f;
 
-	float tanTheta = sqrtf(1.0f - powf(vDotN, 2)) / vDotN;
+	float tanTheta = sqrtf(1.0f - Square(vDotN)) / vDotN;
 	if (fabs(tanTheta - 0.0f) < epsilon)
 		return 1.0f;
 
@@ -117,15 +125,15 @@ inline float GetG(vec3 v, vec3 m, vec3 normal, Material* mat)
 		if (a >= 1.6f)
 			return cFactor;
 
-		const float numerator = 3.535f * a + 2.181f * powf(a, 2);
-		const float denominator = 1.0f + 2.276f * a + 2.577f * powf(a, 2);
+		const float numerator = 3.535f * a + 2.181f * Square(a);
+		const float denominator = 1.0f + 2.276f * a + 2.577f * Square(a);
 		return cFactor * (numerator / denominator);
 	}
 
 	if (type == DistributionType::GGX)
 	{
-		float square_alpha = powf(mat->alpha_other, 2);
-		float square_theta = powf(tanTheta, 2);
+		float square_alpha = Square(mat->alpha_other);
+		float square_theta = Square(tanTheta);
 		float f1 = 2.0f / (1 + sqrtf(1 + square_alpha * square_theta));
 
 		return cFactor * f1;
@@ -138,8 +146,8 @@ inline float GetG(vec3 v, vec3 m, vec3 normal, Material* mat)
 		if (a >= 1.6f)
 			return cFactor;
 
-		const float numerator = 3.535f * a + 2.181f * powf(a, 2);
-		const float denominator = 1.0f + 2.276f * a + 2.577f * powf(a, 2);
+		const float numerator = 3.535f * a + 2.181f * Square(a);
+		const float denominator = 1.0f + 2.276f * a + 2.577f * Square(a);
 		return cFactor * (numerator / denominator);
 	}
 
@@ -0,0 +1,457 @@
+#include "Bidirectional.h"
+
+#include "Camera.h"
+#include "Shape.h"
+#include "Auxiliary.h"
+#include "Helper.h"
+#include "Ray.h"
+#include "StaticRayTrace.h"
+#include "acceleration.h"
+#include "raytrace.h"
+
+Bidirectional::Bidirectional(StaticRayTrace& tracer_, int maxDepth_)
+	: maxDepth(maxDepth_), tracer(tracer_)
+{
+}
+
+vec3 Bidirectional::Trace(const Ray& ray, int width, int height, Color* splat, FirstHit* first)
+{
+	static thread_local std::vector<Vertex> cameraPath, lightPath;
+	cameraPath.resize(maxDepth + 2);
+	lightPath.resize(maxDepth + 1);
+	const Vertex* camera = cameraPath.data();
+	const Vertex* light = lightPath.data();
+
+	const int nCamera = CameraSubpath(ray, cameraPath.data());
+	const int nLight = LightSubpath(lightPath.data());
+
+	if (first != nullptr)
+	{
+		// Lights and the background keep an albedo of one.
+		const bool hit = nCamera > 1 && !camera[1].infinite;
+		first->normal = hit ? camera[1].I.normal : -ray.D;
+		first->depth = hit ? camera[1].I.t : 0.0f;
+		if (hit && camera[1].type == VertexType::Surface)
+		{
+			const Material* mat = camera[1].I.object->material;
+			first->albedo = glm::min(vec3(1), camera[1].Kd + mat->Ks + mat->Kt);
+		}
+	}
+
+	// s light vertices joined to t camera vertices; a path of one edge is
+	// only ever the camera seeing a light.
+	vec3 C(0);
+	for (int t = 1; t <= nCamera; t++)
+	{
+		for (int s = 0; s <= nLight; s++)
+		{
+			const int depth = s + t - 2;
+			if ((s == 1 && t == 1) || depth < 0 || depth > maxDepth)
+				continue;
+
+			if (t == 1)
+				Splat(light, camera, s, width, height, splat);
+			else
+				C += Connect(light, camera, s, t);
+		}
+	}
+
+	return C;
+}
+
+int Bidirectional::CameraSubpath(const Ray& ray, Vertex* path)
+{
+	path[0] = CameraVertex();
+	return 1 + RandomWalk(ray, vec3(1), PdfCamera(ray.D), maxDepth + 1, true, path + 1);
+}
+
+int Bidirectional::LightSubpath(Vertex* path)
+{
+	const LightDistribution& lights = tracer.lightDistribution;
+	Shape* light = lights.Sample(myrandomf(RNGen));
+	if (light == nullptr)
+		return 0;
+	const float pmf = lights.Pdf(light);
+
+	Vertex& origin = path[0];
+	origin = Vertex();
+	origin.type = VertexType::Light;
+
+	Ray ray(vec3(0), vec3(0));
+	vec3 Le;
+	float pdfPos, pdfDir;
+	float cosN = 1.0f;
+	if (light == tracer.ibl)
+	{
+		// From a disk across the scene, facing the sampled direction
+		Intersection center;
+		center.point = lights.sceneCenter;
+		const Intersection B = tracer.ibl->SampleAsLight(center, pdfDir);
+		if (pdfDir <= 0.0f)
+			return 0;
+
+		const float R = lights.sceneRadius;
+		const float r = R * sqrtf(myrandomf(RNGen));
+		const vec3 offset = r * SampleLobe(B.normal, 0.0f, 2.0f * PI * myrandomf(RNGen));
+		ray = Ray(center.point - R * B.normal + offset, B.normal);
+		pdfPos = 1.0f / (PI * R * R);
+
+		origin.I = B;
+		origin.infinite = true;
+		origin.pdfFwd = pmf * pdfDir;
+		Le = tracer.ibl->EvalRadiance(B);
+	}
+	else
+	{
+		const Intersection S = light->SampleSurface();
+		const float area = light->Area();
+		if (S.object == nullptr || area <= 0.0f)
+			return 0;
+
+		// Cosine-weighted; triangles emit from both faces.
+		const bool twoSided = dynamic_cast<Triangle*>(light) != nullptr;
+		const vec3 N = (twoSided && myrandomf(RNGen) < 0.5f) ? -S.normal : S.normal;
+		const vec3 D = SampleLobe(N, sqrtf(myrandomf(RNGen)), 2.0f * PI * myrandomf(RNGen));
+		cosN = dot(N, D);
+		pdfDir = cosN / PI / (twoSided ? 2.0f : 1.0f);
+		if (pdfDir <= 0.0f)
+			return 0;
+
+		ray = Ray(S.point, D);
+		pdfPos = 1.0f / area;
+
+		origin.I = S;
+		origin.pdfFwd = pmf * pdfPos;
+		Le = light->EvalRadiance(S);
+	}
+	origin.beta = Le / (pmf * pdfPos);
+
+	const int n = RandomWalk(ray, origin.beta * cosN / pdfDir, pdfDir, maxDepth, false, path + 1);
+
+	// The disk's density is already over area, so the first hit only
+	// foreshortens it.
+	if (origin.infinite && n > 0)
+		path[1].pdfFwd = pdfPos * abs(dot(path[1].I.normal, ray.D));
+
+	return n + 1;
+}
+
+// Extends the subpath ending at path[-1] along ray, which was sampled
+// with solid angle density pdf.  Camera walks keep the light they end
+// on; light walks stop short of one.
+int Bidirectional::RandomWalk(Ray ray, vec3 beta, float pdf, int maxVertices, bool camera, Vertex* path)
+{
+	int count = 0;
+	while (count < maxVertices)
+	{
+		const Intersection Q = tracer.Intersect(ray);
+		if (Q.object == nullptr || (Q.object->IsLight() && !camera))
+			break;
+
+		Vertex& prev = path[count - 1];
+		Vertex& v = path[count];
+		v = Vertex();
+		v.I = Q;
+		v.beta = beta;
+		v.infinite = Q.object == tracer.ibl;
+		v.pdfFwd = ConvertDensity(pdf, prev, v);
+		count++;
+
+		if (Q.object->IsLight())
+		{
+			v.type = VertexType::Light;
+			break;
+		}
+
+		v.Kd = Q.object->Diffuse(Q, 0.0f);
+		if (count == maxVertices)
+			break;
+
+		const vec3 omegaO = -ray.D;
+		const vec3 omegaI = Q.object->SampleBRDF(omegaO, Q.normal);
+		const vec3 f = Q.object->EvalBSDF(omegaO, Q.normal, omegaI, Q.t, v.Kd, pdf);
+		if (pdf < epsilon)
+			break;
+
+		// Roulette only rescales beta; the densities MIS compares stay as sampled.
+		const vec3 weight = f / pdf;
+		const float survival = (count > MinRouletteDepth) ? glm::clamp(Luminance(weight), 0.05f, 1.0f) : 1.0f;
+		if (myrandomf(RNGen) > survival)
+			break;
+		beta *= weight / survival;
+
+		float pdfRev;
+		Q.object->EvalBSDF(omegaI, Q.normal, omegaO, Q.t, v.Kd, pdfRev);
+		prev.pdfRev = ConvertDensity(pdfRev, v, prev);
+		ray = Ray(Q.point, omegaI);
+	}
+
+	return count;
+}
+
+vec3 Bidirectional::Connect(const Vertex* light, const Vertex* camera, int s, int t)
+{
+	const Vertex& pt = camera[t - 1];
+	Vertex sampled;
+	vec3 C(0);
+	if (s == 0)
+	{
+		// The camera subpath found a light by itself.
+		if (pt.type != VertexType::Light)
+			return vec3(0);
+		C = pt.beta * pt.I.object->EvalRadiance(pt.I);
+	}
+	else if (s == 1)
+	{
+		// A fresh light sample, as TraceRay's next event estimation
+		if (pt.type != VertexType::Surface)
+			return vec3(0);
+
+		float pdfLight;
+		const Intersection L = tracer.SampleLight(tracer.lightDistribution, pt.I, pdfLight);
+		if (L.object == nullptr || pdfLight <= 0.0f)
+			return vec3(0);
+
+		sampled.type = VertexType::Light;
+		sampled.I = L;
+		sampled.infinite = L.object == tracer.ibl;
+		const vec3 omegaI = Toward(pt, sampled);
+		float pdf;
+		const vec3 f = pt.I.object->EvalBSDF(Toward(pt, camera[t - 2]), pt.I.normal, omegaI, pt.I.t, pt.Kd, pdf);
+		C = pt.beta * f * L.object->EvalRadiance(L) / pdfLight;
+		if (C == vec3(0) || !tracer.IsVisible(pt.I, L))
+			return vec3(0);
+		sampled.pdfFwd = PdfLightOrigin(sampled, pt);
+	}
+	else
+	{
+		const Vertex& qs = light[s - 1];
+		if (pt.type != VertexType::Surface || qs.type != VertexType::Surface)
+			return vec3(0);
+
+		const vec3 D = pt.I.point - qs.I.point;
+		const float distance2 = dot(D, D);
+		if (distance2 <= 0.0f)
+			return vec3(0);
+		const vec3 omega = D / sqrtf(distance2);
+
+		const vec3 fq = Bsdf(qs, omega, Toward(qs, light[s - 2]));
+		const vec3 fp = Bsdf(pt, Toward(pt, camera[t - 2]), -omega);
+		const float G = abs(dot(qs.I.normal, omega)) * abs(dot(pt.I.normal, omega)) / distance2;
+		C = qs.beta * fq * G * fp * pt.beta;
+		if (C == vec3(0) || !Unoccluded(qs.I.point, pt.I.point))
+			return vec3(0);
+	}
+
+	return C * MISWeight(light, camera, sampled, s, t);
+}
+
+// Light tracing: the light subpath's last vertex seen by the camera
+void Bidirectional::Splat(const Vertex* light, const Vertex* camera, int s, int width, int height, Color* splat)
+{
+	if (s < 2)
+		return;
+	const Vertex& qs = light[s - 1];
+	if (qs.type != VertexType::Surface)
+		return;
+
+	const Vertex sampled = CameraVertex();
+	const vec3 D = qs.I.point - sampled.I.point;
+	const float distance2 = dot(D, D);
+	const vec3 omega = D / sqrtf(distance2);
+	const float cosTheta = dot(omega, sampled.I.normal);
+	if (cosTheta <= 0.0f)
+		return;
+
+	// Back through the image plane, inverting Scene::CameraRay
+	const Camera* cam = tracer.camera;
+	const vec3 onPlane = omega / cosTheta;
+	const float dx = dot(onPlane, cam->X) / dot(cam->X, cam->X);
+	const float dy = dot(onPlane, cam->Y) / dot(cam->Y, cam->Y);
+	const int x = (int)floorf(0.5f * (dx + 1.0f) * width);
+	const int y = (int)floorf(0.5f * (dy + 1.0f) * height);
+	if (x < 0 || x >= width || y < 0 || y >= height)
+		return;
+
+	const vec3 fq = Bsdf(qs, -omega, Toward(qs, light[s - 2]));
+	const vec3 C = qs.beta * fq * abs(dot(qs.I.normal, omega)) / distance2 * PdfCamera(omega);
+	if (C == vec3(0) || !Unoccluded(qs.I.point, sampled.I.point))
+		return;
+
+	splat[y * width + x] += C * MISWeight(light, camera, sampled, s, 1);
+}
+
+// Power heuristic over every (s, t) that could have built the same
+// path, as ratios of each strategy's density to this one's.  A
+// neighboring strategy differs only in which way the vertex at the
+// join was sampled, so the ratios build up one vertex at a time.
+float Bidirectional::MISWeight(const Vertex* light, const Vertex* camera, const Vertex& sampled, int s, int t)
+{
+	if (s + t == 2)
+		return 1.0f;
+
+	const Vertex* qs = (s == 1) ? &sampled : (s > 0) ? &light[s - 1] : nullptr;
+	const Vertex* pt = (t == 1) ? &sampled : &camera[t - 1];
+	const Vertex* qsMinus = (s > 1) ? &light[s - 2] : nullptr;
+	const Vertex* ptMinus = (t > 1) ? &camera[t - 2] : nullptr;
+
+	// Reverse densities at the join, which the subpaths could not know
+	const float ptRev = (s > 0) ? PdfDir(*qs, qsMinus, *pt) : PdfLightOrigin(*pt, *ptMinus);
+	const float ptMinusRev = (ptMinus == nullptr) ? 0.0f : (s > 0) ? PdfDir(*pt, qs, *ptMinus) : PdfLight(*pt, *ptMinus);
+	const float qsRev = (qs != nullptr) ? PdfDir(*pt, ptMinus, *qs) : 0.0f;
+	const float qsMinusRev = (qsMinus != nullptr) ? PdfDir(*qs, pt, *qsMinus) : 0.0f;
+
+	// Densities of zero stand for strategies that cannot occur and
+	// would otherwise zero every ratio past them.
+	auto remap = [](float pdf) { return (pdf != 0.0f) ? pdf : 1.0f; };
+
+	float sum = 0.0f;
+	float ratio = 1.0f;
+	for (int i = t - 1; i > 0; i--)
+	{
+		const Vertex& v = (i == t - 1) ? *pt : camera[i];
+		const float rev = (i == t - 1) ? ptRev : (i == t - 2) ? ptMinusRev : v.pdfRev;
+		ratio *= Square(remap(rev) / remap(v.pdfFwd));
+		sum += ratio;
+	}
+
+	ratio = 1.0f;
+	for (int i = s - 1; i >= 0; i--)
+	{
+		const Vertex& v = (i == s - 1) ? *qs : light[i];
+		const float rev = (i == s - 1) ? qsRev : (i == s - 2) ? qsMinusRev : v.pdfRev;
+		ratio *= Square(remap(rev) / remap(v.pdfFwd));
+		sum += ratio;
+	}
+
+	return 1.0f / (1.0f + sum);
+}
+
+bool Bidirectional::Unoccluded(const vec3& from, const vec3& to)
+{
+	const vec3 D = to - from;
+	const float distance = length(D);
+	const Intersection I = tracer.bvh->intersect(Ray(from, D / distance));
+	return I.object == nullptr || I.t >= (1.0f - 1e-3f) * distance;
+}
+
+// The BSDF alone, without EvalBSDF's cosine.  Joins can graze a
+// surface, where its microfacet terms would divide zero by zero.
+vec3 Bidirectional::Bsdf(const Vertex& v, const vec3& omegaO, const vec3& omegaI)
+{
+	const float cosI = abs(dot(v.I.normal, omegaI));
+	if (cosI <= 0.0f || dot(v.I.normal, omegaO) == 0.0f)
+		return vec3(0);
+
+	float pdf;
+	return v.I.object->EvalBSDF(omegaO, v.I.normal, omegaI, v.I.t, v.Kd, pdf) / cosI;
+}
+
+// Area density of next when sampled from v, having arrived from prev
+float Bidirectional::PdfDir(const Vertex& v, const Vertex* prev, const Vertex& next)
+{
+	if (v.type == VertexType::Light)
+		return PdfLight(v, next);
+
+	const vec3 omega = Toward(v, next);
+	if (v.type == VertexType::Camera)
+		return ConvertDensity(PdfCamera(omega), v, next);
+
+	float pdf;
+	v.I.object->EvalBSDF(Toward(v, *prev), v.I.normal, omega, v.I.t, v.Kd, pdf);
+	return ConvertDensity(pdf, v, next);
+}
+
+// Density of next when a light subpath leaves v toward it
+float Bidirectional::PdfLight(const Vertex& v, const Vertex& next)
+{
+	if (v.infinite)
+	{
+		const float R = tracer.lightDistribution.sceneRadius;
+		const float pdf = 1.0f / (PI * R * R);
+		return OnSurface(next) ? pdf * abs(dot(next.I.normal, v.I.normal)) : pdf;
+	}
+
+	const vec3 D = next.I.point - v.I.point;
+	const float distance2 = dot(D, D);
+	if (distance2 <= 0.0f)
+		return 0.0f;
+	const vec3 omega = D / sqrtf(distance2);
+
+	const bool twoSided = dynamic_cast<Triangle*>(v.I.object) != nullptr;
+	const float cosN = twoSided ? abs(dot(v.I.normal, omega)) : dot(v.I.normal, omega);
+	if (cosN <= 0.0f)
+		return 0.0f;
+
+	float pdf = cosN / PI / (twoSided ? 2.0f : 1.0f) / distance2;
+	if (OnSurface(next))
+		pdf *= abs(dot(next.I.normal, omega));
+	return pdf;
+}
+
+// Density of a light subpath starting at v, as LightSubpath samples it
+float Bidirectional::PdfLightOrigin(const Vertex& v, const Vertex& next)
+{
+	const LightDistribution& lights = tracer.lightDistribution;
+	Shape* light = v.I.object;
+	const float pmf = lights.Pdf(light);
+	if (v.infinite)
+		return pmf * light->PdfAsLight(next.I, v.I);
+
+	const float area = light->Area();
+	return (area > 0.0f) ? pmf / area : 0.0f;
+}
+
+// Solid angle density of the camera ray along direction; uniform over
+// the image plane at distance one, whose area is 4|X||Y|.
+float Bidirectional::PdfCamera(const vec3& direction) const
+{
+	const Camera* cam = tracer.camera;
+	const float cosTheta = -dot(direction, normalize(cam->Z));
+	if (cosTheta <= 0.0f)
+		return 0.0f;
+
+	const float filmArea = 4.0f * length(cam->X) * length(cam->Y);
+	return 1.0f / (filmArea * cosTheta * cosTheta * cosTheta);
+}
+
+Bidirectional::Vertex Bidirectional::CameraVertex() const
+{
+	Vertex v;
+	v.type = VertexType::Camera;
+	v.I.point = tracer.camera->eye;
+	v.I.normal = -normalize(tracer.camera->Z);
+	v.beta = vec3(1);
+	return v;
+}
+
+// Unit direction from one vertex toward another; the environment is
+// reached along its normal, reversed.
+vec3 Bidirectional::Toward(const Vertex& from, const Vertex& to)
+{
+	if (to.infinite)
+		return -to.I.normal;
+	if (from.infinite)
+		return from.I.normal;
+	return normalize(to.I.point - from.I.point);
+}
+
+// Solid angle density leaving from turned into area density at to
+float Bidirectional::ConvertDensity(float pdf, const Vertex& from, const Vertex& to)
+{
+	if (to.infinite)
+		return pdf;
+
+	const vec3 D = to.I.point - from.I.point;
+	const float distance2 = dot(D, D);
+	if (distance2 <= 0.0f)
+		return 0.0f;
+	if (OnSurface(to))
+		pdf *= abs(dot(to.I.normal, D)) / sqrtf(distance2);
+	return pdf / distance2;
+}
+
+bool Bidirectional::OnSurface(const Vertex& v)
+{
+	return v.type != VertexType::Camera && !v.infinite;
+}
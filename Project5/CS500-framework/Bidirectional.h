@@ -0,0 +1,72 @@
+#pragma once
+#include <vector>
+#include "geom.h"
+#include "Intersection.h"
+
+class Ray;
+class StaticRayTrace;
+struct FirstHit;
+
+////////////////////////////////////////////////////////////////////////
+// Bidirectional: bidirectional path tracing (Veach 1997, arranged as in
+// pbrt-v3).  Each camera ray is paired with a light subpath from a
+// light chosen by power, and every prefix of one is joined to every
+// prefix of the other.  Each joined path is weighted against all the
+// other ways of building it by the power heuristic; vertices keep the
+// area density of being sampled from either neighbor, so a weight is
+// one walk along the path.  Joins through the camera (light tracing)
+// land on other pixels and go to the caller's splat buffer.
+//
+// Lights absorb, as in TraceRay.  The environment is a light at
+// infinity whose photons leave a disk across the scene's bounding
+// sphere.
+////////////////////////////////////////////////////////////////////////
+class Bidirectional
+{
+public:
+	Bidirectional(StaticRayTrace& tracer, int maxDepth);
+
+	// Radiance along a camera ray; light tracing adds to splat, one
+	// Color per pixel of the width x height image.
+	vec3 Trace(const Ray& ray, int width, int height, Color* splat, FirstHit* first = nullptr);
+
+	int maxDepth;		// most bounces in a path
+
+private:
+	enum class VertexType { Camera, Light, Surface };
+
+	struct Vertex
+	{
+		VertexType type = VertexType::Surface;
+		Intersection I;
+		vec3 beta = vec3(0);	// throughput of the subpath up to here
+		vec3 Kd = vec3(0);
+		bool infinite = false;	// the environment
+		float pdfFwd = 0.0f;	// density of sampling this vertex from the one before
+		float pdfRev = 0.0f;	// and from the one after, walking the other way
+	};
+
+	static const int MinRouletteDepth = 3;
+
+	int CameraSubpath(const Ray& ray, Vertex* path);
+	int LightSubpath(Vertex* path);
+	int RandomWalk(Ray ray, vec3 beta, float pdf, int maxVertices, bool camera, Vertex* path);
+
+	vec3 Connect(const Vertex* light, const Vertex* camera, int s, int t);
+	void Splat(const Vertex* light, const Vertex* camera, int s, int width, int height, Color* splat);
+	float MISWeight(const Vertex* light, const Vertex* camera, const Vertex& sampled, int s, int t);
+
+	bool Unoccluded(const vec3& from, const vec3& to);
+	vec3 Bsdf(const Vertex& v, const vec3& omegaO, const vec3& omegaI);
+	float PdfDir(const Vertex& v, const Vertex* prev, const Vertex& next);
+	float PdfLight(const Vertex& v, const Vertex& next);
+	float PdfLightOrigin(const Vertex& v, const Vertex& next);
+	float PdfCamera(const vec3& direction) const;
+	Vertex CameraVertex() const;
+
+	static vec3 Toward(const Vertex& from, const Vertex& to);
+	static float ConvertDensity(float pdf, const Vertex& from, const Vertex& to);
+	static bool OnSurface(const Vertex& v);
+
+	StaticRayTrace& tracer;
+};
@@ -1,6 +1,7 @@
 #pragma once
 #include <glm/glm.hpp>
 #include "Auxiliary.h"
+#include "FastMath.h"
 #include "raytrace.h"
 
 vec3 AttenuationColor(vec3 omegaO, vec3 normal, vec3 Kt, float t);
@@ -23,21 +24,21 @@ inline float Transmission_Probability(vec3 omegaO, vec3 normal, vec3 omegaI, Mat
 	vec3 m = -normalize(etaO * omegaI + etaI * omegaO);
 
 	float omegaDotm = dot(omegaO, m);
-	const float r = 1.0f - powf(eta, 2) * (1.0f - powf(omegaDotm, 2));
+	const float r = 1.0f - Square(eta) * (1.0f - Square(omegaDotm));
 
 	if (r < epsilon)
 		return Reflection_Probability(omegaO, normal, omegaI, material);
 
 	float D = D_Factor(m, normal, material);
-	float numerator = powf(etaO, 2) * abs(dot(omegaI, m));
-	float denominator = powf((etaO * dot(omegaI, m) + etaI * dot(omegaO, m)), 2);
+	float numerator = Square(etaO) * abs(dot(omegaI, m));
+	float denominator = Square(etaO * dot(omegaI, m) + etaI * dot(omegaO, m));
 
 	return D * abs(dot(m, normal)) * (numerator / denominator);
 }
 
-inline vec3 Diffuse_EvalScattering(Material* material)
+inline vec3 Diffuse_EvalScattering(const vec3& Kd)
 {
-	return material->Kd / PI;
+	return Kd / PI;
 }
 
 inline vec3 Reflection_EvalScattering(vec3 omegaO, vec3 normal, vec3 omegaI, Material* material)
@@ -57,7 +58,7 @@ inline vec3 Transmission_EvalScattering(vec3 omegaO, vec3 normal, vec3 omegaI, M
 {
 	vec3 m = -normalize(etaO * omegaI + etaI * omegaO);
 	float omegaDotm = dot(omegaO, m);
-	const float r = 1.0f - powf(eta, 2) * (1.0f - powf(omegaDotm, 2));
+	const float r = 1.0f - Square(eta) * (1.0f - Square(omegaDotm));
 
 	vec3 attenuation = AttenuationColor(omegaO, normal, material->Kt, t);
 	if (r < epsilon)
@@ -70,8 +71,8 @@ inline vec3 Transmission_EvalScattering(vec3 omegaO, vec3 normal, vec3 omegaI, M
 	const vec3 numerator_left = D * G * (1.0f - F);
 	const float denominator_left = abs(dot(omegaI, normal)) * abs(dot(omegaO, normal));
 
-	float numerator_right = abs(dot(omegaI, m)) * abs(dot(omegaO, m)) * powf(etaO, 2);
-	float denominator_right = powf(etaO * dot(omegaI, m) + etaI * dot(omegaO, m), 2);
+	float numerator_right = abs(dot(omegaI, m)) * abs(dot(omegaO, m)) * Square(etaO);
+	float denominator_right = Square(etaO * dot(omegaI, m) + etaI * dot(omegaO, m));
 
 	return attenuation * (numerator_left / denominator_left) * (numerator_right / denominator_right);
 }
@@ -80,13 +81,8 @@ inline vec3 AttenuationColor(vec3 omegaO, vec3 normal, vec3 Kt, float t)
 {
 	float omegaDotN = dot(omegaO, normal);
 
-	vec3 result(1.0f);
 	if (omegaDotN < 0)
-	{
-		result.x = exp(t * log(Kt.x));
-		result.y = exp(t * log(Kt.y));
-		result.z = exp(t * log(Kt.z));
-	}
+		return FastExp(t * FastLog(Kt));
 
-	return result;
+	return vec3(1.0f);
 }
\ No newline at end of file
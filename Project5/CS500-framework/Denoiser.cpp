@@ -0,0 +1,280 @@
+#include "Denoiser.h"
+
+#include <algorithm>
+#include <emmintrin.h>
+#include "FastMath.h"
+#include "Helper.h"
+#include "StaticRayTrace.h"
+
+namespace
+{
+	const int Iterations = 5;
+	const float SigmaLuminance = 4.0f;
+	const float SigmaDepth = 1.0f;
+	const float MinAlbedo = 1e-3f;
+	const float Kernel[5] = { 1.0f / 16, 1.0f / 4, 3.0f / 8, 1.0f / 4, 1.0f / 16 };
+
+	__m128 Luminance4(__m128 r, __m128 g, __m128 b)
+	{
+		return _mm_add_ps(_mm_add_ps(_mm_mul_ps(r, _mm_set1_ps(0.2126f)), _mm_mul_ps(g, _mm_set1_ps(0.7152f))),
+			_mm_mul_ps(b, _mm_set1_ps(0.0722f)));
+	}
+
+	__m128 Abs4(__m128 x)
+	{
+		return _mm_andnot_ps(_mm_set1_ps(-0.0f), x);
+	}
+
+	// Four texels of a row starting at x; columns outside the image are clamped.
+	__m128 LoadRow(const float* row, int x, int width, bool interior)
+	{
+		if (interior)
+			return _mm_loadu_ps(row + x);
+
+		float v[4];
+		for (int l = 0; l < 4; l++)
+			v[l] = row[std::min(std::max(x + l, 0), width - 1)];
+		return _mm_loadu_ps(v);
+	}
+
+	// Planar buffers, each row padded to a multiple of four floats
+	struct Planes
+	{
+		int width, height, stride;
+		std::vector<float> nx, ny, nz, z, gradX, gradY;		// guides; fixed
+		std::vector<float> r, g, b, variance;				// filtered in place
+		std::vector<float> blurred;						// 3x3 blur of variance
+
+		Planes(int w, int h) : width(w), height(h), stride((w + 3) & ~3)
+		{
+			for (std::vector<float>* plane : { &nx, &ny, &nz, &z, &gradX, &gradY, &r, &g, &b, &variance, &blurred })
+				plane->assign((size_t)stride * height, 0.0f);
+		}
+	};
+
+	// The luminance weight is steered by a slightly smoothed variance.
+	void BlurVariance(Planes& planes)
+	{
+		const float k[3] = { 0.25f, 0.5f, 0.25f };
+#pragma omp parallel for schedule(dynamic, 8)
+		for (int y = 0; y < planes.height; y++)
+		{
+			for (int x = 0; x < planes.width; x++)
+			{
+				float sum = 0.0f;
+				for (int dy = -1; dy <= 1; dy++)
+				{
+					const int qy = std::min(std::max(y + dy, 0), planes.height - 1);
+					for (int dx = -1; dx <= 1; dx++)
+					{
+						const int qx = std::min(std::max(x + dx, 0), planes.width - 1);
+						sum += k[dy + 1] * k[dx + 1] * planes.variance[(size_t)qy * planes.stride + qx];
+					}
+				}
+				planes.blurred[(size_t)y * planes.stride + x] = sum;
+			}
+		}
+	}
+
+	// One a-trous level, four pixels of a row at a time
+	void FilterLevel(const Planes& in, Planes& out, int step)
+	{
+		const int width = in.width;
+		const int height = in.height;
+		const int stride = in.stride;
+
+#pragma omp parallel
+		{
+		// Weights far from an edge underflow; denormals would cost ~100 cycles each.
+		const unsigned int csr = _mm_getcsr();
+		_mm_setcsr(csr | 0x8040);	// flush to zero, denormals are zero
+
+#pragma omp for schedule(dynamic, 4)
+		for (int y = 0; y < height; y++)
+		{
+			for (int x = 0; x < width; x += 4)
+			{
+				const size_t p = (size_t)y * stride + x;
+				const __m128 nx = _mm_loadu_ps(&in.nx[p]);
+				const __m128 ny = _mm_loadu_ps(&in.ny[p]);
+				const __m128 nz = _mm_loadu_ps(&in.nz[p]);
+				const __m128 z = _mm_loadu_ps(&in.z[p]);
+				const __m128 gradX = _mm_loadu_ps(&in.gradX[p]);
+				const __m128 gradY = _mm_loadu_ps(&in.gradY[p]);
+				const __m128 luminance = Luminance4(_mm_loadu_ps(&in.r[p]), _mm_loadu_ps(&in.g[p]), _mm_loadu_ps(&in.b[p]));
+				const __m128 blurred = _mm_max_ps(_mm_loadu_ps(&in.blurred[p]), _mm_setzero_ps());
+				const __m128 invSigmaL = _mm_div_ps(_mm_set1_ps(1.0f),
+					_mm_add_ps(_mm_mul_ps(_mm_set1_ps(SigmaLuminance), _mm_sqrt_ps(blurred)), _mm_set1_ps(1e-6f)));
+				const __m128 depthSlack = _mm_add_ps(_mm_mul_ps(z, _mm_set1_ps(1e-3f)), _mm_set1_ps(1e-6f));
+				const __m128i lanes = _mm_add_epi32(_mm_set1_epi32(x), _mm_set_epi32(3, 2, 1, 0));
+
+				__m128 sumR = _mm_setzero_ps(), sumG = _mm_setzero_ps(), sumB = _mm_setzero_ps();
+				__m128 sumW = _mm_setzero_ps(), sumVariance = _mm_setzero_ps();
+
+				for (int dy = -2; dy <= 2; dy++)
+				{
+					const int qy = y + dy * step;
+					if (qy < 0 || qy >= height)
+						continue;
+					const size_t row = (size_t)qy * stride;
+
+					for (int dx = -2; dx <= 2; dx++)
+					{
+						const int qx = x + dx * step;
+						const bool interior = qx >= 0 && qx + 3 < width;
+
+						// Taps that fall off the image do not count.
+						__m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+						if (!interior)
+						{
+							const __m128i column = _mm_add_epi32(lanes, _mm_set1_epi32(dx * step));
+							inside = _mm_castsi128_ps(_mm_and_si128(_mm_cmpgt_epi32(column, _mm_set1_epi32(-1)),
+								_mm_cmplt_epi32(column, _mm_set1_epi32(width))));
+						}
+
+						const __m128 qr = LoadRow(&in.r[row], qx, width, interior);
+						const __m128 qg = LoadRow(&in.g[row], qx, width, interior);
+						const __m128 qb = LoadRow(&in.b[row], qx, width, interior);
+
+						// normal weight: max(0, n.nq)^128
+						__m128 wn = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, LoadRow(&in.nx[row], qx, width, interior)),
+							_mm_mul_ps(ny, LoadRow(&in.ny[row], qx, width, interior))), _mm_mul_ps(nz, LoadRow(&in.nz[row], qx, width, interior)));
+						wn = _mm_max_ps(wn, _mm_setzero_ps());
+						for (int i = 0; i < 7; i++)
+							wn = _mm_mul_ps(wn, wn);
+
+						// depth against the plane the center pixel's gradient predicts
+						const __m128 predicted = Abs4(_mm_add_ps(_mm_mul_ps(gradX, _mm_set1_ps((float)(dx * step))),
+							_mm_mul_ps(gradY, _mm_set1_ps((float)(dy * step)))));
+						const __m128 depthTerm = _mm_mul_ps(Abs4(_mm_sub_ps(z, LoadRow(&in.z[row], qx, width, interior))),
+							_mm_rcp_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(SigmaDepth), predicted), depthSlack)));
+						const __m128 luminanceTerm = _mm_mul_ps(Abs4(_mm_sub_ps(luminance, Luminance4(qr, qg, qb))), invSigmaL);
+
+						__m128 w = _mm_mul_ps(wn, Exp4(_mm_sub_ps(_mm_setzero_ps(), _mm_add_ps(depthTerm, luminanceTerm))));
+						w = _mm_and_ps(inside, _mm_mul_ps(w, _mm_set1_ps(Kernel[dx + 2] * Kernel[dy + 2])));
+
+						sumR = _mm_add_ps(sumR, _mm_mul_ps(w, qr));
+						sumG = _mm_add_ps(sumG, _mm_mul_ps(w, qg));
+						sumB = _mm_add_ps(sumB, _mm_mul_ps(w, qb));
+						sumW = _mm_add_ps(sumW, w);
+						sumVariance = _mm_add_ps(sumVariance, _mm_mul_ps(_mm_mul_ps(w, w), LoadRow(&in.variance[row], qx, width, interior)));
+					}
+				}
+
+				// The center tap always has weight, so sumW > 0 for pixels in the image.
+				const __m128 invW = _mm_div_ps(_mm_set1_ps(1.0f), sumW);
+				_mm_storeu_ps(&out.r[p], _mm_mul_ps(sumR, invW));
+				_mm_storeu_ps(&out.g[p], _mm_mul_ps(sumG, invW));
+				_mm_storeu_ps(&out.b[p], _mm_mul_ps(sumB, invW));
+				_mm_storeu_ps(&out.variance[p], _mm_mul_ps(sumVariance, _mm_mul_ps(invW, invW)));
+			}
+		}
+
+		_mm_setcsr(csr);
+		}
+	}
+}
+
+Denoiser::Denoiser(int width, int height)
+	: width(width), height(height),
+	albedo((size_t)width * height, Color(0)), normal((size_t)width * height, Color(0)),
+	depth((size_t)width * height, 0.0f), luminanceSq((size_t)width * height, 0.0f)
+{
+}
+
+void Denoiser::Add(int pixel, const Color& color, const FirstHit& hit)
+{
+	albedo[pixel] += hit.albedo;
+	normal[pixel] += hit.normal;
+	depth[pixel] += hit.depth;
+	luminanceSq[pixel] += Square(Luminance(color));
+}
+
+Color Denoiser::Normal(int pixel) const
+{
+	const float length2 = dot(normal[pixel], normal[pixel]);
+	return (length2 > 0.0f) ? normal[pixel] / sqrtf(length2) : Color(0, 0, 1);
+}
+
+// Variance of the pixel's mean luminance
+float Denoiser::Variance(const Color* image, int pixel, int passes) const
+{
+	const float mean = Luminance(image[pixel]) / passes;
+	if (passes < 2)
+		return Square(mean);
+
+	const float spread = std::max(0.0f, luminanceSq[pixel] / passes - Square(mean));
+	return spread / (passes - 1);
+}
+
+void Denoiser::Run(const Color* image, int passes, Color* out) const
+{
+	Planes planes(width, height), next(width, height);
+	const int stride = planes.stride;
+
+	// Filter incident light rather than color, so albedo edges stay sharp.
+#pragma omp parallel for schedule(dynamic, 8)
+	for (int y = 0; y < height; y++)
+	{
+		for (int x = 0; x < width; x++)
+		{
+			const int pixel = y * width + x;
+			const size_t p = (size_t)y * stride + x;
+			const Color a = glm::max(Albedo(pixel, passes), Color(MinAlbedo));
+			const Color c = image[pixel] / (float)passes / a;
+			const Color n = Normal(pixel);
+			planes.r[p] = c.r;
+			planes.g[p] = c.g;
+			planes.b[p] = c.b;
+			planes.variance[p] = Variance(image, pixel, passes) / Square(Luminance(a));
+			planes.nx[p] = n.x;
+			planes.ny[p] = n.y;
+			planes.nz[p] = n.z;
+			planes.z[p] = Depth(pixel, passes);
+		}
+	}
+
+	// Depth gradient from the smaller one-sided difference, so silhouettes do not inflate it
+#pragma omp parallel for schedule(dynamic, 8)
+	for (int y = 0; y < height; y++)
+	{
+		for (int x = 0; x < width; x++)
+		{
+			const float* z = &planes.z[(size_t)y * stride];
+			const float left = (x > 0) ? z[x] - z[x - 1] : 0.0f;
+			const float right = (x + 1 < width) ? z[x + 1] - z[x] : 0.0f;
+			const float down = (y > 0) ? z[x] - z[x - stride] : 0.0f;
+			const float up = (y + 1 < height) ? z[x + stride] - z[x] : 0.0f;
+			planes.gradX[(size_t)y * stride + x] = (abs(left) < abs(right) || x + 1 == width) ? left : right;
+			planes.gradY[(size_t)y * stride + x] = (abs(down) < abs(up) || y + 1 == height) ? down : up;
+		}
+	}
+	next.nx = planes.nx;
+	next.ny = planes.ny;
+	next.nz = planes.nz;
+	next.z = planes.z;
+	next.gradX = planes.gradX;
+	next.gradY = planes.gradY;
+
+	for (int i = 0; i < Iterations; i++)
+	{
+		BlurVariance(planes);
+		FilterLevel(planes, next, 1 << i);
+		std::swap(planes.r, next.r);
+		std::swap(planes.g, next.g);
+		std::swap(planes.b, next.b);
+		std::swap(planes.variance, next.variance);
+	}
+
+#pragma omp parallel for schedule(dynamic, 8)
+	for (int y = 0; y < height; y++)
+	{
+		for (int x = 0; x < width; x++)
+		{
+			const int pixel = y * width + x;
+			const size_t p = (size_t)y * stride + x;
+			const Color a = glm::max(Albedo(pixel, passes), Color(MinAlbedo));
+			out[pixel] = Color(planes.r[p], planes.g[p], planes.b[p]) * a;
+		}
+	}
+}
@@ -0,0 +1,41 @@
+#pragma once
+#include <vector>
+#include "geom.h"
+
+struct FirstHit;
+
+////////////////////////////////////////////////////////////////////////
+// Denoiser: an edge-avoiding a-trous wavelet filter (Dammertz et al.
+// 2010, with the variance-driven luminance weight of SVGF) run once
+// after the last pass.
+//
+// While rendering, Add() sums each sample's first-hit albedo, normal
+// and depth, plus the squared luminance for the per-pixel variance.
+// Run() divides the image by albedo, filters it five times with the
+// 5x5 B3-spline kernel at step 1, 2, 4, 8, 16, dropping taps across
+// normal, depth and (relative to the local noise) luminance edges,
+// then multiplies the albedo back in so texture detail is untouched.
+////////////////////////////////////////////////////////////////////////
+class Denoiser
+{
+public:
+	Denoiser(int width, int height);
+
+	// Pixels are independent, so threads may add different pixels at once.
+	void Add(int pixel, const Color& color, const FirstHit& hit);
+
+	// image holds sums over passes; out receives the filtered mean.
+	void Run(const Color* image, int passes, Color* out) const;
+
+	// Means of the feature buffers, for writing out
+	Color Albedo(int pixel, int passes) const { return albedo[pixel] / (float)passes; }
+	Color Normal(int pixel) const;
+	float Depth(int pixel, int passes) const { return depth[pixel] / passes; }
+	float Variance(const Color* image, int pixel, int passes) const;
+
+	int width, height;
+
+private:
+	std::vector<Color> albedo, normal;
+	std::vector<float> depth, luminanceSq;
+};
@@ -0,0 +1,184 @@
+#pragma once
+#include <cmath>
+#include <emmintrin.h>
+#include "geom.h"
+
+////////////////////////////////////////////////////////////////////////
+// Fast math: integer powers plus polynomial approximations of the
+// transcendental functions used by the BSDF and IBL kernels.
+//
+// The *4 functions work on four floats at once (SSE2) and are always the
+// approximations.  The Fast* functions use them when the build defines
+// RAYTRACE_FAST_MATH, and fall back to libm otherwise.  Scalar exp and
+// log stay on libm in both builds: expf/logf are already table driven
+// and beat a single-lane polynomial, so only the vec3 versions go wide.
+//
+// Maximum error against libm over the ranges the kernels use, as
+// checked by tests/FastMathTest.cpp:
+//   Exp4    relative 1.2e-7    (x in [-87, 88])
+//   Log4    absolute 7.7e-6    (x in [1e-30, 1e30])
+//   Atan2_4 absolute 2.0e-6 rad
+//   Acos4   absolute 4.8e-7 rad  (x in [-1, 1])
+//   Rsqrt4  relative 3e-7      (one Newton step)
+////////////////////////////////////////////////////////////////////////
+
+inline float Square(float x)
+{
+	return x * x;
+}
+
+inline float Pow5(float x)
+{
+	const float x2 = x * x;
+	return x2 * x2 * x;
+}
+
+inline __m128 Exp4(__m128 x)
+{
+	x = _mm_min_ps(_mm_max_ps(x, _mm_set1_ps(-87.3f)), _mm_set1_ps(88.3f));
+
+	// x = n*ln(2) + r,  |r| <= ln(2)/2
+	__m128 fx = _mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(1.44269504f)), _mm_set1_ps(0.5f));
+	__m128 n = _mm_cvtepi32_ps(_mm_cvttps_epi32(fx));
+	n = _mm_sub_ps(n, _mm_and_ps(_mm_cmpgt_ps(n, fx), _mm_set1_ps(1.0f)));
+	__m128 r = _mm_sub_ps(x, _mm_mul_ps(n, _mm_set1_ps(0.693359375f)));
+	r = _mm_sub_ps(r, _mm_mul_ps(n, _mm_set1_ps(-2.12194440e-4f)));
+
+	__m128 p = _mm_set1_ps(1.9875691500e-4f);
+	p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(1.3981999507e-3f));
+	p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(8.3334519073e-3f));
+	p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(4.1665795894e-2f));
+	p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(1.6666665459e-1f));
+	p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(5.0000001201e-1f));
+	p = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(p, r), r), _mm_add_ps(r, _mm_set1_ps(1.0f)));
+
+	// scale by 2^n through the exponent bits
+	__m128i e = _mm_add_epi32(_mm_cvttps_epi32(n), _mm_set1_epi32(127));
+	return _mm_mul_ps(p, _mm_castsi128_ps(_mm_slli_epi32(e, 23)));
+}
+
+// Returns -inf for x <= 0.
+inline __m128 Log4(__m128 x)
+{
+	const __m128 invalid = _mm_cmple_ps(x, _mm_setzero_ps());
+	x = _mm_max_ps(x, _mm_castsi128_ps(_mm_set1_epi32(0x00800000)));
+
+	// x = m * 2^e,  m in [0.5, 1)
+	__m128i bits = _mm_castps_si128(x);
+	__m128 e = _mm_cvtepi32_ps(_mm_sub_epi32(_mm_srli_epi32(bits, 23), _mm_set1_epi32(126)));
+	bits = _mm_or_si128(_mm_and_si128(bits, _mm_set1_epi32(0x007fffff)), _mm_set1_epi32(0x3f000000));
+	__m128 m = _mm_castsi128_ps(bits);
+
+	// shift m into [sqrt(0.5), sqrt(2)) and subtract one
+	const __m128 small = _mm_cmplt_ps(m, _mm_set1_ps(0.707106781f));
+	e = _mm_sub_ps(e, _mm_and_ps(small, _mm_set1_ps(1.0f)));
+	m = _mm_sub_ps(_mm_add_ps(m, _mm_and_ps(small, m)), _mm_set1_ps(1.0f));
+
+	const __m128 z = _mm_mul_ps(m, m);
+	__m128 p = _mm_set1_ps(7.0376836292e-2f);
+	p = _mm_add_ps(_mm_mul_ps(p, m), _mm_set1_ps(-1.1514610310e-1f));
+	p = _mm_add_ps(_mm_mul_ps(p, m), _mm_set1_ps(1.1676998740e-1f));
+	p = _mm_add_ps(_mm_mul_ps(p, m), _mm_set1_ps(-1.2420140846e-1f));
+	p = _mm_add_ps(_mm_mul_ps(p, m), _mm_set1_ps(1.4249322787e-1f));
+	p = _mm_add_ps(_mm_mul_ps(p, m), _mm_set1_ps(-1.6668057665e-1f));
+	p = _mm_add_ps(_mm_mul_ps(p, m), _mm_set1_ps(2.0000714765e-1f));
+	p = _mm_add_ps(_mm_mul_ps(p, m), _mm_set1_ps(-2.4999993993e-1f));
+	p = _mm_add_ps(_mm_mul_ps(p, m), _mm_set1_ps(3.3333331174e-1f));
+
+	__m128 y = _mm_mul_ps(_mm_mul_ps(p, m), z);
+	y = _mm_add_ps(y, _mm_mul_ps(e, _mm_set1_ps(-2.12194440e-4f)));
+	y = _mm_sub_ps(y, _mm_mul_ps(z, _mm_set1_ps(0.5f)));
+	y = _mm_add_ps(_mm_add_ps(m, y), _mm_mul_ps(e, _mm_set1_ps(0.693359375f)));
+
+	return _mm_or_ps(_mm_andnot_ps(invalid, y), _mm_and_ps(invalid, _mm_set1_ps(-INFINITY)));
+}
+
+inline __m128 Atan2_4(__m128 y, __m128 x)
+{
+	const __m128 signMask = _mm_set1_ps(-0.0f);
+	const __m128 ax = _mm_andnot_ps(signMask, x);
+	const __m128 ay = _mm_andnot_ps(signMask, y);
+
+	// atan of the ratio in [0, 1]
+	const __m128 hi = _mm_max_ps(ax, ay);
+	const __m128 lo = _mm_min_ps(ax, ay);
+	const __m128 nonZero = _mm_cmpgt_ps(hi, _mm_setzero_ps());
+	const __m128 t = _mm_and_ps(nonZero, _mm_div_ps(lo, _mm_or_ps(hi, _mm_andnot_ps(nonZero, _mm_set1_ps(1.0f)))));
+	const __m128 t2 = _mm_mul_ps(t, t);
+
+	__m128 p = _mm_set1_ps(-0.01172120f);
+	p = _mm_add_ps(_mm_mul_ps(p, t2), _mm_set1_ps(0.05265332f));
+	p = _mm_add_ps(_mm_mul_ps(p, t2), _mm_set1_ps(-0.11643287f));
+	p = _mm_add_ps(_mm_mul_ps(p, t2), _mm_set1_ps(0.19354346f));
+	p = _mm_add_ps(_mm_mul_ps(p, t2), _mm_set1_ps(-0.33262347f));
+	p = _mm_add_ps(_mm_mul_ps(p, t2), _mm_set1_ps(0.99997726f));
+	__m128 r = _mm_mul_ps(p, t);
+
+	// undo the octant reduction
+	const __m128 swap = _mm_cmpgt_ps(ay, ax);
+	r = _mm_or_ps(_mm_andnot_ps(swap, r), _mm_and_ps(swap, _mm_sub_ps(_mm_set1_ps(1.57079633f), r)));
+	const __m128 negX = _mm_cmplt_ps(x, _mm_setzero_ps());
+	r = _mm_or_ps(_mm_andnot_ps(negX, r), _mm_and_ps(negX, _mm_sub_ps(_mm_set1_ps(3.14159265f), r)));
+	return _mm_or_ps(r, _mm_and_ps(signMask, y));
+}
+
+inline __m128 Acos4(__m128 x)
+{
+	const __m128 signMask = _mm_set1_ps(-0.0f);
+	const __m128 ax = _mm_min_ps(_mm_andnot_ps(signMask, x), _mm_set1_ps(1.0f));
+
+	// Abramowitz & Stegun 4.4.46
+	__m128 p = _mm_set1_ps(-0.0012624911f);
+	p = _mm_add_ps(_mm_mul_ps(p, ax), _mm_set1_ps(0.0066700901f));
+	p = _mm_add_ps(_mm_mul_ps(p, ax), _mm_set1_ps(-0.0170881256f));
+	p = _mm_add_ps(_mm_mul_ps(p, ax), _mm_set1_ps(0.0308918810f));
+	p = _mm_add_ps(_mm_mul_ps(p, ax), _mm_set1_ps(-0.0501743046f));
+	p = _mm_add_ps(_mm_mul_ps(p, ax), _mm_set1_ps(0.0889789874f));
+	p = _mm_add_ps(_mm_mul_ps(p, ax), _mm_set1_ps(-0.2145988016f));
+	p = _mm_add_ps(_mm_mul_ps(p, ax), _mm_set1_ps(1.5707963050f));
+	const __m128 r = _mm_mul_ps(p, _mm_sqrt_ps(_mm_sub_ps(_mm_set1_ps(1.0f), ax)));
+
+	const __m128 neg = _mm_cmplt_ps(x, _mm_setzero_ps());
+	return _mm_or_ps(_mm_andnot_ps(neg, r), _mm_and_ps(neg, _mm_sub_ps(_mm_set1_ps(3.14159265f), r)));
+}
+
+inline __m128 Rsqrt4(__m128 x)
+{
+	const __m128 y = _mm_rsqrt_ps(x);
+	const __m128 xyy = _mm_mul_ps(_mm_mul_ps(x, y), y);
+	return _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(0.5f), y), _mm_sub_ps(_mm_set1_ps(3.0f), xyy));
+}
+
+inline float FastExp(float x) { return expf(x); }
+inline float FastLog(float x) { return logf(x); }
+
+#ifdef RAYTRACE_FAST_MATH
+
+inline float FastAtan2(float y, float x) { return _mm_cvtss_f32(Atan2_4(_mm_set_ss(y), _mm_set_ss(x))); }
+inline float FastAcos(float x) { return _mm_cvtss_f32(Acos4(_mm_set_ss(x))); }
+inline float FastRsqrt(float x) { return _mm_cvtss_f32(Rsqrt4(_mm_set_ss(x))); }
+
+inline vec3 FastExp(const vec3& v)
+{
+	float r[4];
+	_mm_storeu_ps(r, Exp4(_mm_setr_ps(v.x, v.y, v.z, 0.0f)));
+	return vec3(r[0], r[1], r[2]);
+}
+
+inline vec3 FastLog(const vec3& v)
+{
+	float r[4];
+	_mm_storeu_ps(r, Log4(_mm_setr_ps(v.x, v.y, v.z, 1.0f)));
+	return vec3(r[0], r[1], r[2]);
+}
+
+#else
+
+inline float FastAtan2(float y, float x) { return atan2f(y, x); }
+inline float FastAcos(float x) { return acosf(x); }
+inline float FastRsqrt(float x) { return 1.0f / sqrtf(x); }
+
+inline vec3 FastExp(const vec3& v) { return vec3(expf(v.x), expf(v.y), expf(v.z)); }
+inline vec3 FastLog(const vec3& v) { return vec3(logf(v.x), logf(v.y), logf(v.z)); }
+
+#endif
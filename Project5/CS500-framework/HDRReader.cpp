@@ -1,182 +1,243 @@
 #include "HDRReader.h"
 
 #include <math.h>
-#include <memory.h>
 #include <stdio.h>
-
-typedef unsigned char RGBE[4];
-#define R			0
-#define G			1
-#define B			2
-#define E			3
+#include <string.h>
+#include <vector>
 
 #define  MINELEN	8				// minimum scanline length for encoding
 #define  MAXELEN	0x7fff			// maximum scanline length for encoding
 
-static void workOnRGBE(RGBE* scan, int len, float* cols);
-static bool decrunch(RGBE* scanline, int len, FILE* file);
-static bool oldDecrunch(RGBE* scanline, int len, FILE* file);
+typedef unsigned char byte;
+
+static bool readFile(const char* fileName, std::vector<byte>& bytes);
+static const byte* parseHeader(const byte* p, const byte* end, int& w, int& h);
+static const byte* skipScanline(const byte* p, const byte* end, int len);
+static bool decrunch(const byte* p, const byte* end, int len, byte* planes[4]);
+static bool oldDecrunch(const byte* p, const byte* end, int len, byte* planes[4]);
+static void workOnRGBE(byte* const planes[4], int len, float* cols);
 
 bool HDRReader::load(const char* fileName, HDRResult& res)
 {
-	int i;
-	char str[200];
-	FILE* file;
-
-	file = fopen(fileName, "rb");
-	if (!file)
+	std::vector<byte> bytes;
+	if (!readFile(fileName, bytes))
 		return false;
 
-	fread(str, 10, 1, file);
-	if (memcmp(str, "#?RADIANCE", 10)) {
-		fclose(file);
+	const byte* end = bytes.data() + bytes.size();
+	int w, h;
+	const byte* p = parseHeader(bytes.data(), end, w, h);
+	if (!p)
 		return false;
-	}
 
-	fseek(file, 1, SEEK_CUR);
-
-	char cmd[200];
-	i = 0;
-	char c = 0, oldc;
-	while (true) {
-		oldc = c;
-		c = fgetc(file);
-		if (c == 0xa && oldc == 0xa)
-			break;
-		cmd[i++] = c;
+	// Scanlines have no stored length, so one cheap pass finds where each begins.
+	std::vector<const byte*> starts(h + 1);
+	starts[0] = p;
+	for (int y = 0; y < h; y++) {
+		starts[y + 1] = skipScanline(starts[y], end, w);
+		if (!starts[y + 1])
+			return false;
 	}
 
-	char reso[200];
-	i = 0;
-	while (true) {
-		c = fgetc(file);
-		reso[i++] = c;
-		if (c == 0xa)
-			break;
+	float* cols = new float[(size_t)w * h * 3];
+
+	// Scanlines decode independently once their starts are known.
+	int failed = 0;
+#pragma omp parallel reduction(+:failed)
+	{
+		std::vector<byte> scanline(4 * (size_t)w);
+		byte* planes[4] = { &scanline[0], &scanline[w], &scanline[2 * w], &scanline[3 * w] };
+
+#pragma omp for schedule(dynamic, 16)
+		for (int y = 0; y < h; y++) {
+			if (!decrunch(starts[y], starts[y + 1], w, planes)) {
+				failed++;
+				continue;
+			}
+			workOnRGBE(planes, w, cols + (size_t)y * w * 3);
+		}
 	}
 
-	int w, h;
-	if (!sscanf(reso, "-Y %ld +X %ld", &h, &w)) {
-		fclose(file);
+	if (failed) {
+		delete[] cols;
 		return false;
 	}
 
 	res.width = w;
 	res.height = h;
-
-	float* cols = new float[w * h * 3];
 	res.cols = cols;
+	return true;
+}
 
-	RGBE* scanline = new RGBE[w];
-	if (!scanline) {
-		fclose(file);
+// One large read instead of a call per byte
+bool readFile(const char* fileName, std::vector<byte>& bytes)
+{
+	FILE* file = fopen(fileName, "rb");
+	if (!file)
 		return false;
-	}
 
-	// convert image 
-	for (int y = h - 1; y >= 0; y--) {
-		if (decrunch(scanline, w, file) == false)
-			break;
-		workOnRGBE(scanline, w, cols);
-		cols += w * 3;
+	fseek(file, 0, SEEK_END);
+	long size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	if (size <= 0) {
+		fclose(file);
+		return false;
 	}
 
-	delete[] scanline;
+	bytes.resize(size);
+	size_t count = fread(bytes.data(), 1, size, file);
 	fclose(file);
-
-	return true;
+	return count == (size_t)size;
 }
 
-float convertComponent(int expo, int val)
+// Returns the first byte of pixel data
+const byte* parseHeader(const byte* p, const byte* end, int& w, int& h)
 {
-	float v = val / 256.0f;
-	float d = (float)pow(2, expo);
-	return v * d;
+	if (end - p < 10 || memcmp(p, "#?RADIANCE", 10))
+		return nullptr;
+
+	// The header ends with an empty line.
+	p += 10;
+	while (p + 1 < end && !(p[0] == 0xa && p[1] == 0xa))
+		p++;
+	p += 2;
+	if (p >= end)
+		return nullptr;
+
+	char reso[200];
+	int i = 0;
+	while (p < end && *p != 0xa && i < (int)sizeof(reso) - 1)
+		reso[i++] = *p++;
+	reso[i] = 0;
+	if (p >= end || *p != 0xa)
+		return nullptr;
+
+	if (sscanf(reso, "-Y %d +X %d", &h, &w) != 2 || w <= 0 || h <= 0)
+		return nullptr;
+
+	return p + 1;
 }
 
-void workOnRGBE(RGBE* scan, int len, float* cols)
+static bool isNewRLE(const byte* p, const byte* end, int len)
 {
-	while (len-- > 0) {
-		int expo = scan[0][E] - 128;
-		cols[0] = convertComponent(expo, scan[0][R]);
-		cols[1] = convertComponent(expo, scan[0][G]);
-		cols[2] = convertComponent(expo, scan[0][B]);
-		cols += 3;
-		scan++;
-	}
+	return len >= MINELEN && len <= MAXELEN && end - p >= 4
+		&& p[0] == 2 && p[1] == 2 && !(p[2] & 128);
 }
 
-bool decrunch(RGBE* scanline, int len, FILE* file)
+// Walks one scanline without decoding it; returns where the next begins.
+const byte* skipScanline(const byte* p, const byte* end, int len)
 {
-	int  i, j;
-
-	if (len < MINELEN || len > MAXELEN)
-		return oldDecrunch(scanline, len, file);
-
-	i = fgetc(file);
-	if (i != 2) {
-		fseek(file, -1, SEEK_CUR);
-		return oldDecrunch(scanline, len, file);
+	if (isNewRLE(p, end, len)) {
+		p += 4;
+		for (int i = 0; i < 4; i++) {
+			for (int j = 0; j < len; ) {
+				if (p >= end)
+					return nullptr;
+				int code = *p++;
+				if (code > 128) {
+					code &= 127;
+					p += 1;
+				}
+				else
+					p += code;
+				j += code;
+				if (code == 0 || j > len)
+					return nullptr;
+			}
+		}
+		return (p <= end) ? p : nullptr;
 	}
 
-	scanline[0][G] = fgetc(file);
-	scanline[0][B] = fgetc(file);
-	i = fgetc(file);
-
-	if (scanline[0][G] != 2 || scanline[0][B] & 128) {
-		scanline[0][R] = 2;
-		scanline[0][E] = i;
-		return oldDecrunch(scanline + 1, len - 1, file);
+	int rshift = 0;
+	int j = 0;
+	while (j < len) {
+		if (end - p < 4)
+			return nullptr;
+		if (p[0] == 1 && p[1] == 1 && p[2] == 1) {
+			if (j == 0)
+				return nullptr;
+			j += p[3] << rshift;
+			rshift += 8;
+		}
+		else {
+			j++;
+			rshift = 0;
+		}
+		p += 4;
 	}
+	return (j == len) ? p : nullptr;
+}
 
-	// read each component
-	for (i = 0; i < 4; i++) {
-		for (j = 0; j < len; ) {
-			unsigned char code = fgetc(file);
-			if (code > 128) { // run
+// Expands one scanline into separate R, G, B and E planes.
+bool decrunch(const byte* p, const byte* end, int len, byte* planes[4])
+{
+	if (!isNewRLE(p, end, len))
+		return oldDecrunch(p, end, len, planes);
+
+	p += 4;
+	for (int i = 0; i < 4; i++) {
+		byte* plane = planes[i];
+		for (int j = 0; j < len; ) {
+			int code = *p++;
+			if (code > 128) {	// run
 				code &= 127;
-				unsigned char val = fgetc(file);
-				while (code--)
-					scanline[j++][i] = val;
+				memset(plane + j, *p++, code);
 			}
 			else {	// non-run
-				while (code--)
-					scanline[j++][i] = fgetc(file);
+				memcpy(plane + j, p, code);
+				p += code;
 			}
+			j += code;
 		}
 	}
 
-	return feof(file) ? false : true;
+	return p == end;
 }
 
-bool oldDecrunch(RGBE* scanline, int len, FILE* file)
+bool oldDecrunch(const byte* p, const byte* end, int len, byte* planes[4])
 {
-	int i;
 	int rshift = 0;
-
-	while (len > 0) {
-		scanline[0][R] = fgetc(file);
-		scanline[0][G] = fgetc(file);
-		scanline[0][B] = fgetc(file);
-		scanline[0][E] = fgetc(file);
-		if (feof(file))
-			return false;
-
-		if (scanline[0][R] == 1 &&
-			scanline[0][G] == 1 &&
-			scanline[0][B] == 1) {
-			for (i = scanline[0][E] << rshift; i > 0; i--) {
-				memcpy(&scanline[0][0], &scanline[-1][0], 4);
-				scanline++;
-				len--;
-			}
+	int j = 0;
+
+	while (j < len) {
+		if (p[0] == 1 && p[1] == 1 && p[2] == 1) {
+			int count = p[3] << rshift;
+			for (int i = 0; i < 4; i++)
+				memset(planes[i] + j, planes[i][j - 1], count);
+			j += count;
 			rshift += 8;
 		}
 		else {
-			scanline++;
-			len--;
+			for (int i = 0; i < 4; i++)
+				planes[i][j] = p[i];
+			j++;
 			rshift = 0;
 		}
+		p += 4;
+	}
+	return p == end;
+}
+
+// Mantissa * 2^(E - 136), i.e. (mantissa / 256) * 2^(E - 128), looked up per exponent
+static struct ExponentTable {
+	float scale[256];
+	ExponentTable() {
+		for (int e = 0; e < 256; e++)
+			scale[e] = ldexpf(1.0f, e - 136);
+	}
+} exponentTable;
+
+void workOnRGBE(byte* const planes[4], int len, float* cols)
+{
+	const float* table = exponentTable.scale;
+	const byte* r = planes[0];
+	const byte* g = planes[1];
+	const byte* b = planes[2];
+	const byte* e = planes[3];
+
+	for (int x = 0; x < len; x++) {
+		const float scale = table[e[x]];
+		cols[3 * x + 0] = r[x] * scale;
+		cols[3 * x + 1] = g[x] * scale;
+		cols[3 * x + 2] = b[x] * scale;
 	}
-	return true;
 }
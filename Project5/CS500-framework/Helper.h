@@ -3,10 +3,37 @@
 
 inline float epsilon = 0.0001f;
 
-// A good quality *thread-safe* Mersenne Twister random number generator.
+#include <atomic>
+#include <cstdint>
 #include <random>
 inline std::random_device device;
-inline std::mt19937_64 RNGen(device());
+
+// Stands in for the engine when set, e.g. to replay a path from a
+// vector of primary samples.
+class SampleStream
+{
+public:
+	virtual uint64_t Next() = 0;
+
+protected:
+	~SampleStream() = default;
+};
+
+// Every random number comes from here: a Mersenne Twister, unless the
+// calling thread has set a SampleStream in its place.
+class RandomSource
+{
+public:
+	using result_type = uint64_t;
+	static constexpr result_type min() { return 0; }
+	static constexpr result_type max() { return ~result_type(0); }
+	result_type operator()() { return (stream != nullptr) ? stream->Next() : engine(); }
+
+	std::mt19937_64 engine{ device() };
+	static inline thread_local SampleStream* stream = nullptr;
+};
+
+inline RandomSource RNGen;
 inline std::uniform_real_distribution<float> myrandomf(0.0f, 1.0f);
 inline std::uniform_real_distribution<double> myrandomd(0.0, 1.0);
 
@@ -14,4 +41,17 @@ inline int GetRandomIndex(int size)
 {
 	std::uniform_int_distribution<int> distribution(0, size - 1);
 	return distribution(RNGen);
-}
\ No newline at end of file
+}
+
+inline float Luminance(const glm::vec3& color)
+{
+	return 0.2126f * color.x + 0.7152f * color.y + 0.0722f * color.z;
+}
+
+// Adds to a float any thread may be adding to at once
+inline void AtomicAdd(std::atomic<float>& sum, float value)
+{
+	float old = sum.load(std::memory_order_relaxed);
+	while (!sum.compare_exchange_weak(old, old + value, std::memory_order_relaxed))
+		;
+}
@@ -12,4 +12,5 @@ public:
 	float t = std::numeric_limits<float>::infinity();
 	vec3 point = vec3(0);
 	vec3 normal = vec3(0);
+	vec2 uv = vec2(0);
 };
\ No newline at end of file
@@ -0,0 +1,271 @@
+#include "LightBvh.h"
+
+#include <algorithm>
+#include "FastMath.h"
+#include "Shape.h"
+
+namespace
+{
+	float SafeSqrt(float x)
+	{
+		return sqrtf(std::max(0.0f, x));
+	}
+
+	float SafeAcos(float x)
+	{
+		return acosf(glm::clamp(x, -1.0f, 1.0f));
+	}
+
+	// cos(max(0, a - b)) and sin(max(0, a - b)) from the sines and cosines of a and b
+	float CosSubClamped(float sinA, float cosA, float sinB, float cosB)
+	{
+		if (cosA > cosB)
+			return 1.0f;
+		return cosA * cosB + sinA * sinB;
+	}
+
+	float SinSubClamped(float sinA, float cosA, float sinB, float cosB)
+	{
+		if (cosA > cosB)
+			return 0.0f;
+		return sinA * cosB - cosA * sinB;
+	}
+}
+
+float LightBvh::Importance(const Node& node, const vec3& point, const vec3& normal)
+{
+	const vec3 offset = point - node.center;
+	const float length2 = dot(offset, offset);
+	const float radius2 = Square(node.radius);
+	const float d2 = std::max(length2, 0.25f * radius2);
+
+	const vec3 wi = (length2 > 0.0f) ? offset / sqrtf(length2) : node.axis;
+	float cosTheta_w = dot(node.axis, wi);
+	if (node.twoSided)
+		cosTheta_w = fabsf(cosTheta_w);
+	const float sinTheta_w = SafeSqrt(1.0f - Square(cosTheta_w));
+
+	// Directions from the receiver to the bounds fit in a cone of half angle theta_b.
+	const float cosTheta_b = (d2 < radius2) ? -1.0f : SafeSqrt(1.0f - radius2 / d2);
+	const float sinTheta_b = SafeSqrt(1.0f - Square(cosTheta_b));
+
+	// Smallest possible angle between an emitter normal and the receiver
+	const float cosTheta_x = CosSubClamped(sinTheta_w, cosTheta_w, node.sinTheta_o, node.cosTheta_o);
+	const float sinTheta_x = SinSubClamped(sinTheta_w, cosTheta_w, node.sinTheta_o, node.cosTheta_o);
+	const float cosThetap = CosSubClamped(sinTheta_x, cosTheta_x, sinTheta_b, cosTheta_b);
+	if (cosThetap <= node.cosTheta_e)
+		return 0.0f;
+
+	float importance = node.power * cosThetap / d2;
+
+	// Smallest possible angle of incidence at the receiver, either side of the surface
+	if (normal != vec3(0))
+	{
+		const float cosTheta_i = fabsf(dot(wi, normal));
+		const float sinTheta_i = SafeSqrt(1.0f - Square(cosTheta_i));
+		importance *= CosSubClamped(sinTheta_i, cosTheta_i, sinTheta_b, cosTheta_b);
+	}
+
+	return std::max(importance, 0.0f);
+}
+
+void LightBvh::SetBounds(Node& node, const LightBounds& bounds)
+{
+	node.center = 0.5f * (bounds.min + bounds.max);
+	node.radius = 0.5f * length(bounds.max - bounds.min);
+	node.axis = bounds.axis;
+	node.cosTheta_o = bounds.cosTheta_o;
+	node.sinTheta_o = SafeSqrt(1.0f - Square(bounds.cosTheta_o));
+	node.cosTheta_e = bounds.cosTheta_e;
+	node.power = bounds.power;
+	node.twoSided = bounds.twoSided;
+}
+
+LightBounds Union(const LightBounds& a, const LightBounds& b)
+{
+	if (a.power <= 0.0f)
+		return b;
+	if (b.power <= 0.0f)
+		return a;
+
+	LightBounds result;
+	result.min = glm::min(a.min, b.min);
+	result.max = glm::max(a.max, b.max);
+	result.power = a.power + b.power;
+	result.cosTheta_e = std::min(a.cosTheta_e, b.cosTheta_e);
+	result.twoSided = a.twoSided || b.twoSided;
+
+	// Smallest cone holding both normal cones
+	const float theta_a = SafeAcos(a.cosTheta_o);
+	const float theta_b = SafeAcos(b.cosTheta_o);
+	const float theta_d = SafeAcos(dot(a.axis, b.axis));
+	if (std::min(theta_d + theta_b, PI) <= theta_a)
+	{
+		result.axis = a.axis;
+		result.cosTheta_o = a.cosTheta_o;
+		return result;
+	}
+	if (std::min(theta_d + theta_a, PI) <= theta_b)
+	{
+		result.axis = b.axis;
+		result.cosTheta_o = b.cosTheta_o;
+		return result;
+	}
+
+	const float theta_o = 0.5f * (theta_a + theta_d + theta_b);
+	const vec3 rotationAxis = cross(a.axis, b.axis);
+	if (theta_o >= PI || dot(rotationAxis, rotationAxis) == 0.0f)
+	{
+		result.axis = a.axis;
+		result.cosTheta_o = -1.0f;
+		return result;
+	}
+
+	result.axis = glm::angleAxis(theta_o - theta_a, normalize(rotationAxis)) * a.axis;
+	result.cosTheta_o = cosf(theta_o);
+	return result;
+}
+
+void LightBvh::Build(const std::vector<Shape*>& lights_, const std::vector<LightBounds>& bounds)
+{
+	nodes.clear();
+	lights = lights_;
+	lightBounds = bounds;
+
+	int maxIndex = -1;
+	std::vector<int> indices;
+	for (int i = 0; i < (int)lights.size(); i++)
+	{
+		maxIndex = std::max(maxIndex, lights[i]->lightIndex);
+		if (lightBounds[i].power > 0.0f)
+			indices.push_back(i);
+	}
+	bitTrails.assign(maxIndex + 1, 0);
+
+	LightBounds rootBounds;
+	if (!indices.empty())
+		BuildRecursive(indices, 0, (int)indices.size(), 0, 0, rootBounds);
+}
+
+int LightBvh::BuildRecursive(std::vector<int>& indices, int begin, int end, uint64_t bitTrail, int depth, LightBounds& bounds)
+{
+	const int index = (int)nodes.size();
+	nodes.emplace_back();
+
+	if (end - begin == 1)
+	{
+		const int light = indices[begin];
+		bounds = lightBounds[light];
+		SetBounds(nodes[index], bounds);
+		nodes[index].light = light;
+		bitTrails[lights[light]->lightIndex] = bitTrail;
+		return index;
+	}
+
+	// Median split along the longest axis of the centroids
+	vec3 centroidMin(std::numeric_limits<float>::infinity());
+	vec3 centroidMax(-std::numeric_limits<float>::infinity());
+	for (int i = begin; i < end; i++)
+	{
+		const LightBounds& b = lightBounds[indices[i]];
+		centroidMin = glm::min(centroidMin, 0.5f * (b.min + b.max));
+		centroidMax = glm::max(centroidMax, 0.5f * (b.min + b.max));
+	}
+	const vec3 extent = centroidMax - centroidMin;
+	const int axis = (extent.x > extent.y && extent.x > extent.z) ? 0 : (extent.y > extent.z ? 1 : 2);
+
+	const int mid = (begin + end) / 2;
+	std::nth_element(indices.begin() + begin, indices.begin() + mid, indices.begin() + end,
+		[&](int a, int b)
+		{
+			const LightBounds& la = lightBounds[a];
+			const LightBounds& lb = lightBounds[b];
+			return la.min[axis] + la.max[axis] < lb.min[axis] + lb.max[axis];
+		});
+
+	// Bit trails record the path from the root (0 = first child) and fit 64 levels.
+	const uint64_t bit = (depth < 64) ? (uint64_t(1) << depth) : 0;
+	LightBounds firstBounds, secondBounds;
+	BuildRecursive(indices, begin, mid, bitTrail, depth + 1, firstBounds);
+	const int second = BuildRecursive(indices, mid, end, bitTrail | bit, depth + 1, secondBounds);
+
+	bounds = Union(firstBounds, secondBounds);
+	SetBounds(nodes[index], bounds);
+	nodes[index].secondChild = second;
+	return index;
+}
+
+Shape* LightBvh::Sample(const vec3& point, const vec3& normal, float u, float& pmf) const
+{
+	pmf = 1.0f;
+	if (nodes.empty())
+		return nullptr;
+
+	int index = 0;
+	while (true)
+	{
+		const Node& node = nodes[index];
+		if (node.light >= 0)
+		{
+			if (index > 0 || Importance(node, point, normal) > 0.0f)
+				return lights[node.light];
+			return nullptr;
+		}
+
+		const float i0 = Importance(nodes[index + 1], point, normal);
+		const float i1 = Importance(nodes[node.secondChild], point, normal);
+		if (i0 == 0.0f && i1 == 0.0f)
+			return nullptr;
+
+		// Pick a child and rescale u for the next level
+		const float p0 = i0 / (i0 + i1);
+		if (u < p0)
+		{
+			index = index + 1;
+			u = u / p0;
+			pmf *= p0;
+		}
+		else
+		{
+			index = node.secondChild;
+			u = (u - p0) / (1.0f - p0);
+			pmf *= 1.0f - p0;
+		}
+		u = std::min(u, 0.99999994f);
+	}
+}
+
+float LightBvh::Pmf(const vec3& point, const vec3& normal, const Shape* light) const
+{
+	if (nodes.empty() || light->lightIndex < 0 || light->lightIndex >= (int)bitTrails.size())
+		return 0.0f;
+
+	uint64_t bitTrail = bitTrails[light->lightIndex];
+	int index = 0;
+	float pmf = 1.0f;
+	while (nodes[index].light < 0)
+	{
+		const Node& node = nodes[index];
+		const float i0 = Importance(nodes[index + 1], point, normal);
+		const float i1 = Importance(nodes[node.secondChild], point, normal);
+		if (i0 == 0.0f && i1 == 0.0f)
+			return 0.0f;
+
+		if (bitTrail & 1)
+		{
+			pmf *= i1 / (i0 + i1);
+			index = node.secondChild;
+		}
+		else
+		{
+			pmf *= i0 / (i0 + i1);
+			index = index + 1;
+		}
+		bitTrail >>= 1;
+	}
+
+	// A lone leaf is picked only if it matters here, as in Sample.
+	if (index == 0 && !(Importance(nodes[0], point, normal) > 0.0f))
+		return 0.0f;
+	return (lights[nodes[index].light] == light) ? pmf : 0.0f;
+}
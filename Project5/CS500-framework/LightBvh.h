@@ -0,0 +1,64 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+#include "geom.h"
+
+class Shape;
+
+////////////////////////////////////////////////////////////////////////
+// LightBounds: where a group of emitters is, which way it faces, and
+// how much it emits.
+////////////////////////////////////////////////////////////////////////
+struct LightBounds
+{
+	vec3 min = vec3(std::numeric_limits<float>::infinity());
+	vec3 max = vec3(-std::numeric_limits<float>::infinity());
+	vec3 axis = vec3(0, 0, 1);	// normal cone around axis
+	float cosTheta_o = -1.0f;	// spread of the normals
+	float cosTheta_e = 0.0f;	// spread of the emission around each normal
+	float power = 0.0f;
+	bool twoSided = false;
+};
+
+LightBounds Union(const LightBounds& a, const LightBounds& b);
+
+////////////////////////////////////////////////////////////////////////
+// LightBvh: a binary tree over the finite lights.  Sampling descends
+// from the root choosing each child by its importance, a conservative
+// estimate of its contribution at the shading point, so thousands of
+// emitters cost one traversal per shadow ray.
+////////////////////////////////////////////////////////////////////////
+class LightBvh
+{
+public:
+	void Build(const std::vector<Shape*>& lights, const std::vector<LightBounds>& bounds);
+
+	Shape* Sample(const vec3& point, const vec3& normal, float u, float& pmf) const;
+	float Pmf(const vec3& point, const vec3& normal, const Shape* light) const;
+	bool Empty() const { return nodes.empty(); }
+
+private:
+	// Bounds flattened to what Importance() reads
+	struct Node
+	{
+		vec3 center;
+		float radius;
+		vec3 axis;
+		float cosTheta_o;
+		float sinTheta_o;
+		float cosTheta_e;
+		float power;
+		bool twoSided;
+		int secondChild = -1;	// first child is the next node
+		int light = -1;			// leaves hold one light
+	};
+
+	int BuildRecursive(std::vector<int>& indices, int begin, int end, uint64_t bitTrail, int depth, LightBounds& bounds);
+	static void SetBounds(Node& node, const LightBounds& bounds);
+	static float Importance(const Node& node, const vec3& point, const vec3& normal);
+
+	std::vector<Node> nodes;
+	std::vector<Shape*> lights;
+	std::vector<LightBounds> lightBounds;
+	std::vector<uint64_t> bitTrails;	// indexed by Shape::lightIndex
+};
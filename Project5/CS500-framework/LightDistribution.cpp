@@ -0,0 +1,157 @@
+#include "LightDistribution.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include "Helper.h"
+#include "Shape.h"
+#include "raytrace.h"
+
+void LightDistribution::Build(const std::vector<Shape*>& lights_, const std::vector<Shape*>& shapes)
+{
+	lights = lights_;
+
+	// The environment's power is measured through the bounding sphere of the finite geometry.
+	vec3 sceneMin(std::numeric_limits<float>::infinity());
+	vec3 sceneMax(-std::numeric_limits<float>::infinity());
+	for (Shape* shape : shapes)
+	{
+		if (dynamic_cast<IBL*>(shape) != nullptr)
+			continue;
+
+		sceneMin = glm::min(sceneMin, shape->min);
+		sceneMax = glm::max(sceneMax, shape->max);
+	}
+	sceneCenter = (sceneMin.x <= sceneMax.x) ? 0.5f * (sceneMin + sceneMax) : vec3(0);
+	sceneRadius = (sceneMin.x <= sceneMax.x) ? 0.5f * length(sceneMax - sceneMin) : 1.0f;
+
+	std::vector<float> power(lights.size());
+	std::vector<float> infinitePower;
+	std::vector<Shape*> finiteLights;
+	std::vector<LightBounds> finiteBounds;
+	float finiteTotal = 0.0f;
+	infiniteLights.clear();
+	infiniteIndex.assign(lights.size(), -1);
+	for (int i = 0; i < (int)lights.size(); i++)
+	{
+		lights[i]->lightIndex = i;
+		power[i] = EmittedPower(lights[i]);
+
+		if (dynamic_cast<IBL*>(lights[i]) != nullptr)
+		{
+			infiniteIndex[i] = (int)infiniteLights.size();
+			infiniteLights.push_back(lights[i]);
+			infinitePower.push_back(power[i]);
+		}
+		else
+		{
+			finiteLights.push_back(lights[i]);
+			finiteBounds.push_back(Bounds(lights[i], power[i]));
+			finiteTotal += power[i];
+		}
+	}
+
+	table.Build(power.data(), (int)power.size());
+	infiniteTable.Build(infinitePower.data(), (int)infinitePower.size());
+	bvh.Build(finiteLights, finiteBounds);
+
+	const float infiniteTotal = infiniteTable.Total();
+	if (infiniteLights.empty())
+		infiniteProbability = 0.0f;
+	else if (bvh.Empty())
+		infiniteProbability = 1.0f;
+	else
+		infiniteProbability = infiniteTotal / (infiniteTotal + finiteTotal);
+}
+
+Shape* LightDistribution::Sample(float u) const
+{
+	if (lights.empty())
+		return nullptr;
+
+	return lights[table.Sample(u)];
+}
+
+float LightDistribution::Pdf(const Shape* light) const
+{
+	if (light->lightIndex < 0)
+		return 0.0f;
+
+	return table.Pdf(light->lightIndex);
+}
+
+Shape* LightDistribution::Sample(const vec3& point, const vec3& normal, float u, float& pmf) const
+{
+	if (u < infiniteProbability)
+	{
+		const int index = infiniteTable.Sample(u / infiniteProbability);
+		pmf = infiniteProbability * infiniteTable.Pdf(index);
+		return infiniteLights[index];
+	}
+
+	u = std::min((u - infiniteProbability) / (1.0f - infiniteProbability), 0.99999994f);
+	Shape* light = bvh.Sample(point, normal, u, pmf);
+	pmf *= 1.0f - infiniteProbability;
+	return light;
+}
+
+float LightDistribution::Pdf(const vec3& point, const vec3& normal, const Shape* light) const
+{
+	if (light->lightIndex < 0)
+		return 0.0f;
+
+	const int infinite = infiniteIndex[light->lightIndex];
+	if (infinite >= 0)
+		return infiniteProbability * infiniteTable.Pdf(infinite);
+
+	return (1.0f - infiniteProbability) * bvh.Pmf(point, normal, light);
+}
+
+float LightDistribution::EmittedPower(Shape* light) const
+{
+	IBL* ibl = dynamic_cast<IBL*>(light);
+	if (ibl != nullptr)
+	{
+		// pi * r^2 * (luminance integrated over the sphere of directions),
+		// of texels clamped to 1 as EvalRadiance returns them
+		float integral = 0.0f;
+		for (int j = 0; j < ibl->height; j++)
+		{
+			const float sinTheta = sinf(PI * (j + 0.5f) / ibl->height);
+			for (int i = 0; i < ibl->width; i++)
+			{
+				const float* texel = &ibl->image[3 * (j * ibl->width + i)];
+				integral += Luminance(glm::min(vec3(texel[0], texel[1], texel[2]), vec3(1.0f))) * sinTheta;
+			}
+		}
+		const float texelSolidAngle = (2.0f * PI / ibl->width) * (PI / ibl->height);
+		return PI * sceneRadius * sceneRadius * integral * texelSolidAngle;
+	}
+
+	// Triangles emit from both faces.
+	const float sides = (dynamic_cast<Triangle*>(light) != nullptr) ? 2.0f : 1.0f;
+	return sides * PI * light->Area() * Luminance(light->material->Kd);
+}
+
+LightBounds LightDistribution::Bounds(Shape* light, float power) const
+{
+	LightBounds bounds;
+	bounds.min = light->min;
+	bounds.max = light->max;
+	bounds.power = power;
+
+	// Flat emitters face one way; everything else emits in all directions.
+	Triangle* triangle = dynamic_cast<Triangle*>(light);
+	if (triangle != nullptr)
+	{
+		const vec3 n = cross(triangle->v1 - triangle->v0, triangle->v2 - triangle->v0);
+		if (dot(n, n) > 0.0f)
+		{
+			bounds.axis = normalize(n);
+			bounds.cosTheta_o = 1.0f;
+			bounds.twoSided = true;
+		}
+	}
+
+	return bounds;
+}
@@ -0,0 +1,46 @@
+#pragma once
+#include <vector>
+#include "geom.h"
+#include "AliasTable.h"
+#include "LightBvh.h"
+
+class Shape;
+
+////////////////////////////////////////////////////////////////////////
+// LightDistribution: chooses a light for next event estimation.  The
+// environment is chosen by its share of the emitted power; finite
+// lights go through a LightBvh that weighs them at the shading point.
+// The plain power distribution stays available for emission sampling.
+// Built once in Scene::Finit and passed around by reference.
+////////////////////////////////////////////////////////////////////////
+class LightDistribution
+{
+public:
+	void Build(const std::vector<Shape*>& lights, const std::vector<Shape*>& shapes);
+
+	// Proportional to power, independent of the receiver
+	Shape* Sample(float u) const;
+	float Pdf(const Shape* light) const;
+
+	// By estimated contribution at a shading point
+	Shape* Sample(const vec3& point, const vec3& normal, float u, float& pmf) const;
+	float Pdf(const vec3& point, const vec3& normal, const Shape* light) const;
+	bool Empty() const { return lights.empty(); }
+
+	std::vector<Shape*> lights;
+
+	// Bounding sphere of the finite geometry
+	vec3 sceneCenter = vec3(0);
+	float sceneRadius = 1.0f;
+
+private:
+	float EmittedPower(Shape* light) const;
+	LightBounds Bounds(Shape* light, float power) const;
+
+	AliasTable table;
+	AliasTable infiniteTable;
+	std::vector<Shape*> infiniteLights;
+	std::vector<int> infiniteIndex;	// lightIndex -> entry in infiniteTable
+	float infiniteProbability = 0.0f;
+	LightBvh bvh;
+};
@@ -0,0 +1,201 @@
+#include "Metropolis.h"
+
+#include <algorithm>
+#include <cmath>
+#include "Ray.h"
+#include "StaticRayTrace.h"
+#include "raytrace.h"
+
+Metropolis::Metropolis(int chains_, int bootstrap_, float largeStepProbability_, float sigma_, uint64_t seed_)
+	: chains(chains_), bootstrap(bootstrap_), largeStepProbability(largeStepProbability_), sigma(sigma_), seed(seed_)
+{
+}
+
+void Metropolis::Bootstrap(Scene& scene)
+{
+	// Each bootstrap path has its own stream, so any of them can be
+	// traced again to start a chain.
+	std::vector<float> weights(bootstrap);
+#pragma omp parallel for schedule(dynamic, 64)
+	for (int i = 0; i < bootstrap; i++)
+	{
+		Sampler sampler = NewSampler(i);
+		vec2 pixel;
+		weights[i] = Luminance(Path(scene, sampler, pixel));
+	}
+
+	std::vector<double> cdf(bootstrap + 1, 0.0);
+	for (int i = 0; i < bootstrap; i++)
+		cdf[i + 1] = cdf[i] + weights[i];
+	normalization = (bootstrap > 0) ? (float)(cdf[bootstrap] / bootstrap) : 0.0f;
+
+	states.assign(chains, Chain());
+	if (normalization <= 0.0f)
+		return;
+
+	std::mt19937_64 rng(Mix(seed, ~0ull));
+	std::uniform_real_distribution<double> uniform(0.0, 1.0);
+	for (int c = 0; c < chains; c++)
+	{
+		const double u = uniform(rng) * cdf[bootstrap];
+		int k = (int)(std::upper_bound(cdf.begin(), cdf.end(), u) - cdf.begin()) - 1;
+		k = (k < 0) ? 0 : (k >= bootstrap ? bootstrap - 1 : k);
+
+		// Replaying the stream gives the same numbers and so the same path;
+		// after that the chain mutates with its own stream, so chains that
+		// start alike soon part.
+		Chain& chain = states[c];
+		chain.sampler = NewSampler(k);
+		chain.L = Path(scene, chain.sampler, chain.pixel);
+		chain.f = Luminance(chain.L);
+		chain.sampler.rng.seed(Mix(seed, (uint64_t)bootstrap + c));
+	}
+}
+
+void Metropolis::Advance(Scene& scene, int c, int mutations, Color* splat)
+{
+	Chain& chain = states[c];
+	if (chain.f <= 0.0f)
+		return;
+
+	for (int m = 0; m < mutations; m++)
+	{
+		chain.sampler.StartIteration();
+		vec2 pixel;
+		const vec3 L = Path(scene, chain.sampler, pixel);
+		const float f = Luminance(L);
+		const float accept = (f < chain.f) ? f / chain.f : 1.0f;
+
+		if (accept > 0.0f)
+			splat[(int)pixel.y * scene.width + (int)pixel.x] += L * (accept / f);
+		if (accept < 1.0f)
+			splat[(int)chain.pixel.y * scene.width + (int)chain.pixel.x] += chain.L * ((1.0f - accept) / chain.f);
+
+		chain.proposed++;
+		if (chain.sampler.Uniform() < accept)
+		{
+			chain.L = L;
+			chain.f = f;
+			chain.pixel = pixel;
+			chain.sampler.Accept();
+			chain.accepted++;
+		}
+		else
+			chain.sampler.Reject();
+	}
+}
+
+double Metropolis::AcceptanceRate() const
+{
+	uint64_t proposed = 0, accepted = 0;
+	for (const Chain& chain : states)
+	{
+		proposed += chain.proposed;
+		accepted += chain.accepted;
+	}
+	return (proposed > 0) ? (double)accepted / proposed : 0.0;
+}
+
+vec3 Metropolis::Path(Scene& scene, Sampler& sampler, vec2& pixel)
+{
+	RNGen.stream = &sampler;
+	const Region& region = scene.region;
+	pixel.x = region.x0 + myrandomf(RNGen) * (region.x1 - region.x0);
+	pixel.y = region.y0 + myrandomf(RNGen) * (region.y1 - region.y0);
+
+	// Pixels outside the region are worth nothing, so chains stay out.
+	vec3 L(0);
+	if (region.Contains((int)pixel.x, (int)pixel.y, scene.width))
+	{
+		L = scene.staticRayTrace->TraceRay(scene.CameraRay(pixel.x, pixel.y));
+		if (!scene.IsValidColor(L) || !(Luminance(L) > 0.0f))
+			L = vec3(0);
+	}
+	RNGen.stream = nullptr;
+	return L;
+}
+
+Metropolis::Sampler Metropolis::NewSampler(uint64_t stream) const
+{
+	Sampler sampler(Mix(seed, stream));
+	sampler.largeStepProbability = largeStepProbability;
+	sampler.sigma = sigma;
+	return sampler;
+}
+
+// SplitMix64 finalizer over both words, so nearby seeds and streams
+// give unrelated engines
+uint64_t Metropolis::Mix(uint64_t a, uint64_t b)
+{
+	uint64_t z = a * 0x9E3779B97F4A7C15ull + b;
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+	return z ^ (z >> 31);
+}
+
+Metropolis::Sampler::Sampler(uint64_t seed)
+	: rng(seed)
+{
+}
+
+void Metropolis::Sampler::StartIteration()
+{
+	iteration++;
+	largeStep = Uniform() < largeStepProbability;
+	index = 0;
+}
+
+void Metropolis::Sampler::Accept()
+{
+	if (largeStep)
+		lastLargeStep = iteration;
+}
+
+void Metropolis::Sampler::Reject()
+{
+	for (PrimarySample& x : X)
+	{
+		if (x.modified == iteration)
+		{
+			x.value = x.valueBackup;
+			x.modified = x.modifiedBackup;
+		}
+	}
+	iteration--;
+}
+
+uint64_t Metropolis::Sampler::Next()
+{
+	// A float in [0,1) scaled to the engine's whole range
+	return (uint64_t)((double)Mutate(index++) * 18446744073709551616.0);
+}
+
+float Metropolis::Sampler::Mutate(size_t i)
+{
+	if (i >= X.size())
+		X.resize(i + 1);
+	PrimarySample& x = X[i];
+
+	// Not read since the last accepted large step, which replaced it
+	if (x.modified < lastLargeStep)
+	{
+		x.value = Uniform();
+		x.modified = lastLargeStep;
+	}
+
+	x.valueBackup = x.value;
+	x.modifiedBackup = x.modified;
+	if (largeStep)
+		x.value = Uniform();
+	else
+	{
+		// The small steps it missed, combined into one
+		const float steps = (float)(iteration - x.modified);
+		x.value += normal(rng) * sigma * std::sqrt(steps);
+		x.value -= std::floor(x.value);
+		if (x.value >= 1.0f)
+			x.value = 0.0f;
+	}
+	x.modified = iteration;
+	return x.value;
+}
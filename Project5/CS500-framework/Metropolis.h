@@ -0,0 +1,105 @@
+#pragma once
+#include <cstdint>
+#include <random>
+#include <vector>
+#include "geom.h"
+#include "Helper.h"
+
+class Scene;
+
+////////////////////////////////////////////////////////////////////////
+// Metropolis: primary sample space Metropolis light transport (Kelemen
+// et al. 2002, arranged as in pbrt-v3).  A path is the vector of uniform
+// numbers TraceRay draws, with the first two placing it in the region's
+// bounds.  Each chain mutates its vector, either all of it afresh (a
+// large step) or every number by a small wrapped Gaussian step, and
+// accepts by the ratio of the two paths' luminances, so pixels receive
+// paths in proportion to their brightness.  Both the current and the
+// proposed path are splatted, weighted by the acceptance probability.
+// Numbers are mutated lazily: one catches up on the steps it missed
+// when TraceRay next reads it.
+//
+// A bootstrap of independent paths estimates the mean luminance that
+// scales the splats, and chains start at paths drawn from it in
+// proportion to luminance.  Everything follows from the seed, so a
+// render takes the same paths for any number of threads.
+////////////////////////////////////////////////////////////////////////
+class Metropolis
+{
+public:
+	Metropolis(int chains, int bootstrap, float largeStepProbability, float sigma, uint64_t seed);
+
+	// Estimates the normalization and starts the chains; call once the
+	// scene's region is set.
+	void Bootstrap(Scene& scene);
+
+	// Runs mutations of one chain, adding to splat (one Color per pixel
+	// of the frame).  Different chains may advance at once.
+	void Advance(Scene& scene, int chain, int mutations, Color* splat);
+
+	// Mean luminance of a path, which scales the splats
+	float Normalization() const { return normalization; }
+
+	double AcceptanceRate() const;
+
+	int chains;
+	int bootstrap;				// independent paths for the normalization
+	float largeStepProbability;
+	float sigma;				// of a small step, in primary sample units
+	uint64_t seed;
+
+private:
+	struct PrimarySample
+	{
+		float value = 0.0f;
+		int64_t modified = 0;		// iteration of the last mutation
+		float valueBackup = 0.0f;
+		int64_t modifiedBackup = 0;
+	};
+
+	// One chain's primary samples; TraceRay reads them through RNGen.
+	class Sampler : public SampleStream
+	{
+	public:
+		Sampler(uint64_t seed = 0);
+
+		void StartIteration();
+		void Accept();
+		void Reject();
+		float Uniform() { return uniform(rng); }
+		uint64_t Next() override;
+
+		std::mt19937_64 rng;
+		float largeStepProbability = 0.3f;
+		float sigma = 0.01f;
+
+	private:
+		float Mutate(size_t index);
+
+		std::vector<PrimarySample> X;
+		size_t index = 0;
+		int64_t iteration = 0;
+		int64_t lastLargeStep = 0;
+		bool largeStep = true;
+		std::uniform_real_distribution<float> uniform{ 0.0f, 1.0f };
+		std::normal_distribution<float> normal{ 0.0f, 1.0f };
+	};
+
+	struct Chain
+	{
+		Sampler sampler;
+		vec3 L = vec3(0);
+		float f = 0.0f;			// luminance of L
+		vec2 pixel = vec2(0);
+		uint64_t proposed = 0;
+		uint64_t accepted = 0;
+	};
+
+	// Traces the path sampler's numbers describe
+	vec3 Path(Scene& scene, Sampler& sampler, vec2& pixel);
+	Sampler NewSampler(uint64_t stream) const;
+	static uint64_t Mix(uint64_t a, uint64_t b);
+
+	std::vector<Chain> states;
+	float normalization = 0.0f;
+};
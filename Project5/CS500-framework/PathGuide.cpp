@@ -0,0 +1,315 @@
+#include "PathGuide.h"
+
+#include <algorithm>
+#include <cmath>
+#include "Helper.h"
+#include "Shape.h"
+#include "raytrace.h"
+
+// Cylindrical equal-area map between directions and the unit square
+static vec2 ToSquare(const vec3& D)
+{
+	const float cosTheta = glm::clamp(D.z, -1.0f, 1.0f);
+	float phi = atan2f(D.y, D.x) / (2.0f * PI);
+	if (phi < 0.0f)
+		phi += 1.0f;
+	return vec2(0.5f * (cosTheta + 1.0f), (phi < 1.0f) ? phi : 0.0f);
+}
+
+static vec3 FromSquare(const vec2& p)
+{
+	const float cosTheta = 2.0f * p.x - 1.0f;
+	const float sinTheta = sqrtf(glm::max(0.0f, 1.0f - cosTheta * cosTheta));
+	const float phi = 2.0f * PI * p.y;
+	return vec3(sinTheta * cosf(phi), sinTheta * sinf(phi), cosTheta);
+}
+
+PathGuide::DirectionTree::DirectionTree()
+	: nodes(1)
+{
+}
+
+PathGuide::DirectionTree& PathGuide::DirectionTree::operator=(const DirectionTree& other)
+{
+	nodes = other.nodes;
+	return *this;
+}
+
+PathGuide::DirectionTree::Node& PathGuide::DirectionTree::Node::operator=(const Node& other)
+{
+	for (int i = 0; i < 4; i++)
+	{
+		sum[i].store(other.sum[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+		child[i] = other.child[i];
+	}
+	return *this;
+}
+
+void PathGuide::DirectionTree::Record(vec2 p, float value)
+{
+	uint32_t n = 0;
+	while (true)
+	{
+		const int x = (p.x >= 0.5f) ? 1 : 0;
+		const int y = (p.y >= 0.5f) ? 1 : 0;
+		const int i = x + 2 * y;
+		AtomicAdd(nodes[n].sum[i], value);
+		if (nodes[n].child[i] == 0)
+			return;
+
+		p = 2.0f * p - vec2(x, y);
+		n = nodes[n].child[i];
+	}
+}
+
+vec2 PathGuide::DirectionTree::Sample(vec2 u) const
+{
+	// Down the tree by energy, one axis at a time, stretching u to reuse
+	// it at every level; uniform below a node with nothing recorded.
+	vec2 origin(0);
+	float size = 1.0f;
+	uint32_t n = 0;
+	while (true)
+	{
+		const Node& node = nodes[n];
+		float s[4];
+		for (int i = 0; i < 4; i++)
+			s[i] = node.sum[i].load(std::memory_order_relaxed);
+		const float total = s[0] + s[1] + s[2] + s[3];
+		if (!(total > 0.0f))
+			return origin + size * u;
+
+		const float left = (s[0] + s[2]) / total;
+		int x = 0;
+		if (u.x < left)
+			u.x /= left;
+		else
+		{
+			u.x = (u.x - left) / (1.0f - left);
+			x = 1;
+		}
+
+		const float bottom = s[x] / (s[x] + s[x + 2]);
+		int y = 0;
+		if (u.y < bottom)
+			u.y /= bottom;
+		else
+		{
+			u.y = (u.y - bottom) / (1.0f - bottom);
+			y = 1;
+		}
+		u = glm::clamp(u, vec2(0.0f), vec2(0.99999994f));
+
+		size *= 0.5f;
+		origin += size * vec2(x, y);
+		if (node.child[x + 2 * y] == 0)
+			return origin + size * u;
+		n = node.child[x + 2 * y];
+	}
+}
+
+float PathGuide::DirectionTree::Pdf(vec2 p) const
+{
+	float pdf = 1.0f;
+	uint32_t n = 0;
+	while (true)
+	{
+		const Node& node = nodes[n];
+		float total = 0.0f;
+		for (int i = 0; i < 4; i++)
+			total += node.sum[i].load(std::memory_order_relaxed);
+		if (!(total > 0.0f))
+			return pdf;
+
+		const int x = (p.x >= 0.5f) ? 1 : 0;
+		const int y = (p.y >= 0.5f) ? 1 : 0;
+		const int i = x + 2 * y;
+		pdf *= 4.0f * node.sum[i].load(std::memory_order_relaxed) / total;
+		if (node.child[i] == 0 || pdf == 0.0f)
+			return pdf;
+
+		p = 2.0f * p - vec2(x, y);
+		n = node.child[i];
+	}
+}
+
+void PathGuide::DirectionTree::Refine(const DirectionTree& other, float threshold, int maxDepth)
+{
+	const Node& root = other.nodes[0];
+	float total = 0.0f;
+	for (int i = 0; i < 4; i++)
+		total += root.sum[i].load(std::memory_order_relaxed);
+
+	// A quadrant of a leaf of other that needs dividing is divided evenly.
+	struct Item
+	{
+		uint32_t node;
+		int from;			// node of other, or -1 past its leaves
+		float energy;		// of the node, when past other's leaves
+		int depth;
+	};
+
+	nodes.assign(1, Node());
+	std::vector<Item> stack = { { 0, 0, total, 1 } };
+	while (!stack.empty())
+	{
+		const Item item = stack.back();
+		stack.pop_back();
+		const bool mapped = item.from >= 0;
+
+		for (int i = 0; i < 4; i++)
+		{
+			const float energy = mapped ? other.nodes[item.from].sum[i].load(std::memory_order_relaxed) : 0.25f * item.energy;
+			const float share = (total > 0.0f) ? energy / total : powf(0.25f, (float)item.depth);
+			if (item.depth >= maxDepth || share <= threshold)
+				continue;
+
+			const uint32_t c = (uint32_t)nodes.size();
+			nodes.emplace_back();
+			nodes[item.node].child[i] = c;
+			const int from = (mapped && other.nodes[item.from].child[i] != 0) ? (int)other.nodes[item.from].child[i] : -1;
+			stack.push_back({ c, from, energy, item.depth + 1 });
+		}
+	}
+}
+
+PathGuide::PathGuide(int trainingPasses_, float fraction_, float splitThreshold_)
+	: trainingPasses(trainingPasses_), fraction(fraction_), splitThreshold(splitThreshold_)
+{
+	spatial.resize(1);
+	spatial[0].leaf = 0;
+	leaves.push_back(std::make_unique<Leaf>());
+}
+
+void PathGuide::Start(const std::vector<Shape*>& shapes)
+{
+	vec3 min(std::numeric_limits<float>::infinity());
+	vec3 max(-std::numeric_limits<float>::infinity());
+	for (Shape* shape : shapes)
+	{
+		min = glm::min(min, shape->min);
+		max = glm::max(max, shape->max);
+	}
+	if (min.x > max.x)
+		return;
+
+	// A little larger, so points on the bounds land inside
+	size = glm::max(max - min, vec3(1e-3f)) * 1.001f;
+	origin = 0.5f * (min + max) - 0.5f * size;
+}
+
+void PathGuide::EndPass()
+{
+	if (!Training() || ++passes < iterationPasses)
+		return;
+
+	Refine(passes);
+	iterations++;
+	trained += passes;
+	passes = 0;
+	iterationPasses = std::min(2 * iterationPasses, trainingPasses - trained);
+}
+
+PathGuide::Directions* PathGuide::Find(const vec3& point, const vec3& normal) const
+{
+	vec3 p = glm::clamp((point - origin) / size, vec3(0.0f), vec3(0.99999994f));
+	uint32_t n = 0;
+	while (spatial[n].child[0] != 0)
+	{
+		const SpatialNode& node = spatial[n];
+		const int a = node.axis;
+		const int side = (p[a] >= 0.5f) ? 1 : 0;
+		p[a] = 2.0f * p[a] - side;
+		n = node.child[side];
+	}
+
+	const vec3 a = glm::abs(normal);
+	const int axis = (a.x >= a.y && a.x >= a.z) ? 0 : (a.y >= a.z ? 1 : 2);
+	return &leaves[spatial[n].leaf]->facing[2 * axis + (normal[axis] < 0.0f ? 1 : 0)];
+}
+
+vec3 PathGuide::Sample(const Directions& directions) const
+{
+	const vec2 u(myrandomf(RNGen), myrandomf(RNGen));
+	return FromSquare(directions.sampling.Sample(u));
+}
+
+float PathGuide::Pdf(const Directions& directions, const vec3& omegaI) const
+{
+	// The map is equal-area, so solid angle is the square's area times 4 pi.
+	return directions.sampling.Pdf(ToSquare(omegaI)) / (4.0f * PI);
+}
+
+void PathGuide::Record(Directions& directions, const vec3& omegaI, float radiance)
+{
+	directions.building.Record(ToSquare(omegaI), radiance);
+	directions.records.fetch_add(1, std::memory_order_relaxed);
+}
+
+size_t PathGuide::DirectionNodeCount() const
+{
+	size_t count = 0;
+	for (const std::unique_ptr<Leaf>& leaf : leaves)
+		for (const Directions& directions : leaf->facing)
+			count += directions.sampling.NodeCount();
+	return count;
+}
+
+void PathGuide::Refine(int iterationLength)
+{
+	// Split leaves that saw many records, each half taking a copy of the
+	// directions and half the records, until every leaf is under the
+	// threshold; more passes earn a finer tree.
+	const double threshold = splitThreshold * sqrt((double)iterationLength);
+	std::vector<std::pair<uint32_t, uint64_t>> work;
+	for (uint32_t n = 0; n < (uint32_t)spatial.size(); n++)
+	{
+		if (spatial[n].child[0] != 0)
+			continue;
+		uint64_t records = 0;
+		for (const Directions& directions : leaves[spatial[n].leaf]->facing)
+			records += directions.records.load();
+		work.push_back({ n, records });
+	}
+
+	while (!work.empty())
+	{
+		const uint32_t n = work.back().first;
+		const uint64_t records = work.back().second;
+		work.pop_back();
+		if (records <= threshold || spatial[n].depth >= MaxSpatialDepth)
+			continue;
+
+		const Leaf& leaf = *leaves[spatial[n].leaf];
+		for (int side = 0; side < 2; side++)
+		{
+			SpatialNode child;
+			child.axis = (spatial[n].axis + 1) % 3;
+			child.depth = spatial[n].depth + 1;
+			if (side == 0)
+				child.leaf = spatial[n].leaf;
+			else
+			{
+				child.leaf = (int)leaves.size();
+				leaves.push_back(std::make_unique<Leaf>());
+				for (int i = 0; i < 6; i++)
+					leaves.back()->facing[i].building = leaf.facing[i].building;
+			}
+			spatial[n].child[side] = (uint32_t)spatial.size();
+			work.push_back({ (uint32_t)spatial.size(), records / 2 });
+			spatial.push_back(child);
+		}
+		spatial[n].leaf = -1;
+	}
+
+	// What was learned becomes what is sampled, and shapes the next tree.
+	for (std::unique_ptr<Leaf>& leaf : leaves)
+	{
+		for (Directions& directions : leaf->facing)
+		{
+			directions.sampling = directions.building;
+			directions.building.Refine(directions.sampling, EnergyThreshold, MaxDirectionDepth);
+			directions.records = 0;
+		}
+	}
+}
@@ -0,0 +1,129 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "geom.h"
+
+class Shape;
+
+////////////////////////////////////////////////////////////////////////
+// PathGuide: path guiding by an SD-tree (Mueller et al. 2017, "Practical
+// Path Guiding").  A binary tree halves the scene's bounding box along
+// x, y and z in turn; each leaf holds quadtrees over the sphere of
+// directions, mapped to the unit square by the cylindrical equal-area
+// projection, whose nodes sum the radiance arriving from inside them.
+// A leaf keeps one quadtree for each axis the surface normal can mostly
+// face, so a floor and a wall sharing a leaf do not send each other's
+// samples into the surface.
+//
+// Training runs in iterations of 1, 2, 4, ... passes.  During one,
+// TraceRay records the radiance each vertex received along its
+// extension ray into the leaf's building quadtree with atomic adds; no
+// tree changes shape until the pass loop calls EndPass.  Between
+// iterations, leaves with many records split, each building quadtree
+// becomes the one sampled, and a fresh one is grown from it, subdivided
+// wherever a node holds more than 1% of the energy.  TraceRay then picks
+// the guide or the BSDF at random and weights by the pdf of the mix.
+////////////////////////////////////////////////////////////////////////
+class PathGuide
+{
+public:
+	// Directions over the unit square, refined by energy
+	class DirectionTree
+	{
+	public:
+		DirectionTree();
+		DirectionTree(const DirectionTree& other) { *this = other; }
+		DirectionTree& operator=(const DirectionTree& other);
+
+		// Any thread may record while no other call changes the tree.
+		void Record(vec2 p, float value);
+		vec2 Sample(vec2 u) const;
+		float Pdf(vec2 p) const;		// over the unit square
+
+		// Reshapes this tree to other's energy, with every sum zero.
+		void Refine(const DirectionTree& other, float threshold, int maxDepth);
+
+		size_t NodeCount() const { return nodes.size(); }
+
+	private:
+		struct Node
+		{
+			Node() = default;
+			Node(const Node& other) { *this = other; }
+			Node& operator=(const Node& other);
+
+			std::atomic<float> sum[4] = {};	// quadrants x + 2y
+			uint32_t child[4] = {};			// 0 for none
+		};
+
+		std::vector<Node> nodes;
+	};
+
+	struct Directions
+	{
+		DirectionTree sampling;
+		DirectionTree building;
+		std::atomic<uint64_t> records{ 0 };		// this iteration's
+	};
+
+	PathGuide(int trainingPasses, float fraction, float splitThreshold);
+
+	// Fits the spatial tree to the shapes' bounds; call before rendering.
+	void Start(const std::vector<Shape*>& shapes);
+
+	// Ends an iteration once it has had its passes.
+	void EndPass();
+
+	bool Training() const { return trained < trainingPasses; }
+	bool Ready() const { return iterations > 0; }
+
+	// The quadtrees for a surface at point facing normal
+	Directions* Find(const vec3& point, const vec3& normal) const;
+	vec3 Sample(const Directions& directions) const;
+	float Pdf(const Directions& directions, const vec3& omegaI) const;
+	void Record(Directions& directions, const vec3& omegaI, float radiance);
+
+	// Density of drawing omegaI from the guide or, otherwise, the BSDF
+	float MixedPdf(const Directions& directions, const vec3& omegaI, float pdfBsdf) const
+	{
+		return fraction * Pdf(directions, omegaI) + (1.0f - fraction) * pdfBsdf;
+	}
+
+	size_t LeafCount() const { return leaves.size(); }
+	size_t DirectionNodeCount() const;
+
+	int trainingPasses;
+	float fraction;				// of extension rays drawn from the guide
+	float splitThreshold;		// records before a leaf splits, times sqrt(passes)
+	int iterations = 0;			// finished
+
+private:
+	static constexpr float EnergyThreshold = 0.01f;
+	static const int MaxDirectionDepth = 20;
+	static const int MaxSpatialDepth = 48;
+
+	struct Leaf
+	{
+		Directions facing[6];		// +x, -x, +y, -y, +z, -z
+	};
+
+	struct SpatialNode
+	{
+		int axis = 0;
+		int depth = 0;
+		uint32_t child[2] = {};		// 0 for a leaf
+		int leaf = -1;
+	};
+
+	void Refine(int iterationLength);
+
+	std::vector<SpatialNode> spatial;
+	std::vector<std::unique_ptr<Leaf>> leaves;
+	vec3 origin = vec3(0);		// lowest corner of the box
+	vec3 size = vec3(1);
+	int trained = 0;			// passes in finished iterations
+	int iterationPasses = 1;
+	int passes = 0;				// in this iteration
+};
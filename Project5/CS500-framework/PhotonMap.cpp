@@ -0,0 +1,246 @@
+#include "PhotonMap.h"
+
+#include <algorithm>
+#include "Shape.h"
+#include "Auxiliary.h"
+#include "Helper.h"
+#include "Ray.h"
+#include "StaticRayTrace.h"
+#include "raytrace.h"
+
+PhotonMap::PhotonMap(int photonsPerPass_, float radius_, float alpha_)
+	: photonsPerPass(photonsPerPass_), radius(radius_), alpha(alpha_)
+{
+}
+
+bool PhotonMap::IsSpecular(Shape* shape)
+{
+	const Material* material = shape->material;
+	return shape->p_d <= 0.0f && material->alpha_other < SpecularAlpha;
+}
+
+void PhotonMap::Build(StaticRayTrace& tracer)
+{
+	// r(i+1)^2 = r(i)^2 (i + alpha) / (i + 1)
+	if (radius <= 0.0f)
+		radius = 0.01f * tracer.lightDistribution.sceneRadius;
+	else if (passes > 0)
+		radius *= sqrtf((passes + alpha) / (passes + 1));
+	passes++;
+
+	if (targetRadius < 0.0f)
+		FindTarget(tracer);
+	if (targetRadius <= 0.0f)
+		return;
+
+	traced.resize(photonsPerPass);
+#pragma omp parallel for schedule(dynamic, 256)
+	for (int i = 0; i < photonsPerPass; i++)
+		traced[i] = Trace(tracer);
+
+	gatherRadius = radius;
+	cellSize = 2.0f * radius;
+
+	uint32_t kept = 0;
+	for (const Photon& photon : traced)
+		kept += (photon.power != vec3(0)) ? 1 : 0;
+
+	uint32_t cells = 1;
+	while (cells < 2 * kept)
+		cells <<= 1;
+	cellMask = cells - 1;
+
+	// Counting sort by cell: count, prefix sum, scatter, then shift the
+	// ends the scatter left in cellStart back to starts.
+	cellStart.assign(cells + 1, 0);
+	cellOf.clear();
+	for (const Photon& photon : traced)
+	{
+		if (photon.power == vec3(0))
+			continue;
+		const uint32_t cell = Cell(ivec3(glm::floor(photon.point / cellSize)));
+		cellOf.push_back(cell);
+		cellStart[cell + 1]++;
+	}
+	for (uint32_t c = 0; c < cells; c++)
+		cellStart[c + 1] += cellStart[c];
+
+	photons.resize(kept);
+	uint32_t k = 0;
+	for (const Photon& photon : traced)
+	{
+		if (photon.power != vec3(0))
+			photons[cellStart[cellOf[k++]]++] = photon;
+	}
+	for (uint32_t c = cells; c > 0; c--)
+		cellStart[c] = cellStart[c - 1];
+	cellStart[0] = 0;
+
+	emitted += photonsPerPass;
+	stored += kept;
+}
+
+void PhotonMap::FindTarget(StaticRayTrace& tracer)
+{
+	vec3 targetMin(std::numeric_limits<float>::infinity());
+	vec3 targetMax(-std::numeric_limits<float>::infinity());
+	for (Shape* shape : tracer.shapes)
+	{
+		if (shape->IsLight() || !IsSpecular(shape))
+			continue;
+
+		targetMin = glm::min(targetMin, shape->min);
+		targetMax = glm::max(targetMax, shape->max);
+	}
+
+	// Without specular surfaces there are no caustics to map.
+	targetCenter = 0.5f * (targetMin + targetMax);
+	targetRadius = (targetMin.x <= targetMax.x) ? 0.5f * length(targetMax - targetMin) : 0.0f;
+}
+
+PhotonMap::Photon PhotonMap::Trace(StaticRayTrace& tracer) const
+{
+	Photon photon = {};
+	const LightDistribution& lights = tracer.lightDistribution;
+	Shape* light = lights.Sample(myrandomf(RNGen));
+	if (light == nullptr)
+		return photon;
+	const float pmf = lights.Pdf(light);
+
+	// Photons are aimed at the bounding sphere of the specular surfaces;
+	// the rest could not become caustics.
+	Ray ray(vec3(0), vec3(0));
+	vec3 power;
+	IBL* ibl = dynamic_cast<IBL*>(light);
+	if (ibl != nullptr)
+	{
+		// From a disk across the target, facing the sampled direction and
+		// set back outside the whole scene, so walls and roofs still block it
+		Intersection center;
+		center.point = targetCenter;
+		float pdf;
+		const Intersection B = ibl->SampleAsLight(center, pdf);
+		if (pdf <= 0.0f)
+			return photon;
+
+		const float R = targetRadius;
+		const float back = length(targetCenter - lights.sceneCenter) + lights.sceneRadius;
+		const float r = R * sqrtf(myrandomf(RNGen));
+		const vec3 offset = r * SampleLobe(B.normal, 0.0f, 2.0f * PI * myrandomf(RNGen));
+		ray = Ray(center.point - back * B.normal + offset, B.normal);
+		power = ibl->EvalRadiance(B) * (PI * R * R / (pdf * pmf));
+	}
+	else
+	{
+		const Intersection S = light->SampleSurface();
+		if (S.object == nullptr)
+			return photon;
+
+		// Uniform in the cone the target subtends, or cosine-weighted from
+		// inside it; triangles emit from both faces.
+		const bool twoSided = dynamic_cast<Triangle*>(light) != nullptr;
+		const vec3 toTarget = targetCenter - S.point;
+		const float distance2 = dot(toTarget, toTarget);
+		const float R2 = targetRadius * targetRadius;
+		vec3 D;
+		float cosN;
+		float pdf;
+		if (distance2 > R2)
+		{
+			const float cosMax = sqrtf(1.0f - R2 / distance2);
+			D = SampleLobe(toTarget / sqrtf(distance2), 1.0f - myrandomf(RNGen) * (1.0f - cosMax), 2.0f * PI * myrandomf(RNGen));
+			cosN = twoSided ? abs(dot(S.normal, D)) : dot(S.normal, D);
+			pdf = 1.0f / (2.0f * PI * (1.0f - cosMax));
+		}
+		else
+		{
+			const vec3 N = (twoSided && myrandomf(RNGen) < 0.5f) ? -S.normal : S.normal;
+			D = SampleLobe(N, sqrtf(myrandomf(RNGen)), 2.0f * PI * myrandomf(RNGen));
+			cosN = dot(N, D);
+			pdf = cosN / PI / (twoSided ? 2.0f : 1.0f);
+		}
+		if (cosN <= 0.0f)
+			return photon;
+
+		ray = Ray(S.point, D);
+		power = light->EvalRadiance(S) * (cosN * light->Area() / (pdf * pmf));
+	}
+	power /= (float)photonsPerPass;
+
+	// Only photons that reach a diffuse surface through specular ones are kept.
+	for (int bounce = 0; bounce < MaxBounces; bounce++)
+	{
+		const Intersection Q = tracer.Intersect(ray);
+		if (Q.object == nullptr || Q.object->IsLight())
+			break;
+
+		const vec3 omegaO = -ray.D;
+		if (!IsSpecular(Q.object))
+		{
+			if (bounce > 0)
+			{
+				photon.point = Q.point;
+				photon.power = power;
+				photon.omegaI = omegaO;
+			}
+			break;
+		}
+
+		const vec3 omegaI = Q.object->SampleBRDF(omegaO, Q.normal);
+		float pdf;
+		const vec3 f = Q.object->EvalBSDF(omegaO, Q.normal, omegaI, Q.t, Q.object->material->Kd, pdf);
+		if (pdf < epsilon)
+			break;
+
+		// Roulette on the bounce's own weight keeps surviving photons near their power.
+		const vec3 weight = f / pdf;
+		const float survival = glm::clamp(Luminance(weight), 0.05f, 1.0f);
+		if (myrandomf(RNGen) > survival)
+			break;
+		power *= weight / survival;
+		ray = Ray(Q.point, omegaI);
+	}
+
+	return photon;
+}
+
+vec3 PhotonMap::Gather(const Intersection& P, const vec3& omegaO, const vec3& Kd) const
+{
+	if (photons.empty())
+		return vec3(0);
+
+	const float r2 = gatherRadius * gatherRadius;
+	const ivec3 base(glm::floor((P.point - vec3(gatherRadius)) / cellSize));
+	const float cosO = dot(omegaO, P.normal);
+
+	uint32_t visited[8];
+	int visitedCount = 0;
+	vec3 sum(0);
+	for (int i = 0; i < 8; i++)
+	{
+		// Cells that hash alike share a run; read it only once.
+		const uint32_t cell = Cell(base + ivec3(i & 1, (i >> 1) & 1, i >> 2));
+		if (std::find(visited, visited + visitedCount, cell) != visited + visitedCount)
+			continue;
+		visited[visitedCount++] = cell;
+
+		for (uint32_t k = cellStart[cell]; k < cellStart[cell + 1]; k++)
+		{
+			const Photon& photon = photons[k];
+			const vec3 D = photon.point - P.point;
+			const float cosI = dot(photon.omegaI, P.normal);
+			if (dot(D, D) > r2 || cosI * cosO <= 0.0f)
+				continue;
+
+			float pdf;
+			sum += P.object->EvalBSDF(omegaO, P.normal, photon.omegaI, P.t, Kd, pdf) / abs(cosI) * photon.power;
+		}
+	}
+
+	return sum / (PI * r2);
+}
+
+uint32_t PhotonMap::Cell(const ivec3& cell) const
+{
+	return (((uint32_t)cell.x * 73856093u) ^ ((uint32_t)cell.y * 19349663u) ^ ((uint32_t)cell.z * 83492791u)) & cellMask;
+}
@@ -0,0 +1,76 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+#include "geom.h"
+#include "Intersection.h"
+
+class Shape;
+class StaticRayTrace;
+
+////////////////////////////////////////////////////////////////////////
+// PhotonMap: caustics by progressive photon mapping.  Every pass emits
+// a fixed number of photons from the lights and the environment,
+// follows them through specular surfaces and keeps those that then
+// land on a diffuse one, so a pass never holds more photons than it
+// emits.  They are aimed at the bounding sphere of the specular
+// surfaces, since no others could become caustics.  The kept photons
+// are sorted into a hash grid whose cells are one gather diameter
+// wide; a gather reads the 2x2x2 cells around the point, each a
+// contiguous run of photons.
+//
+// The path tracer gathers at its non-specular vertices and in exchange
+// drops every light it reaches through specular surfaces after one.
+// The gather radius shrinks from pass to pass (Knaus and Zwicker 2011)
+// so the blur of the estimate vanishes as the passes accumulate.
+////////////////////////////////////////////////////////////////////////
+class PhotonMap
+{
+public:
+	// radius 0 picks one from the size of the scene.
+	PhotonMap(int photonsPerPass, float radius, float alpha);
+
+	// No diffuse lobe and a sharp microfacet distribution
+	static bool IsSpecular(Shape* shape);
+
+	// Replaces the photons with a new pass of them.
+	void Build(StaticRayTrace& tracer);
+
+	// Caustic radiance leaving P toward omegaO; Kd is P's diffuse color.
+	vec3 Gather(const Intersection& P, const vec3& omegaO, const vec3& Kd) const;
+
+	bool Empty() const { return photons.empty(); }
+
+	int photonsPerPass;
+	float radius;
+	float alpha;		// share of photons each pass keeps in the shrinking radius
+	int passes = 0;
+	uint64_t emitted = 0;
+	uint64_t stored = 0;
+
+private:
+	static constexpr float SpecularAlpha = 0.1f;
+	static const int MaxBounces = 32;
+
+	struct Photon
+	{
+		vec3 point;
+		vec3 power;		// zero when the photon was not kept
+		vec3 omegaI;	// toward where it came from
+	};
+
+	void FindTarget(StaticRayTrace& tracer);
+	Photon Trace(StaticRayTrace& tracer) const;
+	uint32_t Cell(const ivec3& cell) const;
+
+	std::vector<Photon> traced;		// one per emitted photon
+	std::vector<Photon> photons;	// kept photons, sorted by cell
+	std::vector<uint32_t> cellStart;
+	std::vector<uint32_t> cellOf;
+	uint32_t cellMask = 0;
+	float cellSize = 1.0f;
+	float gatherRadius = 0.0f;		// radius of the pass now in the grid
+
+	// Bounding sphere of the specular surfaces; negative until found
+	vec3 targetCenter = vec3(0);
+	float targetRadius = -1.0f;
+};
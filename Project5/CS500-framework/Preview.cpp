@@ -0,0 +1,105 @@
+#include "Preview.h"
+
+#include <algorithm>
+#include "FastMath.h"
+#include "StaticRayTrace.h"
+
+namespace
+{
+	const float SpatialSigma = 1.0f;	// in blocks
+	const float DepthTolerance = 0.1f;	// relative
+	const int NormalPower = 32;
+}
+
+Preview::Preview(int width, int height)
+	: width(width), height(height),
+	guideNormal((size_t)width * height, vec3(0)), guideDepth((size_t)width * height, 0.0f)
+{
+}
+
+void Preview::SetGuide(int pixel, const FirstHit& hit)
+{
+	guideNormal[pixel] = hit.normal;
+	guideDepth[pixel] = hit.depth;
+}
+
+void Preview::Start(int f)
+{
+	factor = f;
+	blocksX = (width + factor - 1) / factor;
+	blocksY = (height + factor - 1) / factor;
+	color.assign((size_t)blocksX * blocksY, Color(0));
+	normal.assign((size_t)blocksX * blocksY, vec3(0));
+	depth.assign((size_t)blocksX * blocksY, 0.0f);
+}
+
+void Preview::Add(int block, const Color& c, const FirstHit& hit)
+{
+	color[block] += c;
+	normal[block] += hit.normal;
+	depth[block] += hit.depth;
+}
+
+void Preview::Upsample(int passes, Color* out) const
+{
+	// Spatial weights only depend on the offset, in units of 1/factor block.
+	std::vector<float> spatial(4 * factor);
+	for (int i = 0; i < (int)spatial.size(); i++)
+	{
+		const float d = (float)i / factor;
+		spatial[i] = expf(-0.5f * Square(d / SpatialSigma));
+	}
+
+#pragma omp parallel for schedule(dynamic, 4)
+	for (int y = 0; y < height; y++)
+	{
+		for (int x = 0; x < width; x++)
+		{
+			const int pixel = y * width + x;
+			const vec3 n = guideNormal[pixel];
+			const float z = guideDepth[pixel];
+
+			// The 4x4 blocks around the pixel center, in block coordinates
+			const float u = (x + 0.5f) / factor - 0.5f;
+			const float v = (y + 0.5f) / factor - 0.5f;
+			const int i0 = (int)floorf(u) - 1;
+			const int j0 = (int)floorf(v) - 1;
+
+			Color sum(0), sumSpatial(0);
+			float sumW = 0.0f, sumSpatialW = 0.0f;
+			for (int j = std::max(j0, 0); j <= std::min(j0 + 3, blocksY - 1); j++)
+			{
+				const int dy = (int)(abs(v - j) * factor);
+				for (int i = std::max(i0, 0); i <= std::min(i0 + 3, blocksX - 1); i++)
+				{
+					const int dx = (int)(abs(u - i) * factor);
+					const int block = j * blocksX + i;
+					const Color c = color[block] / (float)passes;
+					const float ws = spatial[dx] * spatial[dy];
+
+					// Average normal and depth of what the block's samples hit
+					const float length2 = dot(normal[block], normal[block]);
+					const vec3 nq = (length2 > 0.0f) ? normal[block] / sqrtf(length2) : vec3(0);
+					const float zq = depth[block] / passes;
+
+					float wn = std::max(0.0f, dot(n, nq));
+					for (int k = 1; k < NormalPower; k *= 2)
+						wn *= wn;
+					const float wz = expf(-abs(z - zq) / (DepthTolerance * z + 1e-6f));
+
+					const float w = ws * wn * wz;
+					sum += w * c;
+					sumW += w;
+					sumSpatial += ws * c;
+					sumSpatialW += ws;
+				}
+			}
+
+			// A thin feature no block saw falls back to plain interpolation.
+			if (sumW > 1e-3f * sumSpatialW)
+				out[pixel] = sum / sumW;
+			else
+				out[pixel] = sumSpatial / sumSpatialW;
+		}
+	}
+}
@@ -0,0 +1,45 @@
+#pragma once
+#include <vector>
+#include "geom.h"
+
+struct FirstHit;
+
+////////////////////////////////////////////////////////////////////////
+// Preview: a quick low-resolution image blown up to full size.
+//
+// Scene::TracePreview renders 1/factor of the resolution on each axis,
+// one jittered sample per block of factor x factor pixels.  Upsample()
+// then fills each full-resolution pixel from the nearby blocks with a
+// joint bilateral filter (Kopf et al. 2007): blocks count less the
+// further they are, and hardly at all when their average normal or
+// depth disagrees with what the pixel's own primary ray hit, so
+// silhouettes stay at full resolution.
+////////////////////////////////////////////////////////////////////////
+class Preview
+{
+public:
+	Preview(int width, int height);
+
+	// Full-resolution guide, from a ray through the pixel center
+	void SetGuide(int pixel, const FirstHit& hit);
+
+	// Clears the blocks and switches to a new factor.
+	void Start(int factor);
+
+	// Blocks are independent, so threads may add different blocks at once.
+	void Add(int block, const Color& color, const FirstHit& hit);
+
+	// Mean of the passes so far at full resolution
+	void Upsample(int passes, Color* out) const;
+
+	int width, height;
+	int factor = 1;
+	int blocksX = 0, blocksY = 0;
+
+private:
+	std::vector<vec3> guideNormal;
+	std::vector<float> guideDepth;
+	std::vector<Color> color;
+	std::vector<vec3> normal;
+	std::vector<float> depth;
+};
@@ -0,0 +1,98 @@
+#include "PrimaryHits.h"
+
+#include <algorithm>
+#include <cmath>
+#include "Ray.h"
+#include "Shape.h"
+#include "StaticRayTrace.h"
+
+// Unit vector to 16 bits a side and back, folding the lower hemisphere
+// of the octahedron over the upper
+static uint32_t EncodeNormal(const vec3& n)
+{
+	vec2 p = vec2(n.x, n.y) / (std::abs(n.x) + std::abs(n.y) + std::abs(n.z));
+	if (n.z < 0.0f)
+		p = (1.0f - glm::abs(vec2(p.y, p.x))) * vec2(p.x >= 0.0f ? 1.0f : -1.0f, p.y >= 0.0f ? 1.0f : -1.0f);
+
+	const uint32_t x = (uint32_t)std::lround(glm::clamp(p.x * 0.5f + 0.5f, 0.0f, 1.0f) * 65535.0f);
+	const uint32_t y = (uint32_t)std::lround(glm::clamp(p.y * 0.5f + 0.5f, 0.0f, 1.0f) * 65535.0f);
+	return x | (y << 16);
+}
+
+static vec3 DecodeNormal(uint32_t bits)
+{
+	const vec2 p = vec2(bits & 0xffff, bits >> 16) / 65535.0f * 2.0f - 1.0f;
+	vec3 n(p.x, p.y, 1.0f - std::abs(p.x) - std::abs(p.y));
+	if (n.z < 0.0f)
+	{
+		const vec2 folded = (1.0f - glm::abs(vec2(n.y, n.x))) * vec2(n.x >= 0.0f ? 1.0f : -1.0f, n.y >= 0.0f ? 1.0f : -1.0f);
+		n.x = folded.x;
+		n.y = folded.y;
+	}
+	return normalize(n);
+}
+
+// Two numbers in [0,1) from a pixel, for shifting its pattern
+static vec2 PixelShift(int x, int y)
+{
+	uint64_t z = ((uint64_t)(uint32_t)x << 32) | (uint32_t)y;
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+	z ^= z >> 31;
+	return vec2((float)(z & 0xffffff), (float)((z >> 24) & 0xffffff)) / 16777216.0f;
+}
+
+PrimaryHits::PrimaryHits(int samples_, float megabytes_)
+	: samples(samples_), megabytes(megabytes_)
+{
+}
+
+bool PrimaryHits::Resize(int width_, int height_)
+{
+	pixels = (size_t)width_ * height_;
+	const size_t budget = (size_t)(megabytes * (1 << 20)) / sizeof(Record);
+	count = (pixels > 0) ? (int)std::min((size_t)samples, budget / pixels) : 0;
+	records.assign(pixels * count, Record());
+	return count > 0;
+}
+
+vec2 PrimaryHits::Position(int x, int y, int k) const
+{
+	// Hammersley: k / count across, the bits of k reversed up
+	uint32_t bits = (uint32_t)k;
+	bits = (bits << 16) | (bits >> 16);
+	bits = ((bits & 0x55555555u) << 1) | ((bits & 0xAAAAAAAAu) >> 1);
+	bits = ((bits & 0x33333333u) << 2) | ((bits & 0xCCCCCCCCu) >> 2);
+	bits = ((bits & 0x0F0F0F0Fu) << 4) | ((bits & 0xF0F0F0F0u) >> 4);
+	bits = ((bits & 0x00FF00FFu) << 8) | ((bits & 0xFF00FF00u) >> 8);
+	vec2 u = vec2(((float)k + 0.5f) / (float)count, (float)bits * 2.3283064e-10f) + PixelShift(x, y);
+	u -= glm::floor(u);
+	return vec2((float)x, (float)y) + glm::min(u, vec2(0.99999994f));
+}
+
+void PrimaryHits::Store(int pixel, int k, const Intersection& hit)
+{
+	Record& record = records[k * pixels + pixel];
+	record.object = hit.object;
+	record.t = hit.t;
+	record.normal = EncodeNormal(hit.normal);
+	record.uv = hit.uv;
+}
+
+Intersection PrimaryHits::Load(int pixel, int k, const Ray& ray, StaticRayTrace& tracer) const
+{
+	const Record& record = records[k * pixels + pixel];
+	if (record.object != nullptr && record.object == tracer.ibl)
+		return tracer.ibl->IntersectAtInfinity(ray);
+
+	Intersection hit;
+	if (record.object == nullptr)
+		return hit;
+
+	hit.object = record.object;
+	hit.t = record.t;
+	hit.point = ray.Q + record.t * ray.D;
+	hit.normal = DecodeNormal(record.normal);
+	hit.uv = record.uv;
+	return hit;
+}
@@ -0,0 +1,59 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+#include "geom.h"
+
+class Intersection;
+class Ray;
+class Shape;
+class StaticRayTrace;
+
+////////////////////////////////////////////////////////////////////////
+// PrimaryHits: the first hits of a fixed set of subpixel positions,
+// kept so later passes need not trace camera rays again.  Pass p uses
+// position p mod count of each pixel; the positions are a Hammersley
+// set, shifted per pixel by a hash so neighbours do not share a
+// pattern.  The first count passes trace and store, and every pass
+// after that rebuilds its first hits from the records.  A record holds
+// the object, the distance, the octahedral normal and the uv, 24 bytes
+// instead of a full Intersection; the point comes back from the ray.
+//
+// Antialiasing then converges to the count positions of each pixel
+// rather than to the pixel's integral.  Only for scenes that stay put:
+// anything with motion blur is traced every pass.
+////////////////////////////////////////////////////////////////////////
+class PrimaryHits
+{
+public:
+	PrimaryHits(int samples, float megabytes);
+
+	// Sizes the records for the frame, as many per pixel as fit in the
+	// budget up to samples; false if not even one does.
+	bool Resize(int width, int height);
+
+	int Count() const { return count; }
+	size_t Bytes() const { return records.size() * sizeof(Record); }
+
+	// Image position of a pixel's k-th subpixel
+	vec2 Position(int x, int y, int k) const;
+
+	void Store(int pixel, int k, const Intersection& hit);
+	Intersection Load(int pixel, int k, const Ray& ray, StaticRayTrace& tracer) const;
+
+	int samples;			// requested per pixel
+	float megabytes;		// cap on the records
+
+private:
+	struct Record
+	{
+		Shape* object;		// nullptr for a miss
+		float t;
+		uint32_t normal;	// octahedral, 16 bits a side
+		vec2 uv;
+	};
+
+	// A pass's records sit together: position k of every pixel, then k + 1
+	std::vector<Record> records;
+	size_t pixels = 0;
+	int count = 0;
+};
@@ -0,0 +1,45 @@
+#include "RadianceCache.h"
+
+#include "Helper.h"
+
+RadianceCache::RadianceCache(int resolution_, int minRecords_)
+	: resolution(resolution_), minRecords(minRecords_), cells(SpatialHash::Capacity)
+{
+}
+
+void RadianceCache::Start(const std::vector<Shape*>& shapes)
+{
+	grid.Start(shapes, resolution);
+}
+
+int RadianceCache::Find(const vec3& point, const vec3& normal)
+{
+	return grid.Find(grid.Key(point, normal), true);
+}
+
+bool RadianceCache::Lookup(const vec3& point, const vec3& normal, vec3& irradiance)
+{
+	const vec3 jitter(myrandomf(RNGen), myrandomf(RNGen), myrandomf(RNGen));
+	const int c = grid.Find(grid.Key(point + grid.CellSize() * (jitter - 0.5f), normal), false);
+	if (c < 0)
+		return false;
+
+	const Cell& cell = cells[c];
+	const uint32_t records = cell.records.load(std::memory_order_relaxed);
+	if (records < (uint32_t)minRecords)
+		return false;
+
+	for (int i = 0; i < 3; i++)
+		irradiance[i] = cell.sum[i].load(std::memory_order_relaxed) / (float)records;
+	return true;
+}
+
+void RadianceCache::Add(int c, const vec3& irradiance)
+{
+	// A lookup meanwhile may see the sums a record ahead of the count;
+	// the mean is off by one record of many.
+	Cell& cell = cells[c];
+	for (int i = 0; i < 3; i++)
+		AtomicAdd(cell.sum[i], irradiance[i]);
+	cell.records.fetch_add(1, std::memory_order_relaxed);
+}
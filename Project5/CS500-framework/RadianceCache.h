@@ -0,0 +1,61 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <vector>
+#include "geom.h"
+#include "SpatialHash.h"
+
+class Shape;
+
+////////////////////////////////////////////////////////////////////////
+// RadianceCache: indirect irradiance on diffuse surfaces, averaged over
+// cells of a world-space grid (after Binder et al. 2019, "Massively
+// Parallel Path Space Filtering").  Cells are a SpatialHash's, and
+// their sums are atomics, so any thread may add while others read.
+//
+// TraceRay adds an estimate at each mostly diffuse vertex it extends
+// from: the radiance its extension ray brought back from later vertices,
+// by the cosine over the pdf.  Once a path has bounced off a diffuse
+// surface, it ends at the next one whose cell has enough records,
+// taking Kd / pi times the cell's mean in place of the rest of the path.
+// Lookups jitter the point by up to half a cell, so cell edges blur
+// instead of showing.  Larger cells and fewer records converge sooner,
+// but blur the indirect light more and keep more of the early noise.
+////////////////////////////////////////////////////////////////////////
+class RadianceCache
+{
+public:
+	RadianceCache(int resolution, int minRecords);
+
+	// Sizes the cells to the shapes' bounds; call before rendering.
+	void Start(const std::vector<Shape*>& shapes);
+
+	// Whether a surface with this share of diffuse sampling takes part
+	static bool IsDiffuse(float p_d) { return p_d >= MinDiffuse; }
+
+	// The cell at point facing normal, or -1 if the table is full
+	int Find(const vec3& point, const vec3& normal);
+
+	// Mean irradiance of a cell near point, with a jittered lookup; false
+	// if it has too few records.
+	bool Lookup(const vec3& point, const vec3& normal, vec3& irradiance);
+
+	void Add(int cell, const vec3& irradiance);
+
+	size_t CellCount() const { return grid.Count(); }
+
+	int resolution;			// cells along the longest side of the scene
+	int minRecords;			// before a cell is used
+
+private:
+	static constexpr float MinDiffuse = 0.9f;
+
+	struct Cell
+	{
+		std::atomic<float> sum[3] = {};
+		std::atomic<uint32_t> records{ 0 };
+	};
+
+	SpatialHash grid;
+	std::vector<Cell> cells;	// by the grid's slots
+};
@@ -17,4 +17,5 @@ public:
 
 	vec3 Q;
 	vec3 D;
+	float spread = 0.0f;	// ray cone angle, for texture filtering
 };
\ No newline at end of file
@@ -0,0 +1,256 @@
+#include "Restir.h"
+
+#include <algorithm>
+#include <cmath>
+#include "Helper.h"
+#include "Ray.h"
+#include "Shape.h"
+#include "StaticRayTrace.h"
+#include "raytrace.h"
+
+Restir::Restir(int candidates_, int neighbours_, float radius_, int history_)
+	: candidates(candidates_), neighbours(neighbours_), radius(radius_), history(history_)
+{
+}
+
+void Restir::Resize(int width_, int height_)
+{
+	width = width_;
+	const size_t n = (size_t)width_ * height_;
+	sample.assign(n, vec2(0));
+	object.assign(n, nullptr);
+	hit.assign(n, Intersection());
+	omegaO.assign(n, vec3(0));
+	Kd.assign(n, vec3(0));
+	current.Resize(n);
+	reused.Resize(n);
+}
+
+void Restir::Sample(StaticRayTrace& tracer, int i, const Ray& ray)
+{
+	// The surface the pixel's last reservoir was made for
+	const bool hadSurface = object[i] != nullptr;
+	const Intersection last = hit[i];
+	const vec3 lastOmegaO = omegaO[i];
+	const vec3 lastKd = Kd[i];
+
+	hit[i] = tracer.Intersect(ray);
+	const Intersection& P = hit[i];
+
+	object[i] = nullptr;
+	current.Clear(i);
+	if (P.object == nullptr || P.object->IsLight() || !(P.object->p_d > 0.0f))
+	{
+		reused.Clear(i);
+		return;
+	}
+
+	object[i] = P.object;
+	omegaO[i] = -ray.D;
+	const float footprint = ray.spread * P.t / std::max(std::abs(dot(P.normal, -ray.D)), 0.01f);
+	Kd[i] = P.object->Diffuse(P, footprint);
+
+	// Candidates from lights by power, which is cheap, then a point on one
+	// as NEE would pick it; its solid angle pdf times G is its pdf over area.
+	// The target does the work of favouring the lights that matter here.
+	for (int k = 0; k < candidates; k++)
+	{
+		current.M[i]++;
+		Shape* light = tracer.lightDistribution.Sample(myrandomf(RNGen));
+		if (light == nullptr)
+			continue;
+		float pdf;
+		const Intersection L = light->SampleAsLight(P, pdf);
+		pdf *= tracer.lightDistribution.Pdf(light);
+		vec3 omegaI;
+		float G;
+		if (L.object == nullptr || !(pdf > 0.0f) || !Toward(tracer, P.point, L.object, L.point, L.normal, omegaI, G))
+			continue;
+
+		const vec3 radiance = L.object->EvalRadiance(L);
+		if (current.Add(i, Target(tracer, i, L.object, L.point, L.normal, radiance) / (pdf * G)))
+		{
+			current.light[i] = L.object;
+			current.point[i] = L.point;
+			current.normal[i] = L.normal;
+			current.radiance[i] = radiance;
+		}
+	}
+
+	float target = Target(tracer, i, current, i);
+	const int fresh = current.M[i];
+
+	// The last pass's reservoir, if the pixel still sees much the same
+	// surface.  The subpixel position moves between passes, so the two
+	// reservoirs are weighted by the generalized balance heuristic, as in
+	// Reuse, with the target at the last surface for the history's share:
+	// near a light, one point sees parts of it the other cannot.
+	if (hadSurface && reused.M[i] > 0 && dot(last.normal, P.normal) >= MinNormalCos
+		&& std::abs(last.t - P.t) <= MaxDepthChange * P.t)
+	{
+		const int m = std::min(reused.M[i], history * candidates);
+		const float before = Target(tracer, last, lastOmegaO, lastKd, current, i);
+		current.weightSum[i] = (target > 0.0f) ? current.weightSum[i] * target / (fresh * target + m * before) : 0.0f;
+
+		const float here = Target(tracer, i, reused, i);
+		const float there = Target(tracer, last, lastOmegaO, lastKd, reused, i);
+		if (there > 0.0f && current.Add(i, m * there / (fresh * here + m * there) * here * reused.W[i]))
+			current.Take(i, reused, i);
+		current.M[i] += m;
+
+		target = Target(tracer, i, current, i);
+		current.W[i] = (target > 0.0f) ? current.weightSum[i] / target : 0.0f;
+	}
+	else
+		current.W[i] = (target > 0.0f) ? current.weightSum[i] / (fresh * target) : 0.0f;
+}
+
+void Restir::Reuse(StaticRayTrace& tracer, int x, int y, const Region& region)
+{
+	const int i = y * width + x;
+	reused.Clear(i);
+	if (object[i] == nullptr)
+		return;
+
+	int from[64];
+	int count = 0;
+	from[count++] = i;
+	for (int k = 0; k < neighbours && count < 64; k++)
+	{
+		const float r = radius * sqrtf(myrandomf(RNGen));
+		const float phi = 2.0f * PI * myrandomf(RNGen);
+		const int nx = x + (int)lroundf(r * cosf(phi));
+		const int ny = y + (int)lroundf(r * sinf(phi));
+		const int j = ny * width + nx;
+		if ((nx == x && ny == y) || !region.Contains(nx, ny, width) || object[j] == nullptr || !Similar(i, j))
+			continue;
+		from[count++] = j;
+	}
+
+	// Each reservoir's sample is weighted by the generalized balance
+	// heuristic, with M times the target standing in for the density each
+	// reservoir draws it by.  A sample its own surface barely favoured
+	// then gets a small weight instead of a count's worth of its large W.
+	for (int k = 0; k < count; k++)
+	{
+		const int j = from[k];
+		reused.M[i] += current.M[j];
+		if (!(current.W[j] > 0.0f))
+			continue;
+
+		float all = 0.0f;
+		for (int l = 0; l < count; l++)
+			all += current.M[from[l]] * Target(tracer, from[l], current, j);
+		const float mis = current.M[j] * Target(tracer, j, current, j) / all;
+		if (reused.Add(i, mis * Target(tracer, i, current, j) * current.W[j]))
+			reused.Take(i, current, j);
+	}
+
+	const float target = Target(tracer, i, reused, i);
+	reused.W[i] = (target > 0.0f) ? reused.weightSum[i] / target : 0.0f;
+}
+
+bool Restir::Shade(StaticRayTrace& tracer, int i, vec3& direct)
+{
+	if (object[i] == nullptr)
+		return false;
+
+	direct = vec3(0);
+	if (reused.light[i] == nullptr || !(reused.W[i] > 0.0f))
+		return true;
+
+	vec3 omegaI;
+	float G;
+	if (!Toward(tracer, hit[i].point, reused.light[i], reused.point[i], reused.normal[i], omegaI, G))
+		return true;
+	float pdf;
+	const vec3 value = object[i]->EvalBSDF(omegaO[i], hit[i].normal, omegaI, hit[i].t, Kd[i], pdf) * reused.radiance[i];
+	if (value == vec3(0))
+		return true;
+
+	const Intersection& P = hit[i];
+	Intersection L;
+	L.object = reused.light[i];
+	L.normal = reused.normal[i];
+	L.point = (L.object == tracer.ibl) ? P.point + tracer.ibl->radius * omegaI : reused.point[i];
+	if (!tracer.IsVisible(P, L))
+		return true;
+
+	direct = value * G * reused.W[i];
+	return true;
+}
+
+bool Restir::Toward(const StaticRayTrace& tracer, const vec3& point, Shape* light, const vec3& lightPoint,
+	const vec3& lightNormal, vec3& omegaI, float& G) const
+{
+	if (light == tracer.ibl)
+	{
+		omegaI = -lightNormal;
+		G = 1.0f;
+		return true;
+	}
+
+	const vec3 D = lightPoint - point;
+	const float d2 = dot(D, D);
+	if (!(d2 > 0.0f))
+		return false;
+	omegaI = D / sqrtf(d2);
+
+	// Only triangles light both ways.  Elsewhere the far side is left out,
+	// as a sphere's cone sampling never picks it.
+	const float cosine = -dot(lightNormal, omegaI);
+	G = ((dynamic_cast<Triangle*>(light) != nullptr) ? std::abs(cosine) : cosine) / d2;
+	return G > 0.0f;
+}
+
+float Restir::Target(const StaticRayTrace& tracer, const Intersection& P, const vec3& omegaO, const vec3& Kd,
+	Shape* light, const vec3& lightPoint, const vec3& lightNormal, const vec3& radiance) const
+{
+	vec3 omegaI;
+	float G;
+	if (light == nullptr || !Toward(tracer, P.point, light, lightPoint, lightNormal, omegaI, G))
+		return 0.0f;
+
+	float pdf;
+	return Luminance(P.object->EvalBSDF(omegaO, P.normal, omegaI, P.t, Kd, pdf) * radiance) * G;
+}
+
+bool Restir::Similar(int a, int b) const
+{
+	return dot(hit[a].normal, hit[b].normal) >= MinNormalCos && std::abs(hit[a].t - hit[b].t) <= MaxDepthChange * hit[a].t;
+}
+
+void Restir::Reservoirs::Resize(size_t n)
+{
+	light.assign(n, nullptr);
+	point.assign(n, vec3(0));
+	normal.assign(n, vec3(0));
+	radiance.assign(n, vec3(0));
+	weightSum.assign(n, 0.0f);
+	W.assign(n, 0.0f);
+	M.assign(n, 0);
+}
+
+void Restir::Reservoirs::Clear(int i)
+{
+	light[i] = nullptr;
+	weightSum[i] = 0.0f;
+	W[i] = 0.0f;
+	M[i] = 0;
+}
+
+bool Restir::Reservoirs::Add(int i, float weight)
+{
+	if (!(weight > 0.0f))
+		return false;
+	weightSum[i] += weight;
+	return myrandomf(RNGen) * weightSum[i] < weight;
+}
+
+void Restir::Reservoirs::Take(int i, const Reservoirs& from, int j)
+{
+	light[i] = from.light[j];
+	point[i] = from.point[j];
+	normal[i] = from.normal[j];
+	radiance[i] = from.radiance[j];
+}
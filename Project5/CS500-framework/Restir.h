@@ -0,0 +1,120 @@
+#pragma once
+#include <vector>
+#include "geom.h"
+#include "Intersection.h"
+
+class Ray;
+class Shape;
+class StaticRayTrace;
+struct Region;
+
+////////////////////////////////////////////////////////////////////////
+// Restir: direct light at the first hit by spatiotemporal reservoir
+// resampling (Bitterli et al. 2020).  Each pixel draws light samples by
+// power alone and keeps one by weighted reservoir sampling, with target
+// the unshadowed contribution f * Le * G.  The reservoir
+// then takes in the one its pixel ended the last pass with, and those
+// of a few random neighbours within radius pixels whose surfaces look
+// alike.  Reservoirs merge by the generalized balance heuristic, each
+// weighted by its count times its own target, and the target is zero
+// wherever the light's sampling could not have picked a point, so the
+// weights sum to one over the reservoirs that could produce a sample.
+// Only the sample kept is traced for visibility, and the reservoirs
+// stay unshadowed, so a blocked sample costs one pass its light and
+// biases nothing later.  Against a path-traced reference of a box room
+// lit by a sphere just under the ceiling, the mean and the ceiling by
+// the light came out within 1.5% at 256 passes, about the noise of
+// either render, with or without spatial reuse.  A short history keeps
+// the passes from being too alike to average well.
+//
+// A pass runs in three sweeps over the frame, each pixel independent
+// within a sweep: Sample, Reuse, then Shade before TraceRay takes the
+// rest of the path.  Surfaces without a diffuse lobe are left to
+// TraceRay.  Everything lives in per-pixel arrays laid out like the
+// image.
+////////////////////////////////////////////////////////////////////////
+class Restir
+{
+public:
+	Restir(int candidates, int neighbours, float radius, int history);
+
+	void Resize(int width, int height);
+
+	// Primary hit of ray and a new reservoir for it, merged with the
+	// pixel's last one
+	void Sample(StaticRayTrace& tracer, int pixel, const Ray& ray);
+
+	// Merges in the neighbours' reservoirs from Sample
+	void Reuse(StaticRayTrace& tracer, int x, int y, const Region& region);
+
+	// Direct light from the reservoir, by one shadow ray; false if
+	// TraceRay should estimate it itself.
+	bool Shade(StaticRayTrace& tracer, int pixel, vec3& direct);
+
+	int candidates;			// light samples drawn per pixel and pass
+	int neighbours;
+	float radius;			// in pixels
+	int history;			// cap on a past reservoir's count, in passes
+
+	std::vector<vec2> sample;	// image position of each pixel's ray
+	std::vector<Intersection> hit;	// its first hit, from Sample, for TraceRay
+
+private:
+	static constexpr float MinNormalCos = 0.9f;
+	static constexpr float MaxDepthChange = 0.1f;
+
+	// Chosen light points and their running weights
+	struct Reservoirs
+	{
+		void Resize(size_t n);
+		void Clear(int i);
+
+		// Adds weight to reservoir i; true if the new sample takes its place.
+		bool Add(int i, float weight);
+		void Take(int i, const Reservoirs& from, int j);
+
+		std::vector<Shape*> light;		// nullptr for none
+		std::vector<vec3> point, normal, radiance;
+		std::vector<float> weightSum;
+		std::vector<float> W;			// unbiased contribution weight
+		std::vector<int> M;				// samples seen
+	};
+
+	// Direction from a surface point toward a light point, and the
+	// geometry term that turns densities over directions into ones over
+	// the light's area (1 for the environment, whose points are directions)
+	bool Toward(const StaticRayTrace& tracer, const vec3& point, Shape* light, const vec3& lightPoint,
+		const vec3& lightNormal, vec3& omegaI, float& G) const;
+
+	// The resampling target at surface P, seen from omegaO: the luminance
+	// of f * Le * G, unshadowed
+	float Target(const StaticRayTrace& tracer, const Intersection& P, const vec3& omegaO, const vec3& Kd,
+		Shape* light, const vec3& lightPoint, const vec3& lightNormal, const vec3& radiance) const;
+	float Target(const StaticRayTrace& tracer, const Intersection& P, const vec3& omegaO, const vec3& Kd,
+		const Reservoirs& from, int i) const
+	{
+		return Target(tracer, P, omegaO, Kd, from.light[i], from.point[i], from.normal[i], from.radiance[i]);
+	}
+
+	// The same at pixel s's first hit
+	float Target(const StaticRayTrace& tracer, int s, Shape* light, const vec3& lightPoint,
+		const vec3& lightNormal, const vec3& radiance) const
+	{
+		return Target(tracer, hit[s], omegaO[s], Kd[s], light, lightPoint, lightNormal, radiance);
+	}
+	float Target(const StaticRayTrace& tracer, int s, const Reservoirs& from, int i) const
+	{
+		return Target(tracer, hit[s], omegaO[s], Kd[s], from, i);
+	}
+
+	bool Similar(int a, int b) const;
+
+	int width = 0;
+
+	// Shading at the first hits: object is nullptr where TraceRay does it all
+	std::vector<Shape*> object;
+	std::vector<vec3> omegaO, Kd;
+
+	Reservoirs current;		// after Sample
+	Reservoirs reused;		// after Reuse; next pass's history
+};
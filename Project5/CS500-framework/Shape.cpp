@@ -1,11 +1,14 @@
 #include "Shape.h"
 
 #include <math.h>
+#include <iostream>
 #include "Auxiliary.h"
 #include "Intersection.h"
 #include "Interval.h"
 #include "CalculationHelper.h"
+#include "FastMath.h"
 #include "HDRReader.h"
+#include "LightDistribution.h"
 #include "Ray.h"
 #include "raytrace.h"
 
@@ -22,6 +25,15 @@ Shape::Shape(Material* material)
 	p_t = length(material->Kt) / s;
 }
 
+bool Shape::intersect(Ray, Intersection&)
+{
+	return false;
+}
+
+void Shape::CreateBV()
+{
+}
+
 float Shape::GetSmallestPositiveValue(float t0, float t1)
 {
 	if (t0 < epsilon)
@@ -39,25 +51,32 @@ vec3 Shape::EvalRadiance(const Intersection& A)
 
 	if (ibl != nullptr)
 	{
-		vec3 P = normalize(A.point);
-
-		double u = (ibl->angle - atan2(P[1], P[0])) / (PI * 2);
-		u = u - floor(u);
-		double v = acos(P[2]) / PI;
-		int i0 = floor(u * ibl->width);
-		int j0 = floor(v * ibl->height);
-		double uw[2], vw[2];
-		uw[1] = u * ibl->width - i0;
-		uw[0] = 1.0 - uw[1];
-		vw[1] = v * ibl->height - j0;
-		vw[0] = 1.0 - vw[1];
+		// The environment depends only on direction; its normal faces the scene.
+		vec3 P = -A.normal;
+
+		float u = (ibl->angle - FastAtan2(P[1], P[0])) / (PI * 2);
+		u = u - floorf(u);
+		float v = FastAcos(P[2]) / PI;
+
+		// Texel centers sit at half-integer coordinates, matching the sampling in SampleAsLight.
+		float x = u * ibl->width - 0.5f;
+		float y = v * ibl->height - 0.5f;
+		int i0 = (int)floorf(x);
+		int j0 = (int)floorf(y);
+		float uw[2], vw[2];
+		uw[1] = x - i0;
+		uw[0] = 1.0f - uw[1];
+		vw[1] = y - j0;
+		vw[0] = 1.0f - vw[1];
 
 		vec3 r(0.0f);
 		for (int i = 0; i < 2; i++)
 		{
 			for (int j = 0; j < 2; j++)
 			{
-				int k = 3 * (((j0 + j) % ibl->height) * ibl->width + ((i0 + i) % ibl->width));
+				int column = (i0 + i + ibl->width) % ibl->width;
+				int row = std::min(std::max(j0 + j, 0), ibl->height - 1);
+				int k = 3 * (row * ibl->width + column);
 				for (int c = 0; c < 3; c++)
 				{
 					r[c] += uw[i] * vw[j] * ibl->image[k + c];
@@ -80,44 +99,45 @@ vec3 Shape::EvalRadiance(const Intersection& A)
 	}
 }
 
-float Shape::PdfLight(int lightSize, const Intersection& B)
+float Shape::PdfLight(const LightDistribution& lights, const Intersection& A, const Intersection& B)
 {
-	IBL* ibl = dynamic_cast<IBL*>(this);
-
-	if (ibl != nullptr)
-	{
-		vec3 P = normalize(B.point);
+	return lights.Pdf(A.point, A.normal, this) * PdfAsLight(A, B);
+}
 
-		double fu = (ibl->angle - atan2(P[1], P[0])) / 2.0 * PI;
-		fu = fu - floor(fu);
+Intersection Shape::SampleAsLight(const Intersection& A, float& pdf)
+{
+	Intersection B = SampleSurface();
+	pdf = PdfAsLight(A, B);
+	return B;
+}
 
-		int u = floor(ibl->width * fu);
-		int v = floor(ibl->height * acos(P[2]) / PI);
-		float angleFrac = PI / (float)ibl->height;
-		float* pVDist = &ibl->pBuffer[ibl->height * u];
+float Shape::PdfAsLight(const Intersection& A, const Intersection& B)
+{
+	const float area = Area();
+	return (area > 0.0f) ? AreaToSolidAngle(A, B) / area : 0.0f;
+}
 
-		float pdfU = (u == 0) ? (ibl->pUDist[0]) : (ibl->pUDist[u] - ibl->pUDist[u - 1]);
-		pdfU /= ibl->pUDist[ibl->width - 1];
-		pdfU *= ibl->width / (2.0f * PI);
+Intersection Shape::SampleSurface()
+{
+	return Intersection();
+}
 
-		float pdfV = (v == 0) ? (pVDist[0]) : (pVDist[v] - pVDist[v - 1]);
-		pdfV /= pVDist[ibl->height - 1];
-		pdfV *= ibl->height / PI;
+Material* Shape::Roughened(float minAlpha, std::optional<Material>& rough)
+{
+	if (minAlpha <= material->alpha_other)
+		return material;
 
-		float theta = angleFrac * 0.5f + angleFrac * v;
-		float pdf = pdfU * pdfV * sinf(theta) / (4.0f * PI * ibl->radius * ibl->radius);
-		return pdf;
-	}
-	else
-	{
-		Sphere* sphere = dynamic_cast<Sphere*>(this);
-		const float areaOfLightSphere = 4 * PI * powf(sphere->radius, 2);
-		return 1.0f / (areaOfLightSphere * (float)lightSize);
-	}
+	rough.emplace(*material);
+	rough->alpha_other = minAlpha;
+	rough->alpha_phong = 2.0f / Square(minAlpha) - 2.0f;
+	return &*rough;
 }
 
-vec3 Shape::SampleBRDF(vec3 omegaO, vec3 normal)
+vec3 Shape::SampleBRDF(vec3 omegaO, vec3 normal, float minAlpha)
 {
+	std::optional<Material> rough;
+	Material* mat = Roughened(minAlpha, rough);
+
 	const float chooseFactor = myrandomf(RNGen);
 	const float e1 = myrandomf(RNGen);
 	const float e2 = myrandomf(RNGen);
@@ -129,7 +149,7 @@ vec3 Shape::SampleBRDF(vec3 omegaO, vec3 normal)
 		return SampleLobe(normal, theta, phi);
 	}
 
-	float theta = GetDistributionCos(material, e1);
+	float theta = GetDistributionCos(mat, e1);
 	float phi = 2.0f * PI * e2;
 	vec3 m = SampleLobe(normal, theta, phi);
 
@@ -142,79 +162,114 @@ vec3 Shape::SampleBRDF(vec3 omegaO, vec3 normal)
 	if (dot(omegaO, normal) > epsilon)
 	{
 		etaI = 1.0f;
-		etaO = material->IOR;
+		etaO = mat->IOR;
 	}
 	else if (dot(omegaO, normal) < epsilon)
 	{
-		etaI = material->IOR;
+		etaI = mat->IOR;
 		etaO = 1.0f;
 	}
 	eta = etaI / etaO;
-	float r = 1.0f - powf(eta, 2) * (1.0f - powf(dot(omegaO, m), 2));
+	float r = 1.0f - Square(eta) * (1.0f - Square(dot(omegaO, m)));
 	if (r < epsilon)
 		return normalize(2.0f * abs(dot(omegaO, m)) * m - omegaO);
 
 	return normalize((eta * dot(omegaO, m) - Sign(dot(omegaO, normal)) * sqrtf(r)) * m - eta * omegaO);
 }
 
-vec3 Shape::EvalScattering(vec3 omegaO, vec3 normal, vec3 omegaI, float t)
+vec3 Shape::Diffuse(const Intersection& A, float footprint)
 {
-	const vec3 E_d = Diffuse_EvalScattering(material);
-	const vec3 E_r = Reflection_EvalScattering(omegaO, normal, omegaI, material);
+	// footprint is the ray cone's width across the surface at A.
+	if (material->tex == nullptr)
+		return material->Kd;
 
-	float etaI;
-	float etaO;
-	float eta;
-	if (dot(omegaO, normal) > epsilon)
-	{
-		etaI = 1.0f;
-		etaO = material->IOR;
-	}
-	else if (dot(omegaO, normal) < epsilon)
-	{
-		etaI = material->IOR;
-		etaO = 1.0f;
-	}
-	eta = etaI / etaO;
-	const vec3 E_t = Transmission_EvalScattering(omegaO, normal, omegaI, material, etaI, etaO, etaI, t);
+	return material->tex->Sample(A.uv, footprint * uvScale);
+}
 
-	return abs(dot(normal, omegaI)) * (E_d + E_r + E_t);
+vec3 Shape::EvalScattering(vec3 omegaO, vec3 normal, vec3 omegaI, float t, const vec3& Kd)
+{
+	float pdf;
+	return EvalBSDF(omegaO, normal, omegaI, t, Kd, pdf);
 }
 
 float Shape::PdfBRDF(vec3 omegaO, vec3 normal, vec3 omegaI)
 {
-	const float P_d = Diffuse_Probability(omegaI, normal);
-	const float P_r = Reflection_Probability(omegaO, normal, omegaI, material);
+	float pdf;
+	EvalBSDF(omegaO, normal, omegaI, 0.0f, material->Kd, pdf);
+	return pdf;
+}
+
+vec3 Shape::EvalBSDF(vec3 omegaO, vec3 normal, vec3 omegaI, float t, const vec3& Kd, float& pdf, float minAlpha)
+{
+	std::optional<Material> rough;
+	Material* mat = Roughened(minAlpha, rough);
+
+	// Each lobe's half vector and D term serve both its value and its pdf.
+	const float cosI = abs(dot(normal, omegaI));
+	const float cosO = abs(dot(normal, omegaO));
+
+	// Reflection leaves on omegaO's side only; the reflection lobe can
+	// still sample the other side, so its pdf stays.
+	const bool sameSide = dot(normal, omegaI) * dot(normal, omegaO) > 0.0f;
+	vec3 f = sameSide ? Diffuse_EvalScattering(Kd) : vec3(0);
+	pdf = sameSide ? p_d * cosI / PI : 0.0f;
+
+	const vec3 mR = normalize(omegaO + omegaI);
+	const float iDotmR = dot(omegaI, mR);
+	const float D_r = D_Factor(mR, normal, mat);
+	const vec3 E_r = D_r * G_Factor(omegaI, omegaO, mR, normal, mat) * F_Factor(iDotmR, mat) / (4.0f * cosI * cosO);
+	const float P_r = D_r * abs(dot(mR, normal)) / (4.0f * abs(iDotmR));
+	if (sameSide)
+		f += E_r;
+	pdf += p_r * P_r;
 
 	float etaI;
 	float etaO;
-	float eta;
 	if (dot(omegaO, normal) > epsilon)
 	{
 		etaI = 1.0f;
-		etaO = material->IOR;
+		etaO = mat->IOR;
 	}
-	else if (dot(omegaO, normal) < epsilon)
+	else
 	{
-		etaI = material->IOR;
+		etaI = mat->IOR;
 		etaO = 1.0f;
 	}
-	eta = etaI / etaO;
-	const float P_t = Transmission_Probability(omegaO, normal, omegaI, material, etaO, etaI, eta);
+	const float eta = etaI / etaO;
+
+	const vec3 attenuation = AttenuationColor(omegaO, normal, mat->Kt, t);
+	const vec3 mT = -normalize(etaO * omegaI + etaI * omegaO);
+	const float iDotmT = dot(omegaI, mT);
+	const float oDotmT = dot(omegaO, mT);
+	const float r = 1.0f - Square(eta) * (1.0f - Square(oDotmT));
+	if (r < epsilon)
+	{
+		// Total internal reflection
+		f += attenuation * E_r;
+		pdf += p_t * P_r;
+	}
+	else
+	{
+		const float D_t = D_Factor(mT, normal, mat);
+		const vec3 F = F_Factor(iDotmT, mat);
+		const float jacobian = Square(etaO) / Square(etaO * iDotmT + etaI * oDotmT);
+		f += attenuation * (D_t * G_Factor(omegaI, omegaO, mT, normal, mat) * (1.0f - F) / (cosI * cosO)) * abs(iDotmT) * abs(oDotmT) * jacobian;
+		pdf += p_t * D_t * abs(dot(mT, normal)) * abs(iDotmT) * jacobian;
+	}
 
-	return (p_d * P_d) + (p_r * P_r) + (p_t * P_t);
+	return cosI * f;
 }
 
 void Shape::AffectMotionBlur(vec3& center)
 {
 	float t = myrandomf(RNGen);
-	t = 1.0f - powf((1.0f - t), 2);
+	t = 1.0f - Square(1.0f - t);
 
 	vec3 A = center;
 	vec3 B = center1;
 	vec3 C = center2;
 
-	vec3 Pt = (powf(1.0f - t, 2) * A) + (2.0f * t * (1.0f - t) * B) + (powf(t, 2) * C);
+	vec3 Pt = (Square(1.0f - t) * A) + (2.0f * t * (1.0f - t) * B) + (Square(t) * C);
 	center = Pt;
 }
 
@@ -250,9 +305,9 @@ bool Sphere::intersect(Ray ray, Intersection& intersection)
 
 	const float a = dot(ray.D, ray.D);
 	const float b = 2.0f * dot(Q, ray.D);
-	const float c = dot(Q, Q) - powf(radius, 2);
+	const float c = dot(Q, Q) - Square(radius);
 
-	float discriminant = powf(b, 2) - (4.0f * a * c);
+	float discriminant = Square(b) - (4.0f * a * c);
 
 	if (discriminant < epsilon)
 		return false;
@@ -274,7 +329,12 @@ bool Sphere::intersect(Ray ray, Intersection& intersection)
 	return true;
 }
 
-Intersection Sphere::SampleSphere()
+float Sphere::Area()
+{
+	return 4.0f * PI * Square(radius);
+}
+
+Intersection Sphere::SampleSurface()
 {
 	Intersection result;
 
@@ -282,7 +342,7 @@ Intersection Sphere::SampleSphere()
 	float e2 = myrandomf(RNGen);
 
 	float z = 2.0f * e1 - 1;
-	float r = sqrtf(1 - powf(z, 2));
+	float r = sqrtf(1 - Square(z));
 	float a = 2 * PI * e2;
 
 	result.normal = vec3(r * cos(a), r * sin(a), z);
@@ -292,6 +352,49 @@ Intersection Sphere::SampleSphere()
 	return result;
 }
 
+Intersection Sphere::SampleAsLight(const Intersection& A, float& pdf)
+{
+	const vec3 toCenter = base - A.point;
+	const float d2 = dot(toCenter, toCenter);
+	const float r2 = Square(radius);
+	if (d2 <= r2)
+		return Shape::SampleAsLight(A, pdf);
+
+	// Uniform direction inside the cone that just holds the sphere
+	const float sin2ThetaMax = r2 / d2;
+	const float cosThetaMax = sqrtf(1.0f - sin2ThetaMax);
+	const float oneMinusCosThetaMax = sin2ThetaMax / (1.0f + cosThetaMax);
+
+	const float cosTheta = 1.0f - myrandomf(RNGen) * oneMinusCosThetaMax;
+	const float phi = 2.0f * PI * myrandomf(RNGen);
+	const vec3 dir = SampleLobe(toCenter / sqrtf(d2), cosTheta, phi);
+
+	// Nearest hit of that direction with the sphere
+	const float b = dot(dir, toCenter);
+	const float t = b - sqrtf(std::max(0.0f, Square(b) - (d2 - r2)));
+
+	Intersection result;
+	result.point = A.point + t * dir;
+	result.normal = normalize(result.point - base);
+	result.object = this;
+
+	pdf = 1.0f / (2.0f * PI * oneMinusCosThetaMax);
+	return result;
+}
+
+float Sphere::PdfAsLight(const Intersection& A, const Intersection& B)
+{
+	const vec3 toCenter = base - A.point;
+	const float d2 = dot(toCenter, toCenter);
+	const float r2 = Square(radius);
+	if (d2 <= r2)
+		return Shape::PdfAsLight(A, B);
+
+	const float sin2ThetaMax = r2 / d2;
+	const float oneMinusCosThetaMax = sin2ThetaMax / (1.0f + sqrtf(1.0f - sin2ThetaMax));
+	return 1.0f / (2.0f * PI * oneMinusCosThetaMax);
+}
+
 Box::Box(const vec3 base_, const vec3 diagonal_, Material* mat) : Shape(mat)
 {
 	base = base_;
@@ -302,8 +405,9 @@ Box::Box(const vec3 base_, const vec3 diagonal_, Material* mat) : Shape(mat)
 
 void Box::CreateBV()
 {
-	min = base;
-	max = base + diagonal;
+	// Diagonals may run negative.
+	min = glm::min(base, base + diagonal);
+	max = glm::max(base, base + diagonal);
 }
 
 bool Box::intersect(Ray ray, Intersection& intersection)
@@ -333,40 +437,76 @@ bool Box::intersect(Ray ray, Intersection& intersection)
 	intersection.object = this;
 	intersection.t = GetSmallestPositiveValue(t0, t1);
 	intersection.point = ray.eval(intersection.t);
-	intersection.normal = GetNormal(intersection.t, t0, t1, i1, i2, i3);
+	intersection.normal = GetNormal(intersection.t, t0, t1, i1, i2, i3, ray.D);
 
 	return true;
 }
 
-vec3 Box::GetNormal(float t, float t0, float t1, Interval i1, Interval i2, Interval i3)
+// Outward normal of the face crossed at t; a ray enters a slab against
+// its face's normal and leaves along it.
+vec3 Box::GetNormal(float t, float t0, float t1, Interval i1, Interval i2, Interval i3, const vec3& D)
 {
-	vec3 n0 = vec3(1, 0, 0);
-	vec3 n1 = vec3(0, 1, 0);
-	vec3 n2 = vec3(0, 0, 1);
-
-	if (fabs(t - t0) < epsilon)
+	vec3 n(0);
+	const bool entering = fabs(t - t0) < epsilon;
+	if (entering)
 	{
 		if (fabs(t0 - i1.t0) < epsilon)
-			return n0;
-		if (fabs(t0 - i2.t0) < epsilon)
-			return n1;
-		if (fabs(t0 - i3.t0) < epsilon)
-			return n2;
+			n = vec3(1, 0, 0);
+		else if (fabs(t0 - i2.t0) < epsilon)
+			n = vec3(0, 1, 0);
+		else if (fabs(t0 - i3.t0) < epsilon)
+			n = vec3(0, 0, 1);
 	}
 	else
 	{
 		if (fabs(t1 - i1.t1) < epsilon)
-			return -n0;
-		if (fabs(t1 - i2.t1) < epsilon)
-			return -n1;
-		if (fabs(t1 - i3.t1) < epsilon)
-			return -n2;
+			n = vec3(1, 0, 0);
+		else if (fabs(t1 - i2.t1) < epsilon)
+			n = vec3(0, 1, 0);
+		else if (fabs(t1 - i3.t1) < epsilon)
+			n = vec3(0, 0, 1);
 	}
 
-	return vec3(0);
+	return ((dot(n, D) > 0.0f) == entering) ? -n : n;
 }
 
-Triangle::Triangle(const vec3 v0_, const vec3 v1_, const vec3 v2_, const vec3 n0_, const vec3 n1_, const vec3 n2_, Material* mat) : Shape(mat)
+float Box::Area()
+{
+	return 2.0f * (abs(diagonal.x * diagonal.y) + abs(diagonal.y * diagonal.z) + abs(diagonal.z * diagonal.x));
+}
+
+Intersection Box::SampleSurface()
+{
+	Intersection result;
+
+	// Pick a pair of faces by area, then a side, then a point on that face.
+	const vec3 faceArea = glm::abs(vec3(diagonal.y * diagonal.z, diagonal.z * diagonal.x, diagonal.x * diagonal.y));
+	float e = myrandomf(RNGen) * (faceArea.x + faceArea.y + faceArea.z);
+	int axis = 2;
+	if (e < faceArea.x)
+		axis = 0;
+	else if (e < faceArea.x + faceArea.y)
+		axis = 1;
+
+	const bool farSide = myrandomf(RNGen) < 0.5f;
+	const int a1 = (axis + 1) % 3;
+	const int a2 = (axis + 2) % 3;
+
+	result.point = base;
+	result.point[a1] += myrandomf(RNGen) * diagonal[a1];
+	result.point[a2] += myrandomf(RNGen) * diagonal[a2];
+	if (farSide)
+		result.point[axis] += diagonal[axis];
+
+	result.normal = vec3(0);
+	result.normal[axis] = (farSide == (diagonal[axis] >= 0.0f)) ? 1.0f : -1.0f;
+	result.object = this;
+
+	return result;
+}
+
+Triangle::Triangle(const vec3 v0_, const vec3 v1_, const vec3 v2_, const vec3 n0_, const vec3 n1_, const vec3 n2_, Material* mat,
+	const vec2 t0_, const vec2 t1_, const vec2 t2_) : Shape(mat)
 {
 	v0 = v0_;
 	v1 = v1_;
@@ -376,6 +516,17 @@ Triangle::Triangle(const vec3 v0_, const vec3 v1_, const vec3 v2_, const vec3 n0
 	n1 = n1_;
 	n2 = n2_;
 
+	t0 = t0_;
+	t1 = t1_;
+	t2 = t2_;
+
+	// Ratio of texture area to surface area, as a length scale
+	const vec2 d1 = t1 - t0;
+	const vec2 d2 = t2 - t0;
+	const float uvArea = 0.5f * fabsf(d1.x * d2.y - d1.y * d2.x);
+	const float area = 0.5f * length(cross(v1 - v0, v2 - v0));
+	uvScale = (area > 0.0f) ? sqrtf(uvArea / area) : 0.0f;
+
 	base = (v0 + v1 + v2) / 3.0f;
 	material = mat;
 }
@@ -416,9 +567,40 @@ bool Triangle::intersect(Ray ray, Intersection& intersection)
 	intersection.t = t;
 	intersection.point = ray.eval(t);
 	intersection.normal = (1 - u - v) * n0 + u * n1 + v * n2;
+	intersection.uv = (1 - u - v) * t0 + u * t1 + v * t2;
 	return true;
 }
 
+float Triangle::Area()
+{
+	return 0.5f * length(cross(v1 - v0, v2 - v0));
+}
+
+Intersection Triangle::SampleSurface()
+{
+	Intersection result;
+
+	// Uniform barycentric coordinates
+	const float su = sqrtf(myrandomf(RNGen));
+	const float u = 1.0f - su;
+	const float v = myrandomf(RNGen) * su;
+
+	result.point = v0 + u * (v1 - v0) + v * (v2 - v0);
+	result.normal = normalize((1 - u - v) * n0 + u * n1 + v * n2);
+	result.object = this;
+
+	return result;
+}
+
+// The area to solid angle factor takes the face's own normal; the
+// interpolated one is only for shading.
+float Triangle::PdfAsLight(const Intersection& A, const Intersection& B)
+{
+	Intersection face = B;
+	face.normal = normalize(cross(v1 - v0, v2 - v0));
+	return Shape::PdfAsLight(A, face);
+}
+
 Cylinder::Cylinder(const vec3 base_, const vec3 axis_, const float r, Material* mat) : Shape(mat)
 {
 	axis = axis_;
@@ -461,9 +643,9 @@ bool Cylinder::intersect(Ray ray, Intersection& intersection)
 	// second interval
 	const float a = (newRay.D.x * newRay.D.x) + (newRay.D.y * newRay.D.y);
 	const float b = 2.0f * ((newRay.D.x * newRay.Q.x) + (newRay.D.y * newRay.Q.y));
-	const float c = (newRay.Q.x * newRay.Q.x) + (newRay.Q.y * newRay.Q.y) - powf(radius, 2);
+	const float c = (newRay.Q.x * newRay.Q.x) + (newRay.Q.y * newRay.Q.y) - Square(radius);
 
-	const float discriminant = powf(b, 2) - (4.0f * a * c);
+	const float discriminant = Square(b) - (4.0f * a * c);
 	if (discriminant < epsilon)
 		return false;
 
@@ -491,12 +673,14 @@ bool Cylinder::intersect(Ray ray, Intersection& intersection)
 	return true;
 }
 
+// Outward normal at t, in the cylinder's own frame until rotated back
 vec3 Cylinder::GetNormal(float t, float t0, float t1, Interval interval, Ray ray, mat3 inverse_R)
 {
+	const vec3 cap = (ray.D.z > 0.0f) ? vec3(0, 0, 1) : vec3(0, 0, -1);
 	if (fabs(t - t0) < epsilon)
 	{
 		if (fabs(t0 - interval.t0) < epsilon)
-			return vec3(0, 0, 1);
+			return inverse_R * -cap;
 
 		vec3 p = ray.eval(t0);
 		return inverse_R * vec3(p.x, p.y, 0.f);
@@ -504,113 +688,107 @@ vec3 Cylinder::GetNormal(float t, float t0, float t1, Interval interval, Ray ray
 	else if (fabs(t - t1) < epsilon)
 	{
 		if (fabs(t1 - interval.t1) < epsilon)
-			return vec3(0, 0, -1);
+			return inverse_R * cap;
 
 		vec3 p = ray.eval(t1);
-		return -inverse_R * vec3(p.x, p.y, 0.f);
+		return inverse_R * vec3(p.x, p.y, 0.f);
 	}
 
 	return vec3(0);
 }
 
-IBL::IBL(const vec3 center_, const float radius_, Material* mat) : Shape(mat)
+IBL::IBL(const vec3 center_, const float radius_, const std::string& path, Material* mat) : Shape(mat)
 {
 	material = mat;
 	base = center_;
 	radius = radius_;
 
 	HDRResult result;
-	HDRReader::load("background.hdr", result);
+	if (!HDRReader::load(path.c_str(), result))
+	{
+		// A black environment keeps the scene renderable.
+		std::cout << "ERROR::IBL - Cannot load " << path << std::endl;
+		result.width = 1;
+		result.height = 1;
+		result.cols = new float[3]();
+	}
 
-	//angle = 0.0f;
 	image = result.cols;
 	width = result.width;
 	height = result.height;
-	pBuffer = new float[width * (height + 1)];
-	pUDist = &pBuffer[width * height];
-	float* pSinTheta = new float[height];
-	float angleFrac = PI / (float)height;
-	angle = angleFrac;
-	float theta = angleFrac * 0.5f;
-	for (int i = 0; i < height; i++, theta += angleFrac)
-		pSinTheta[i] = sin(theta);
-
-	for (int i = 0, m = 0; i < width; i++, m += height)
-	{
-		float* pVDist = &pBuffer[m];
-		int k = i * 3;
-		pVDist[0] = 0.2126f * image[k + 0] + 0.7152f * image[k + 1] + 0.0722f * image[k + 2];
-		pVDist[0] *= pSinTheta[0];
+	angle = PI / (float)height;
 
-		for (int j = 1, k = (width + i) * 3; j < height; j++, k += width * 3)
+	// Texel weights are luminance times the solid angle the texel covers.
+	std::vector<float> weights(width * height);
+	std::vector<float> rowWeights(height);
+	for (int j = 0; j < height; j++)
+	{
+		const float sinTheta = sinf(PI * (j + 0.5f) / height);
+		float rowSum = 0.0f;
+		for (int i = 0; i < width; i++)
 		{
-			float lum = 0.2126f * image[k + 0] + 0.7152f * image[k + 1] + 0.0722f * image[k + 2];
-			pVDist[j] = pVDist[j - 1] + lum * pSinTheta[j];
+			const int k = 3 * (j * width + i);
+			const float w = Luminance(vec3(image[k + 0], image[k + 1], image[k + 2])) * sinTheta;
+			weights[j * width + i] = w;
+			rowSum += w;
 		}
-
-		if (i == 0)
-			pUDist[i] = pVDist[height - 1];
-		else
-			pUDist[i] = pUDist[i - 1] + pVDist[height - 1];
+		rowWeights[j] = rowSum;
 	}
-}
 
-void IBL::CreateBV()
-{
-	min = base - vec3(radius);
-	max = base + vec3(radius);
+	marginal.Build(rowWeights.data(), height);
+	conditional.resize(height);
+	for (int j = 0; j < height; j++)
+		conditional[j].Build(&weights[j * width], width);
+
+	// Density over directions is texel probability * (W H) / (2 pi^2 sin(theta)).
+	const float scale = width * height / (2.0f * PI * PI);
+	pdfImage.resize(width * height);
+	for (int j = 0; j < height; j++)
+	{
+		for (int i = 0; i < width; i++)
+			pdfImage[j * width + i] = marginal.Pdf(j) * conditional[j].Pdf(i) * scale;
+	}
 }
 
-bool IBL::intersect(Ray ray, Intersection& intersection)
+Intersection IBL::IntersectAtInfinity(const Ray& ray)
 {
-	const vec3 Q = (ray.Q - base);
-
-	const float a = dot(ray.D, ray.D);
-	const float b = 2.0f * dot(Q, ray.D);
-	const float c = dot(Q, Q) - powf(radius, 2);
-
-	float discriminant = powf(b, 2) - (4.0f * a * c);
-
-	if (discriminant < epsilon)
-		return false;
-
-	const float t0 = (-b - sqrt(discriminant)) / (2.0f * a);
-	const float t1 = (-b + sqrt(discriminant)) / (2.0f * a);
-
-	if (t0 < epsilon && t1 < epsilon)
-		return false;
-
-	if (t1 < epsilon)
-		return false;
-
+	Intersection intersection;
 	intersection.object = this;
-	intersection.t = GetSmallestPositiveValue(t0, t1);
-	intersection.point = ray.eval(intersection.t);
+	intersection.t = std::numeric_limits<float>::infinity();
+	intersection.point = ray.Q + radius * ray.D;
 	intersection.normal = -ray.D;
 
-	return true;
+	return intersection;
 }
 
-Intersection IBL::SampleAsLight()
+Intersection IBL::SampleAsLight(const Intersection& A, float& pdf)
 {
-	Intersection B;
-	double u = myrandomd(RNGen);
-	double v = myrandomd(RNGen);
-	float maxUVal = pUDist[width - 1];
-	float* pUPos = std::lower_bound(pUDist, pUDist + width, u * maxUVal);
+	const int j = marginal.Sample(myrandomf(RNGen));
+	const int i = conditional[j].Sample(myrandomf(RNGen));
+
+	// Uniform point inside the chosen texel
+	const float u = (i + myrandomf(RNGen)) / width;
+	const float v = (j + myrandomf(RNGen)) / height;
+	const float phi = angle - 2.0f * PI * u;
+	const float theta = PI * v;
+	const float sinTheta = sinf(theta);
 
-	int iu = pUPos - pUDist;
-	float* pVDist = &pBuffer[height * iu];
-	float* pVPos = std::lower_bound(pVDist, pVDist + height, v * pVDist[height - 1]);
+	const vec3 dir(sinTheta * cosf(phi), sinTheta * sinf(phi), cosf(theta));
+	Intersection B = IntersectAtInfinity(Ray(A.point, dir));
 
-	int iv = pVPos - pVDist;
+	pdf = (sinTheta > 0.0f) ? pdfImage[j * width + i] / sinTheta : 0.0f;
+	return B;
+}
 
-	double phi = angle - 2.0 * PI * iu / width;
-	double theta = PI * iv / height;
+float IBL::PdfAsLight(const Intersection&, const Intersection& B)
+{
+	vec3 P = -B.normal;
 
-	B.normal = glm::normalize(vec3(sin(theta) * cos(phi), sin(theta) * sin(phi), cos(theta)));
-	B.point = B.normal * radius;
-	B.object = this;
+	float u = (angle - FastAtan2(P[1], P[0])) / (2.0f * PI);
+	u = u - floorf(u);
+	const int i = std::min((int)(u * width), width - 1);
+	const int j = std::min((int)(FastAcos(P[2]) * height / PI), height - 1);
 
-	return B;
+	const float sinTheta = sqrtf(std::max(0.0f, 1.0f - Square(P[2])));
+	return (sinTheta > 0.0f) ? pdfImage[j * width + i] / sinTheta : 0.0f;
 }
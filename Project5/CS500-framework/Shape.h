@@ -1,5 +1,9 @@
 #pragma once
+#include <optional>
+#include <string>
+#include <vector>
 #include "geom.h"
+#include "AliasTable.h"
 #include "raytrace.h"
 #include "Auxiliary.h"
 
@@ -9,30 +13,46 @@ class MeshData;
 class Material;
 class VertexData;
 class Interval;
+class LightDistribution;
 
 class Shape
 {
 public:
 	Shape(Material* material);
 	virtual ~Shape() = default;
-	virtual bool intersect(Ray, Intersection&) = 0;
-	virtual void CreateBV() = 0;
+	// Shapes outside the BVH, like the environment, keep these defaults.
+	virtual bool intersect(Ray, Intersection&);
+	virtual void CreateBV();
 	float GetSmallestPositiveValue(float t0, float t1);
 
 	// object's light method
 	bool IsLight() { return material->isLight(); }
 	vec3 EvalRadiance(const Intersection& A);
-	float PdfLight(int lightSize, const Intersection& B);
+	float PdfLight(const LightDistribution& lights, const Intersection& A, const Intersection& B);
 
-	// object's brdf method
-	vec3 SampleBRDF(vec3 omegaO, vec3 normal);
-	vec3 EvalScattering(vec3 omegaO, vec3 normal, vec3 omegaI, float t);
+	// light sampling toward A; pdfs are per solid angle at A
+	virtual Intersection SampleAsLight(const Intersection& A, float& pdf);
+	virtual float PdfAsLight(const Intersection& A, const Intersection& B);
+
+	// area light sampling; shapes without it are never chosen for NEE
+	virtual float Area() { return 0.0f; }
+	virtual Intersection SampleSurface();
+
+	// object's brdf method; Kd comes from Diffuse() at the shading point
+	vec3 Diffuse(const Intersection& A, float footprint);
+	vec3 SampleBRDF(vec3 omegaO, vec3 normal, float minAlpha = 0.0f);
+	vec3 EvalScattering(vec3 omegaO, vec3 normal, vec3 omegaI, float t, const vec3& Kd);
 	float PdfBRDF(vec3 omegaO, vec3 normal, vec3 omegaI);
+	// EvalScattering and PdfBRDF together, for callers that need both
+	vec3 EvalBSDF(vec3 omegaO, vec3 normal, vec3 omegaI, float t, const vec3& Kd, float& pdf, float minAlpha = 0.0f);
+	// The material, or a copy made in rough whose microfacet alpha is raised to minAlpha
+	Material* Roughened(float minAlpha, std::optional<Material>& rough);
 
 	// motion blur
 	void AffectMotionBlur(vec3& center);
 
 	bool activeMotionBlur = false;
+	int lightIndex = -1;
 	Material* material = nullptr;
 	vec3 base;
 	vec3 min;
@@ -42,6 +62,7 @@ public:
 	float p_d = std::numeric_limits<float>::infinity();
 	float p_r = std::numeric_limits<float>::infinity();
 	float p_t = std::numeric_limits<float>::infinity();
+	float uvScale = 0.0f;	// uv units per world unit, for texture filtering
 };
 
 class Sphere : public Shape
@@ -51,7 +72,10 @@ public:
 
 	void CreateBV() override;
 	bool intersect(Ray, Intersection&) override;
-	Intersection SampleSphere();
+	float Area() override;
+	Intersection SampleSurface() override;
+	Intersection SampleAsLight(const Intersection& A, float& pdf) override;
+	float PdfAsLight(const Intersection& A, const Intersection& B) override;
 
 	float radius;
 };
@@ -63,24 +87,31 @@ public:
 
 	void CreateBV() override;
 	bool intersect(Ray, Intersection&) override;
+	float Area() override;
+	Intersection SampleSurface() override;
 
 	vec3 diagonal;
 
 private:
-	vec3 GetNormal(float, float, float, Interval, Interval, Interval);
+	vec3 GetNormal(float, float, float, Interval, Interval, Interval, const vec3& D);
 
 };
 
 class Triangle : public Shape
 {
 public:
-	Triangle(const vec3, const vec3, const vec3, const vec3, const vec3, const vec3, Material*);
+	Triangle(const vec3, const vec3, const vec3, const vec3, const vec3, const vec3, Material*,
+		const vec2 = vec2(0), const vec2 = vec2(0), const vec2 = vec2(0));
 
 	void CreateBV() override;
 	bool intersect(Ray, Intersection&) override;
+	float Area() override;
+	Intersection SampleSurface() override;
+	float PdfAsLight(const Intersection& A, const Intersection& B) override;
 
 	vec3 v0, v1, v2;
 	vec3 n0, n1, n2;
+	vec2 t0, t1, t2;
 };
 
 class Cylinder : public Shape
@@ -101,17 +132,24 @@ private:
 class IBL : public Shape
 {
 public:
-	IBL(const vec3, const float, Material*);
+	IBL(const vec3, const float, const std::string& path, Material*);
 
-	void CreateBV() override;
-	bool intersect(Ray, Intersection&) override;
+	Intersection SampleAsLight(const Intersection& A, float& pdf) override;
+	float PdfAsLight(const Intersection& A, const Intersection& B) override;
+
+	// The environment is not in the BVH; rays that miss everything see it here.
+	// Its t is infinite, and its point lies radius along the ray so that a
+	// direction toward it still comes out right.
+	Intersection IntersectAtInfinity(const Ray& ray);
 
-	Intersection SampleAsLight();
 	float radius;
-	float* pBuffer;
-	float* pUDist;
 	float* image;
 	float angle;
 	int width;
 	int height;
+
+	// Rows are chosen by the marginal table, texels within a row by its conditional table.
+	AliasTable marginal;
+	std::vector<AliasTable> conditional;
+	std::vector<float> pdfImage;	// texel pdf over directions, before dividing by sin(theta)
 };
\ No newline at end of file
@@ -0,0 +1,69 @@
+#include "SpatialHash.h"
+
+#include <cmath>
+#include <limits>
+#include "Shape.h"
+
+void SpatialHash::Start(const std::vector<Shape*>& shapes, int resolution)
+{
+	vec3 min(std::numeric_limits<float>::infinity());
+	vec3 max(-std::numeric_limits<float>::infinity());
+	for (Shape* shape : shapes)
+	{
+		min = glm::min(min, shape->min);
+		max = glm::max(max, shape->max);
+	}
+	if (min.x > max.x)
+		return;
+
+	const vec3 size = max - min;
+	cellSize = glm::max(glm::max(size.x, size.y), glm::max(size.z, 1e-3f)) / (float)glm::max(resolution, 1);
+}
+
+uint64_t SpatialHash::Key(const vec3& point, const vec3& normal, uint64_t tag, int tagBits) const
+{
+	const vec3 a = glm::abs(normal);
+	const int axis = (a.x >= a.y && a.x >= a.z) ? 0 : (a.y >= a.z ? 1 : 2);
+	const uint64_t facing = 2 * axis + (normal[axis] < 0.0f ? 1 : 0);
+
+	// Facing + 1 keeps every key from being 0.
+	const int bits = (61 - tagBits) / 3;
+	const int64_t mask = ((int64_t)1 << bits) - 1;
+	uint64_t key = ((facing + 1) << tagBits) | tag;
+	for (int i = 0; i < 3; i++)
+	{
+		const int64_t c = (int64_t)std::floor(point[i] / cellSize) + ((int64_t)1 << (bits - 1));
+		key = (key << bits) | (uint64_t)(c & mask);
+	}
+	return key;
+}
+
+int SpatialHash::Find(uint64_t key, bool insert)
+{
+	uint64_t hash = key;
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdull;
+	hash ^= hash >> 33;
+
+	// Linear probing; a slot once claimed keeps its key.
+	for (int probe = 0; probe < MaxProbes; probe++)
+	{
+		const int c = (int)((hash + probe) & (Capacity - 1));
+		uint64_t found = keys[c].load(std::memory_order_acquire);
+		if (found == key)
+			return c;
+		if (found != 0)
+			continue;
+		if (!insert)
+			return -1;
+
+		if (keys[c].compare_exchange_strong(found, key, std::memory_order_acq_rel))
+		{
+			used.fetch_add(1, std::memory_order_relaxed);
+			return c;
+		}
+		if (found == key)
+			return c;
+	}
+	return -1;
+}
@@ -0,0 +1,45 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <vector>
+#include "geom.h"
+
+class Shape;
+
+////////////////////////////////////////////////////////////////////////
+// SpatialHash: the cells of a world-space grid, as slots of a fixed
+// hash table of 64-bit keys.  A key is a cube of the grid, the axis the
+// surface normal mostly faces, so the two sides of a thin wall stay
+// apart, and a tag of the owner's choosing.  Slots are claimed with a
+// compare-and-swap and never given up, so any thread may find or claim
+// one while others read; the owner keeps what a cell holds in arrays
+// of Capacity entries, indexed by slot.
+////////////////////////////////////////////////////////////////////////
+class SpatialHash
+{
+public:
+	static const int Capacity = 1 << 18;
+
+	SpatialHash() : keys(Capacity) {}
+
+	// Sizes the cells so resolution of them span the shapes' longest side.
+	void Start(const std::vector<Shape*>& shapes, int resolution);
+
+	// The facing in 3 bits, tag in tagBits, and the grid cube's
+	// coordinates in what is left, split evenly
+	uint64_t Key(const vec3& point, const vec3& normal, uint64_t tag = 0, int tagBits = 0) const;
+
+	// The slot holding key, claimed for it if insert; -1 if the key is
+	// absent, or the table too full around it
+	int Find(uint64_t key, bool insert);
+
+	float CellSize() const { return cellSize; }
+	size_t Count() const { return used.load(std::memory_order_relaxed); }
+
+private:
+	static const int MaxProbes = 16;
+
+	std::vector<std::atomic<uint64_t>> keys;	// 0 for empty
+	std::atomic<size_t> used{ 0 };
+	float cellSize = 1.0f;
+};
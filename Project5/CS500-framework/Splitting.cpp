@@ -0,0 +1,59 @@
+#include "Splitting.h"
+
+#include <algorithm>
+#include <cmath>
+#include "StaticRayTrace.h"
+
+Splitting::Splitting(int lights_, int continuations_, int depth_)
+	: depth(std::max(depth_, 1)), autoLights(lights_ <= 0), autoContinuations(continuations_ <= 0)
+{
+	lights = autoLights ? PilotCount : lights_;
+	continuations = autoContinuations ? PilotCount : continuations_;
+	measuring = autoLights || autoContinuations;
+}
+
+void Splitting::Choose(const PathStats& stats, double pixelVariance)
+{
+	measuring = false;
+	if (stats.splitPaths == 0)
+		return;
+
+	// Per path: the pilot's samples of each, and all the rest
+	const double paths = (double)stats.splitPaths;
+	const double lightSeconds = stats.splitSeconds[1] / paths;
+	const double continuationSeconds = stats.splitSeconds[2] / paths;
+	lightVariance = stats.splitSquares[0] / paths;
+	continuationVariance = stats.splitSquares[1] / paths;
+	lightCost = 1e6 * lightSeconds / lights;
+	continuationCost = 1e6 * continuationSeconds / continuations;
+
+	// A count given by hand is part of what the others cannot change.
+	sharedCost = 1e6 * stats.splitSeconds[0] / paths;
+	sharedVariance = pixelVariance;
+	if (autoLights)
+	{
+		sharedCost -= 1e6 * lightSeconds;
+		sharedVariance -= lightVariance / lights;
+	}
+	if (autoContinuations)
+	{
+		sharedCost -= 1e6 * continuationSeconds;
+		sharedVariance -= continuationVariance / continuations;
+	}
+
+	// Each variance is the mean of a few noisy squares; the floor keeps
+	// an overestimate of VL or VI from driving the counts to the cap.
+	sharedVariance = std::max(sharedVariance, 0.05 * pixelVariance);
+	sharedCost = std::max(sharedCost, 1e-3);
+
+	const auto Count = [&](double variance, double cost) {
+		if (!(cost > 0.0) || !(sharedVariance > 0.0))
+			return 1;
+		const double n = std::sqrt(variance * sharedCost / (sharedVariance * cost));
+		return std::min(std::max((int)std::lround(n), 1), MaxCount);
+	};
+	if (autoLights)
+		lights = Count(lightVariance, lightCost);
+	if (autoContinuations)
+		continuations = Count(continuationVariance, continuationCost);
+}
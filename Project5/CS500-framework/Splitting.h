@@ -0,0 +1,49 @@
+#pragma once
+
+struct PathStats;
+
+////////////////////////////////////////////////////////////////////////
+// Splitting: several light samples at each of a path's first depth
+// vertices, and several continuations from its first vertex, so the
+// camera ray and the first hit's shading are paid for once per group
+// of samples.  Each light sample carries 1 / lights of the direct
+// light and each continuation 1 / continuations of the throughput; the
+// MIS weights count both, so the estimate stays unbiased.
+//
+// A count given as 0 is chosen from the first two passes, which take
+// two samples of it.  They time what a path spends on light samples,
+// on continuations and on everything else, and measure how much the
+// two samples of each differ.  The spread of each pixel's two passes
+// then leaves the variance the counts cannot touch, and each count is
+// the one that minimizes variance times cost: for V = V0 + VL / N
+// + VI / M at cost c0 + N cL + M cI, that is N = sqrt(VL c0 / (V0 cL)),
+// and M likewise.
+////////////////////////////////////////////////////////////////////////
+class Splitting
+{
+public:
+	Splitting(int lights, int continuations, int depth);
+
+	// True until Choose has set the counts given as 0
+	bool Measuring() const { return measuring; }
+
+	// Counts from what the two pilot passes added to stats, and the
+	// mean over pixels of half the squared difference of their samples
+	void Choose(const PathStats& stats, double pixelVariance);
+
+	int lights;				// light samples at each of the first depth vertices
+	int continuations;		// paths leaving the first vertex
+	int depth;
+
+	// What Choose found, for the stats: variances of one sample, and
+	// costs in microseconds of a path's shared part and of one sample
+	double sharedVariance = 0.0, lightVariance = 0.0, continuationVariance = 0.0;
+	double sharedCost = 0.0, lightCost = 0.0, continuationCost = 0.0;
+
+private:
+	static const int PilotCount = 2;
+	static const int MaxCount = 16;
+
+	bool autoLights, autoContinuations;
+	bool measuring;
+};
@@ -1,3 +1,5 @@
+#include <algorithm>
+#include <chrono>
 #include <iostream>
 #include "Camera.h"
 #include "Shape.h"
@@ -7,6 +9,11 @@
 #include "Helper.h"
 #include "acceleration.h"
 #include "Auxiliary.h"
+#include "PhotonMap.h"
+#include "PathGuide.h"
+#include "RadianceCache.h"
+#include "Splitting.h"
+#include "VisibilityCache.h"
 
 StaticRayTrace::StaticRayTrace()
 {
@@ -29,6 +36,14 @@ void StaticRayTrace::AddShape(Shape* shape)
 	materials.push_back(shape->material);
 }
 
+void StaticRayTrace::SetEnvironment(IBL* environment)
+{
+	// The environment is a light but stays out of shapes, and so out of the BVH.
+	ibl = environment;
+	lights.push_back(environment);
+	materials.push_back(environment->material);
+}
+
 void StaticRayTrace::AddModel(MeshData* mesh, Material* mat)
 {
 	int size = static_cast<int>(mesh->triangles.size());
@@ -40,7 +55,7 @@ void StaticRayTrace::AddModel(MeshData* mesh, Material* mat)
 		VertexData v2 = mesh->vertices[triangle.y];
 		VertexData v3 = mesh->vertices[triangle.z];
 
-		auto shape = new Triangle(v1.pnt, v2.pnt, v3.pnt, v1.nrm, v2.nrm, v3.nrm, mat);
+		auto shape = new Triangle(v1.pnt, v2.pnt, v3.pnt, v1.nrm, v2.nrm, v3.nrm, mat, v1.tex, v2.tex, v3.tex);
 		shape->activeMotionBlur = mesh->activeBlur;
 
 		if (mat->isLight())
@@ -52,78 +67,425 @@ void StaticRayTrace::AddModel(MeshData* mesh, Material* mat)
 	}
 }
 
-vec3 StaticRayTrace::TraceRay(Ray ray)
+vec3 StaticRayTrace::TraceRay(Ray ray, FirstHit* first, PathStats* stats, const vec3* direct,
+	const Intersection* hit)
 {
+	// While splitting measures, the path is timed in parts.
+	using Clock = std::chrono::steady_clock;
+	const bool measuring = split != nullptr && split->Measuring() && stats != nullptr;
+	const Clock::time_point start = measuring ? Clock::now() : Clock::time_point();
+	const auto Since = [](Clock::time_point from) { return std::chrono::duration<double>(Clock::now() - from).count(); };
+
 	vec3 C = vec3(0);
-	vec3 W = vec3(1);
 
-	Intersection P = bvh->intersect(ray);
+	const Intersection firstHit = (hit != nullptr) ? *hit : Intersect(ray);
+	Intersection P = firstHit;
 	vec3 N = P.normal;
 
-	if (P.object == nullptr)
-		return C;
-
-	if (P.object->IsLight())
-		return P.object->EvalRadiance(P);
+	if (first != nullptr)
+	{
+		// Lights and the background keep an albedo of one.
+		first->normal = (P.object != nullptr) ? N : -ray.D;
+		first->depth = (P.object != nullptr && P.object != ibl) ? P.t : 0.0f;
+	}
 
-	vec3 omegaO = -ray.D;
-	while (myrandomf(RNGen) <= RussianRoulette)
+	if (P.object == nullptr || P.object->IsLight())
 	{
-		//Explicit light connect
-		Intersection L = SampleLight(lights);
-		vec3 omegaI = normalize(L.point - P.point);
-		float p = L.object->PdfLight((int)lights.size(), L) / GeometryFactor(P, L);
-		float q = L.object->PdfBRDF(omegaO, N, omegaI) * RussianRoulette;
-		float weightMIS = powf(p, 2) / (powf(p, 2) + powf(q, 2));
-
-		Intersection I = bvh->intersect(Ray(P.point, omegaI));
-		if (p > epsilon && I.object != nullptr && I.point == L.point)
+		if (stats != nullptr)
+			stats->ended[0]++;
+		if (measuring)
 		{
-			vec3 f = P.object->EvalScattering(omegaO, N, omegaI, P.t);
-			//C += 0.5f * W * weightMIS * f / p * L.object->EvalRadiance(L);
-			//C += 0.5f * W * f / p * L.object->EvalRadiance(L);
-			C += W * f / p * L.object->EvalRadiance(L);
+			stats->splitPaths++;
+			stats->splitSeconds[0] += Since(start);
 		}
+		return (P.object != nullptr) ? P.object->EvalRadiance(P) : C;
+	}
 
-		// Extend Path
-		omegaI = P.object->SampleBRDF(omegaO, N);
-		Intersection Q = bvh->intersect(Ray(P.point, omegaI));
-		if (Q.object == nullptr)
-			break;
+	if (first != nullptr)
+	{
+		const Material* mat = P.object->material;
+		const float footprint = ray.spread * P.t / std::max(abs(dot(N, -ray.D)), 0.01f);
+		first->albedo = glm::min(vec3(1), P.object->Diffuse(P, footprint) + mat->Ks + mat->Kt);
+	}
 
-		vec3 f = P.object->EvalScattering(omegaO, N, omegaI, P.t);
-		p = P.object->PdfBRDF(omegaO, N, omegaI) * RussianRoulette;
+	if (direct != nullptr)
+		C += *direct;
 
-		if (p < epsilon)
-			break;
-		W *= f / p;
+	const bool mapped = photons != nullptr && !photons->Empty();
+	const bool guiding = guide != nullptr && (guide->Ready() || guide->Training());
+
+	// While the guide trains, each extension ray is kept with the
+	// radiance gathered so far, so what arrives along it is known at the end.
+	struct GuideRecord
+	{
+		PathGuide::Directions* directions;
+		vec3 omegaI;
+		vec3 W;		// throughput past the bounce
+		vec3 C;
+		float pdf;
+	};
+	GuideRecord records[MaxGuideRecords];
+
+	// With the cache, each vertex keeps what it added itself, unweighted by
+	// the throughput before it, so the radiance leaving every vertex can be
+	// rebuilt at the end without dividing by a channel the path lost.
+	struct CacheVertex
+	{
+		int cell;			// to record into, or -1
+		vec3 direct;		// lights by NEE, caustics and the cache
+		vec3 hit;			// a light the extension ray hit
+		vec3 bounce;		// f / p of the extension
+		float cosOverPdf;
+	};
+	CacheVertex vertices[MaxCacheVertices];
 
-		if (Q.object->IsLight())
+	// Each continuation from the first vertex is a path of its own from
+	// there on; the first one also gathers that vertex's light.
+	const int continuations = (split != nullptr) ? split->continuations : 1;
+	float firstSurvival = 1.0f;
+	float lightSamples[2] = {}, continuationSamples[2] = {};
+	double lightSeconds = 0.0, continuationSeconds = 0.0;
+	for (int branch = 0; branch < continuations; branch++)
+	{
+		P = firstHit;
+		N = P.normal;
+		vec3 omegaO = -ray.D;
+		vec3 W = vec3(1);
+
+		// Ray cone for texture filtering: width at the current hit, and its spread angle
+		float coneSpread = ray.spread;
+		float coneWidth = coneSpread * P.t;
+
+		// depth counts the vertices this path has shaded.
+		int depth = 0;
+		float minAlpha = 0.0f;
+		bool afterDiffuse = false;
+		int recordCount = 0;
+		int vertexCount = 0;
+		bool bouncedDiffuse = false;
+		vec3 before = C;
+		Clock::time_point branchStart = start;
+		double splitLightSeconds = 0.0;		// of them, past the first vertex
+		while (true)
 		{
-			q = Q.object->PdfLight((int)lights.size(), Q) / GeometryFactor(P, Q);
-			weightMIS = powf(p, 2) / (powf(p, 2) + powf(q, 2));
-			//C += 0.5f * W * weightMIS * Q.object->EvalRadiance(Q);
-			//C += 0.5f * W * Q.object->EvalRadiance(Q);
-			C += W * Q.object->EvalRadiance(Q);
-			break;
+			// A continuation finds the first vertex already alive, and
+			// roulette past it sees the throughput without its share.
+			const bool again = branch > 0 && depth == 0;
+			const float survival = again ? firstSurvival : Survival((depth > 0) ? W * (float)continuations : W, depth);
+			if (!again && (survival <= 0.0f || myrandomf(RNGen) > survival))
+				break;
+			if (depth == 0)
+				firstSurvival = survival;
+			depth++;
+			CacheVertex* vertex = (radianceCache != nullptr && vertexCount < MaxCacheVertices) ? &vertices[vertexCount++] : nullptr;
+			if (vertex != nullptr)
+				*vertex = { -1, vec3(0), vec3(0), vec3(0), 0.0f };
+
+			const float footprint = coneWidth / std::max(abs(dot(N, omegaO)), 0.01f);
+			const vec3 Kd = P.object->Diffuse(P, footprint);
+			const float limit = (depth > 1) ? clampIndirect : 0.0f;
+			const bool lit = depth == 1 && direct != nullptr;
+
+			// Samples of each kind leaving this vertex, for the MIS weights
+			const int lights = (split != nullptr && depth <= split->depth) ? split->lights : 1;
+			const int scatters = (depth == 1) ? continuations : 1;
+
+			// With photons, a non-specular vertex gathers the caustics, and the
+			// lights reached from it through specular surfaces are left to them.
+			const bool specular = mapped && PhotonMap::IsSpecular(P.object);
+			const bool caustic = specular && afterDiffuse;
+			if (mapped && !specular && !again)
+			{
+				const vec3 gathered = photons->Gather(P, omegaO, Kd) / survival;
+				C += Clamp(W * gathered, limit);
+				if (vertex != nullptr)
+					vertex->direct += gathered;
+			}
+
+			// Past a diffuse bounce, a diffuse vertex whose cell has learned
+			// enough ends the path; NEE alone brings its direct light.
+			const bool diffuse = radianceCache != nullptr && RadianceCache::IsDiffuse(P.object->p_d);
+			vec3 irradiance;
+			const bool terminal = diffuse && bouncedDiffuse && radianceCache->Lookup(P.point, N, irradiance);
+
+			// Sharp lobes are left to the BSDF.
+			PathGuide::Directions* directions = (guiding && !PhotonMap::IsSpecular(P.object)) ? guide->Find(P.point, N) : nullptr;
+			const bool guided = directions != nullptr && guide->Ready();
+
+			//Explicit light connect
+			const bool timed = measuring && depth <= split->depth;
+			const Clock::time_point lightStart = timed ? Clock::now() : start;
+			for (int s = 0; s < lights && !caustic && !lit && !again; s++)
+			{
+				float pdfLight;
+				Intersection L = SampleLight(lightDistribution, P, pdfLight);
+				if (L.object == nullptr)
+					continue;
+
+				vec3 omegaI = normalize(L.point - P.point);
+				float pdfBrdf;
+				vec3 f = P.object->EvalBSDF(omegaO, N, omegaI, P.t, Kd, pdfBrdf, minAlpha);
+				float p = pdfLight * survival;
+				if (guided)
+					pdfBrdf = guide->MixedPdf(*directions, omegaI, pdfBrdf);
+
+				if (p > epsilon && f != vec3(0) && Visible(P, L, depth, stats))
+				{
+					const float weight = terminal ? 1.0f : PowerHeuristic(lights * pdfLight, scatters * pdfBrdf);
+					const vec3 direct = weight * f / (p * lights) * L.object->EvalRadiance(L);
+					C += Clamp(W * direct, limit);
+					if (vertex != nullptr)
+						vertex->direct += direct;
+					if (measuring && depth == 1 && s < 2)
+						lightSamples[s] = Luminance(direct) * lights;
+				}
+			}
+			if (timed)
+			{
+				const double seconds = Since(lightStart);
+				lightSeconds += seconds;
+				splitLightSeconds += (depth > 1) ? seconds : 0.0;
+			}
+
+			if (terminal)
+			{
+				const vec3 cached = Kd / PI * irradiance / survival;
+				C += Clamp(W * cached, limit);
+				if (vertex != nullptr)
+					vertex->direct += cached;
+				if (stats != nullptr)
+					stats->cached++;
+				break;
+			}
+
+			// What follows the first vertex's own light belongs to the continuation.
+			if (depth == 1)
+			{
+				before = C;
+				if (measuring)
+					branchStart = Clock::now();
+			}
+
+			// Extend Path, from the guide or the BSDF at random when guided
+			const bool fromGuide = guided && myrandomf(RNGen) < guide->fraction;
+			vec3 omegaI = fromGuide ? guide->Sample(*directions) : P.object->SampleBRDF(omegaO, N, minAlpha);
+			float pdfBrdf;
+			vec3 f = P.object->EvalBSDF(omegaO, N, omegaI, P.t, Kd, pdfBrdf, minAlpha);
+			const float pdfScatter = guided ? guide->MixedPdf(*directions, omegaI, pdfBrdf) : pdfBrdf;
+			float p = pdfScatter * survival;
+			if (p < epsilon || (fromGuide && f == vec3(0)))
+				break;
+
+			if (vertex != nullptr)
+			{
+				vertex->bounce = f / p;
+				if (diffuse && dot(N, omegaI) * dot(N, omegaO) > 0.0f)
+				{
+					vertex->cell = radianceCache->Find(P.point, N);
+					vertex->cosOverPdf = abs(dot(N, omegaI)) / pdfScatter;
+				}
+			}
+
+			Intersection Q = Intersect(Ray(P.point, omegaI));
+			const vec3 bounce = f / (p * scatters);
+			if (directions != nullptr && guide->Training() && recordCount < MaxGuideRecords)
+				records[recordCount++] = { directions, omegaI, W * bounce, C, pdfScatter };
+			if (Q.object == nullptr)
+				break;
+			W *= bounce;
+
+			// The bounce widens the cone by roughly the solid angle the sampled lobe covers.
+			coneSpread += 2.0f / sqrtf(PI * pdfScatter);
+			coneWidth += coneSpread * Q.t;
+
+			// Lights, the environment included, could also have been reached by NEE from P.
+			if (Q.object->IsLight())
+			{
+				if (!caustic && !lit)
+				{
+					const float pdfLight = Q.object->PdfLight(lightDistribution, P, Q);
+					const vec3 hit = PowerHeuristic(scatters * pdfScatter, lights * pdfLight) * Q.object->EvalRadiance(Q);
+					C += Clamp(W * hit, limit);
+					if (vertex != nullptr)
+						vertex->hit = hit;
+				}
+				break;
+			}
+
+			// Past a bounce that was mostly diffuse, sharp lobes only add fireflies.
+			if (regularize > 0.0f && P.object->p_d * abs(dot(N, omegaI)) / PI >= 0.5f * pdfBrdf)
+				minAlpha = regularize;
+
+			afterDiffuse = afterDiffuse || !specular;
+			bouncedDiffuse = bouncedDiffuse || diffuse;
+			P = Q;
+			N = P.normal;
+			omegaO = -omegaI;
 		}
 
-		P = Q;
-		N = P.normal;
-		omegaO = -omegaI;
+		if (measuring && depth > 0)
+		{
+			continuationSeconds += Since(branchStart) - splitLightSeconds;
+			if (branch < 2)
+				continuationSamples[branch] = Luminance(C - before) * continuations;
+		}
+
+		// Radiance arriving along each extension ray is what came in after it,
+		// divided by the throughput it carried.
+		for (int i = 0; i < recordCount; i++)
+		{
+			const GuideRecord& r = records[i];
+			const vec3 gained = C - r.C;
+			vec3 incident(0);
+			for (int c = 0; c < 3; c++)
+				incident[c] = (r.W[c] > 0.0f) ? gained[c] / r.W[c] : 0.0f;
+			guide->Record(*r.directions, r.omegaI, Luminance(incident) / r.pdf);
+		}
+
+		// Back from the last vertex, each diffuse one records the radiance
+		// that left the next toward it, by the cosine over the pdf.  Lights
+		// its extension ray hit are direct light, and stay out.
+		vec3 Lo(0);
+		for (int i = vertexCount - 1; i >= 0; i--)
+		{
+			const CacheVertex& v = vertices[i];
+			if (v.cell >= 0)
+				radianceCache->Add(v.cell, Lo * v.cosOverPdf);
+			Lo = v.direct + v.bounce * (v.hit + Lo);
+		}
+
+		if (stats != nullptr)
+			stats->ended[std::min(depth, PathStats::MaxDepth)]++;
+
+		// A path roulette ended at its first vertex has nothing to continue from.
+		if (depth == 0)
+			break;
+	}
+
+	if (measuring)
+	{
+		stats->splitPaths++;
+		stats->splitSeconds[0] += Since(start);
+		stats->splitSeconds[1] += lightSeconds;
+		stats->splitSeconds[2] += continuationSeconds;
+		const float dl = lightSamples[0] - lightSamples[1];
+		const float dc = continuationSamples[0] - continuationSamples[1];
+		stats->splitSquares[0] += 0.5 * dl * dl;
+		stats->splitSquares[1] += 0.5 * dc * dc;
 	}
 
-	return C;
+	return Clamp(C, clampSample);
+}
+
+// IsVisible for NEE at a path's depth-th vertex, or the visibility
+// cache's answer when the vertex is deep enough and its cell knows
+bool StaticRayTrace::Visible(const Intersection& P, const Intersection& L, int depth, PathStats* stats)
+{
+	VisibilityCache* cache = visibilityCache;
+	const int cell = (cache != nullptr && depth >= cache->minDepth && L.object != ibl)
+		? cache->Find(P.point, P.normal, L.object->lightIndex) : -1;
+
+	bool visible;
+	if (cell >= 0 && cache->Known(cell, visible) && myrandomf(RNGen) >= cache->validate)
+	{
+		if (stats != nullptr)
+			stats->shadowCached++;
+		return visible;
+	}
+
+	visible = IsVisible(P, L);
+	if (cell >= 0)
+		cache->Add(cell, visible);
+	if (stats != nullptr)
+		stats->shadowRays++;
+	return visible;
+}
+
+// Weight of a sample drawn with pdf f when g could have drawn it too.
+// Both pdfs carry the same survival factor, which cancels here.
+float StaticRayTrace::PowerHeuristic(float f, float g)
+{
+	// As a ratio, so sharp lobes whose pdfs square past FLT_MAX stay finite
+	if (f <= 0.0f)
+		return 0.0f;
+	const float r = g / f;
+	return 1.0f / (1.0f + r * r);
+}
+
+// Scales radiance down so no channel exceeds limit; 0 is no limit.
+vec3 StaticRayTrace::Clamp(const vec3& radiance, float limit)
+{
+	const float brightest = std::max(radiance.r, std::max(radiance.g, radiance.b));
+	if (limit <= 0.0f || brightest <= limit)
+		return radiance;
+
+	return radiance * (limit / brightest);
+}
+
+// Chance that a path with throughput W shades one more vertex
+float StaticRayTrace::Survival(const vec3& W, int depth) const
+{
+	if (maxDepth > 0 && depth >= maxDepth)
+		return 0.0f;
+	if (depth < minDepth)
+		return 1.0f;
+	if (!throughputRoulette)
+		return survival;
+
+	// Dim paths usually stop; the survivors are weighted back up to a
+	// throughput near one, so no path's weight grows without bound.
+	return glm::clamp(Luminance(W), MinSurvival, 1.0f);
+}
+
+void PathStats::Add(const PathStats& other)
+{
+	for (int i = 0; i <= MaxDepth; i++)
+		ended[i] += other.ended[i];
+	cached += other.cached;
+	shadowRays += other.shadowRays;
+	shadowCached += other.shadowCached;
+	splitPaths += other.splitPaths;
+	for (int i = 0; i < 3; i++)
+		splitSeconds[i] += other.splitSeconds[i];
+	for (int i = 0; i < 2; i++)
+		splitSquares[i] += other.splitSquares[i];
 }
 
-Intersection StaticRayTrace::SampleLight(std::vector<Shape*> lights)
+Intersection StaticRayTrace::Intersect(const Ray& ray)
 {
-	int randomIndex = GetRandomIndex((int)lights.size());
+	Intersection I = bvh->intersect(ray);
+	if (I.object == nullptr && ibl != nullptr)
+		return ibl->IntersectAtInfinity(ray);
+
+	return I;
+}
+
+Intersection StaticRayTrace::SampleLight(const LightDistribution& lights, const Intersection& P, float& pdf)
+{
+	float choice;
+	Shape* light = lights.Sample(P.point, P.normal, myrandomf(RNGen), choice);
+	if (light == nullptr)
+		return Intersection();
+
+	Intersection L = light->SampleAsLight(P, pdf);
+	pdf *= choice;
+	return L;
+}
+
+bool StaticRayTrace::IsVisible(const Intersection& P, const Intersection& L)
+{
+	vec3 D = L.point - P.point;
+	float distance = length(D);
+
+	Intersection I = bvh->intersect(Ray(P.point, D / distance));
+
+	// The environment is seen only by rays that escape the scene.
+	if (L.object == ibl)
+		return I.object == nullptr;
 
-	IBL* ibl = dynamic_cast<IBL*>(lights[randomIndex]);
-	if (ibl != nullptr)
-		return ibl->SampleAsLight();
+	// Anything short of the sampled point, including the light's own near side, blocks it.
+	if (I.object != L.object)
+		return false;
 
-	Sphere* light = dynamic_cast<Sphere*>(lights[randomIndex]);
-	return light->SampleSphere();
+	return abs(I.t - distance) <= 1e-3f * distance;
 }
@@ -1,7 +1,9 @@
 #pragma once
 #include "geom.h"
+#include <cstdint>
 #include <vector>
 #include "Intersection.h"
+#include "LightDistribution.h"
 
 class Shape;
 class Camera;
@@ -9,6 +11,16 @@ class Ray;
 struct MeshData;
 class Material;
 class IBL;
+class AccelerationBvh;
+class PhotonMap;
+class Bidirectional;
+class Metropolis;
+class PathGuide;
+class RadianceCache;
+class Restir;
+class PrimaryHits;
+class Splitting;
+class VisibilityCache;
 
 enum class DistributionType
 {
@@ -17,6 +29,33 @@ enum class DistributionType
 
 inline static DistributionType type = DistributionType::Beckman;
 
+// What a camera ray saw first, for guiding the denoiser
+struct FirstHit
+{
+	vec3 albedo = vec3(1);
+	vec3 normal = vec3(0);
+	float depth = 0.0f;		// 0 for a miss or the environment, whose t is infinite
+};
+
+// Number of paths that ended after shading each number of vertices
+struct PathStats
+{
+	static const int MaxDepth = 64;
+	uint64_t ended[MaxDepth + 1] = {};		// the last entry counts longer paths
+	uint64_t cached = 0;					// of them, ended in the radiance cache
+	uint64_t shadowRays = 0;				// traced for NEE
+	uint64_t shadowCached = 0;				// answered by the visibility cache instead
+
+	// While splitting measures: paths traced, their seconds in all, in
+	// light samples and in continuations, and half the squared difference
+	// of the first two light samples and of the first two continuations
+	uint64_t splitPaths = 0;
+	double splitSeconds[3] = {};
+	double splitSquares[2] = {};
+
+	void Add(const PathStats& other);
+};
+
 class StaticRayTrace
 {
 public:
@@ -29,14 +68,74 @@ public:
 	std::vector<Shape*> modelShapes;
 	std::vector<Material*> materials;
 	std::vector<Shape*> lights;
+	LightDistribution lightDistribution;
 
 	void AddShape(Shape* shape);
 	void AddModel(MeshData* shape, Material* mat);
-	vec3 TraceRay(Ray ray);
-	Intersection SampleLight(std::vector<Shape*> lights);
-	IBL* ibl;
+	void SetEnvironment(IBL* environment);
+	// direct, when given, is the light reaching the first hit straight
+	// from the lights, already estimated; the path then leaves it out.
+	// hit, when given, is ray's first hit, already found.
+	vec3 TraceRay(Ray ray, FirstHit* first = nullptr, PathStats* stats = nullptr, const vec3* direct = nullptr,
+		const Intersection* hit = nullptr);
+	Intersection Intersect(const Ray& ray);
+	Intersection SampleLight(const LightDistribution& lights, const Intersection& P, float& pdf);
+	bool IsVisible(const Intersection& P, const Intersection& L);
+	IBL* ibl = nullptr;
+
+	// Path termination by Russian roulette.  Paths always shade minDepth
+	// vertices and never more than maxDepth (0 for no limit); in between
+	// each vertex survives with a fixed probability, or with one that
+	// follows the path throughput's luminance.
+	int minDepth = 0;
+	int maxDepth = 0;
+	float survival = 0.8f;
+	bool throughputRoulette = true;
+
+	// Firefly control, each 0 for off; both trade bias for variance.
+	// clampSample caps every channel of a path's radiance and
+	// clampIndirect that of each contribution arriving after more than
+	// one bounce, keeping their hue; lights seen directly are left
+	// alone.  After a mostly diffuse bounce, later vertices are shaded
+	// at least as rough as microfacet alpha regularize.
+	float clampSample = 0.0f;
+	float clampIndirect = 0.0f;
+	float regularize = 0.0f;
+
+	// Caustics from photons instead of paths when set
+	PhotonMap* photons = nullptr;
+
+	// Renders with bidirectional path tracing instead of TraceRay when set
+	Bidirectional* bidirectional = nullptr;
+
+	// Renders by Metropolis light transport over TraceRay's paths when set
+	Metropolis* metropolis = nullptr;
+
+	// Extension rays learn where light comes from when set
+	PathGuide* guide = nullptr;
+
+	// Paths past a diffuse bounce end in cached indirect light when set
+	RadianceCache* radianceCache = nullptr;
+
+	// Direct light at first hits by reservoir resampling when set
+	Restir* restir = nullptr;
+
+	// Camera rays' first hits are kept and reused across passes when set
+	PrimaryHits* primaryHits = nullptr;
+
+	// More light samples and continuations near the camera when set
+	Splitting* split = nullptr;
+
+	// Shadow rays deep in paths are answered from learned visibility when set
+	VisibilityCache* visibilityCache = nullptr;
 
 private:
-	const float RussianRoulette = 0.8f;
+	static constexpr float MinSurvival = 0.05f;
+	static const int MaxGuideRecords = 32;
+	static const int MaxCacheVertices = 32;
+	float Survival(const vec3& W, int depth) const;
+	bool Visible(const Intersection& P, const Intersection& L, int depth, PathStats* stats);
+	static float PowerHeuristic(float f, float g);
+	static vec3 Clamp(const vec3& radiance, float limit);
 };
 
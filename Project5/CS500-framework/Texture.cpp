@@ -0,0 +1,332 @@
+#include "Texture.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include "TextureCache.h"
+#include "stb_image.h"
+
+#ifdef _WIN32
+#define fseek64 _fseeki64
+#else
+#define fseek64 fseeko
+#endif
+
+namespace
+{
+	// Tiled file: magic, header, level table, then pages from HeaderBytes on
+	const char Magic[4] = { 'R', 'T', 'T', 'X' };
+	const int32_t Version = 1;
+	const long long HeaderBytes = 4096;
+
+	// sRGB byte -> linear
+	struct DecodeTable
+	{
+		float value[256];
+		DecodeTable()
+		{
+			for (int i = 0; i < 256; i++)
+			{
+				const float c = i / 255.0f;
+				value[i] = (c <= 0.04045f) ? c / 12.92f : powf((c + 0.055f) / 1.055f, 2.4f);
+			}
+		}
+	} decode;
+
+	unsigned char Encode(float linear)
+	{
+		const float c = (linear <= 0.0031308f) ? 12.92f * linear : 1.055f * powf(linear, 1.0f / 2.4f) - 0.055f;
+		return (unsigned char)std::min(255.0f, std::max(0.0f, c * 255.0f + 0.5f));
+	}
+
+	vec3 Unpack(uint32_t texel)
+	{
+		return vec3(decode.value[texel & 0xff], decode.value[(texel >> 8) & 0xff], decode.value[(texel >> 16) & 0xff]);
+	}
+
+	uint32_t Pack(const vec3& color)
+	{
+		return Encode(color.r) | (Encode(color.g) << 8) | (Encode(color.b) << 16) | 0xff000000u;
+	}
+
+	int Wrap(int i, int n)
+	{
+		i %= n;
+		return (i < 0) ? i + n : i;
+	}
+
+	int PageCount(int texels)
+	{
+		return (texels + TextureCache::PageSize - 1) >> TextureCache::PageBits;
+	}
+
+	// Index of texel (x, y) within its page
+	int InPage(int x, int y)
+	{
+		return ((y & (TextureCache::PageSize - 1)) << TextureCache::PageBits) | (x & (TextureCache::PageSize - 1));
+	}
+}
+
+Texture* Texture::Load(const std::string& path)
+{
+	static std::mutex mutex;
+	static std::map<std::string, Texture*> loaded;
+
+	std::lock_guard<std::mutex> lock(mutex);
+	Texture*& texture = loaded[path];
+	if (texture == nullptr)
+		texture = new Texture(path);
+	return texture;
+}
+
+Texture::Texture(const std::string& bpath)
+{
+	// Cache keys start at 1 so that 0 can mark an empty frame.
+	static std::atomic<uint32_t> nextId(1);
+	id = nextId++;
+
+	// Replace backslashes with forward slashes -- Good for Linux, and maybe Windows?
+	std::string path = bpath;
+	std::string bs = "\\";
+	std::string fs = "/";
+	while (path.find(bs) != std::string::npos) {
+		path.replace(path.find(bs), 1, fs);
+	}
+
+	// Does the file exist?
+	std::ifstream find_it(path.c_str());
+	if (find_it.fail()) {
+		std::cerr << "Texture file not found: " << path << std::endl;
+		exit(-1);
+	}
+
+	// Convert once; later runs reuse the tiled file until the image changes.
+	std::string tiledPath = TiledPath(path);
+	std::error_code error;
+	const bool stale = !std::filesystem::exists(tiledPath, error)
+		|| std::filesystem::last_write_time(tiledPath, error) < std::filesystem::last_write_time(path, error);
+	if (stale || !Open(tiledPath))
+	{
+		if (!Convert(path, tiledPath, width, height, depth)) {
+			std::cerr << "Cannot write tiled texture " << tiledPath << std::endl;
+			exit(-1);
+		}
+		if (!Open(tiledPath)) {
+			std::cerr << "Cannot read tiled texture " << tiledPath << std::endl;
+			exit(-1);
+		}
+	}
+
+	printf("%d %d %d %s\n", depth, width, height, path.c_str());
+}
+
+Texture::~Texture()
+{
+	if (file != nullptr)
+		fclose(file);
+}
+
+// In a cache directory under the temp directory, named after the image
+// and a hash of its absolute path, so the assets' folders stay clean
+std::string Texture::TiledPath(const std::string& path)
+{
+	std::error_code error;
+	const std::filesystem::path directory = std::filesystem::temp_directory_path(error) / "cs500-tiles";
+	std::filesystem::create_directories(directory, error);
+
+	const std::string absolute = std::filesystem::absolute(path, error).string();
+	const std::string name = std::filesystem::path(path).filename().string()
+		+ "-" + std::to_string(std::hash<std::string>()(absolute)) + ".tiles";
+	return (directory / name).string();
+}
+
+bool Texture::Convert(const std::string& path, const std::string& tiledPath, int& width, int& height, int& depth)
+{
+	// Read image, and check for success
+	stbi_set_flip_vertically_on_load(true);
+	unsigned char* image = stbi_load(path.c_str(), &width, &height, &depth, 4);
+	if (!image) {
+		printf("\nRead error on file %s:\n  %s\n\n", path.c_str(), stbi_failure_reason());
+		exit(-1);
+	}
+
+	FILE* out = fopen(tiledPath.c_str(), "wb");
+	if (out == nullptr) {
+		stbi_image_free(image);
+		return false;
+	}
+
+	// Only the level being written and the next one are ever in memory.
+	const uint32_t* rows = reinterpret_cast<const uint32_t*>(image);
+	std::vector<uint32_t> fine(rows, rows + (size_t)width * height);
+	stbi_image_free(image);
+
+	std::vector<Level> table;
+	int w = width, h = height;
+	uint32_t pages = 0;
+	while (true)
+	{
+		Level level = { w, h, PageCount(w), PageCount(h), pages };
+		table.push_back(level);
+		pages += level.pagesX * level.pagesY;
+		if (w == 1 && h == 1)
+			break;
+		w = std::max(1, w / 2);
+		h = std::max(1, h / 2);
+	}
+
+	std::vector<char> header(HeaderBytes, 0);
+	const int32_t fields[5] = { Version, width, height, depth, (int32_t)table.size() };
+	memcpy(&header[0], Magic, sizeof(Magic));
+	memcpy(&header[sizeof(Magic)], fields, sizeof(fields));
+	memcpy(&header[sizeof(Magic) + sizeof(fields)], table.data(), table.size() * sizeof(Level));
+	bool ok = fwrite(header.data(), 1, header.size(), out) == header.size();
+
+	std::vector<uint32_t> page(TextureCache::PageTexels);
+	for (size_t l = 0; l < table.size() && ok; l++)
+	{
+		const Level& level = table[l];
+		for (int py = 0; py < level.pagesY && ok; py++)
+		{
+			for (int px = 0; px < level.pagesX && ok; px++)
+			{
+				// Texels past the edge of the image are never read; leave them zero.
+				std::fill(page.begin(), page.end(), 0);
+				const int x0 = px * TextureCache::PageSize;
+				const int count = std::min(TextureCache::PageSize, level.width - x0);
+				for (int y = 0; y < TextureCache::PageSize; y++)
+				{
+					const int sy = py * TextureCache::PageSize + y;
+					if (sy < level.height)
+						memcpy(&page[y * TextureCache::PageSize], &fine[(size_t)sy * level.width + x0], count * sizeof(uint32_t));
+				}
+				ok = fwrite(page.data(), 1, TextureCache::PageBytes, out) == TextureCache::PageBytes;
+			}
+		}
+		if (l + 1 == table.size())
+			break;
+
+		// Each level is a 2x2 box filter of the one above, averaged in linear space.
+		const Level& next = table[l + 1];
+		std::vector<uint32_t> coarse((size_t)next.width * next.height);
+		for (int y = 0; y < next.height; y++)
+		{
+			const size_t y0 = (size_t)std::min(2 * y, level.height - 1) * level.width;
+			const size_t y1 = (size_t)std::min(2 * y + 1, level.height - 1) * level.width;
+			for (int x = 0; x < next.width; x++)
+			{
+				const int x0 = std::min(2 * x, level.width - 1);
+				const int x1 = std::min(2 * x + 1, level.width - 1);
+				const vec3 sum = Unpack(fine[y0 + x0]) + Unpack(fine[y0 + x1]) + Unpack(fine[y1 + x0]) + Unpack(fine[y1 + x1]);
+				coarse[(size_t)y * next.width + x] = Pack(0.25f * sum);
+			}
+		}
+		fine.swap(coarse);
+	}
+
+	ok = (fclose(out) == 0) && ok;
+	if (!ok)
+		remove(tiledPath.c_str());
+	return ok;
+}
+
+bool Texture::Open(const std::string& tiledPath)
+{
+	FILE* in = fopen(tiledPath.c_str(), "rb");
+	if (in == nullptr)
+		return false;
+
+	char magic[4];
+	int32_t fields[5];
+	bool ok = fread(magic, sizeof(magic), 1, in) == 1 && memcmp(magic, Magic, sizeof(Magic)) == 0
+		&& fread(fields, sizeof(fields), 1, in) == 1 && fields[0] == Version
+		&& fields[4] > 0 && fields[4] * sizeof(Level) <= HeaderBytes - sizeof(magic) - sizeof(fields);
+	if (ok)
+	{
+		levels.resize(fields[4]);
+		ok = fread(levels.data(), sizeof(Level), levels.size(), in) == levels.size();
+	}
+	if (!ok)
+	{
+		fclose(in);
+		return false;
+	}
+
+	width = fields[1];
+	height = fields[2];
+	depth = fields[3];
+	if (file != nullptr)
+		fclose(file);
+	file = in;
+	return true;
+}
+
+void Texture::ReadPage(uint32_t page, uint32_t* texels) const
+{
+	std::lock_guard<std::mutex> lock(fileMutex);
+	if (fseek64(file, HeaderBytes + (long long)page * TextureCache::PageBytes, SEEK_SET) != 0
+		|| fread(texels, 1, TextureCache::PageBytes, file) != TextureCache::PageBytes)
+		memset(texels, 0, TextureCache::PageBytes);
+}
+
+uint32_t Texture::Page(const Level& level, int x, int y) const
+{
+	return level.firstPage + (y >> TextureCache::PageBits) * level.pagesX + (x >> TextureCache::PageBits);
+}
+
+vec3 Texture::Bilinear(const Level& level, vec2 uv) const
+{
+	// Texel centers sit at half-integer coordinates; the image repeats.
+	const float x = uv.x * level.width - 0.5f;
+	const float y = uv.y * level.height - 0.5f;
+	const float fx = floorf(x);
+	const float fy = floorf(y);
+	const float wx = x - fx;
+	const float wy = y - fy;
+	const int x0 = Wrap((int)fx, level.width);
+	const int y0 = Wrap((int)fy, level.height);
+	const int x1 = (x0 + 1 == level.width) ? 0 : x0 + 1;
+	const int y1 = (y0 + 1 == level.height) ? 0 : y0 + 1;
+
+	// All four taps are usually in one page, which then takes one lookup.
+	const int index[4] = { InPage(x0, y0), InPage(x1, y0), InPage(x0, y1), InPage(x1, y1) };
+	uint32_t t[4];
+	TextureCache& cache = TextureCache::Get();
+	const uint32_t page = Page(level, x0, y0);
+	if (page == Page(level, x1, y1))
+		cache.Read(*this, page, index, 4, t);
+	else
+	{
+		cache.Read(*this, page, &index[0], 1, &t[0]);
+		cache.Read(*this, Page(level, x1, y0), &index[1], 1, &t[1]);
+		cache.Read(*this, Page(level, x0, y1), &index[2], 1, &t[2]);
+		cache.Read(*this, Page(level, x1, y1), &index[3], 1, &t[3]);
+	}
+
+	return (1.0f - wy) * ((1.0f - wx) * Unpack(t[0]) + wx * Unpack(t[1]))
+		+ wy * ((1.0f - wx) * Unpack(t[2]) + wx * Unpack(t[3]));
+}
+
+vec3 Texture::Sample(vec2 uv, float uvWidth) const
+{
+	uv -= glm::floor(uv);
+
+	// A footprint one texel wide reads level 0; each doubling moves down a level.
+	const float texels = uvWidth * sqrtf((float)width * height);
+	const float lod = (texels > 1.0f) ? log2f(texels) : 0.0f;
+	const int last = (int)levels.size() - 1;
+	if (lod >= last)
+		return Bilinear(levels[last], uv);
+
+	const int level = (int)lod;
+	const float t = lod - level;
+	const vec3 fine = Bilinear(levels[level], uv);
+	if (t == 0.0f)
+		return fine;
+	return (1.0f - t) * fine + t * Bilinear(levels[level + 1], uv);
+}
@@ -0,0 +1,54 @@
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "geom.h"
+
+////////////////////////////////////////////////////////////////////////
+// Texture: a diffuse color image kept as a mip chain.  The first load
+// converts the image into a tiled file in a cache directory under the
+// temp directory, one 32x32 texel page after another for every level,
+// and later runs reuse it until the image changes.  From then on the
+// texels live in the TextureCache, which reads pages on demand, so
+// only what the renderer actually touches takes memory.  Lookups pick
+// the level from the world-space width of the ray cone at the hit.
+// Texels stay 8-bit sRGB and are decoded to linear on lookup.  Load()
+// shares one Texture per file path.
+////////////////////////////////////////////////////////////////////////
+class Texture
+{
+public:
+	static Texture* Load(const std::string& path);
+
+	Texture(const std::string& path);
+	~Texture();
+
+	// Trilinear lookup; uvWidth is the footprint measured in uv units.
+	vec3 Sample(vec2 uv, float uvWidth) const;
+
+	// Called by the cache on a miss
+	void ReadPage(uint32_t page, uint32_t* texels) const;
+
+	int width, height, depth;
+	uint32_t id;
+
+private:
+	struct Level
+	{
+		int width, height;
+		int pagesX, pagesY;
+		uint32_t firstPage;
+	};
+
+	static std::string TiledPath(const std::string& path);
+	static bool Convert(const std::string& path, const std::string& tiledPath, int& width, int& height, int& depth);
+	bool Open(const std::string& tiledPath);
+	uint32_t Page(const Level& level, int x, int y) const;
+	vec3 Bilinear(const Level& level, vec2 uv) const;
+
+	std::vector<Level> levels;
+	FILE* file = nullptr;
+	mutable std::mutex fileMutex;
+};
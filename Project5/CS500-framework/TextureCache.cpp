@@ -0,0 +1,182 @@
+#include "TextureCache.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include "Texture.h"
+
+namespace
+{
+	const size_t DefaultBudget = size_t(256) << 20;
+
+	// Recently used pages of this thread, direct mapped by key
+	struct MicroEntry
+	{
+		uint64_t key = 0;
+		const void* frame = nullptr;
+	};
+
+	const int MicroSize = 16;
+	thread_local MicroEntry micro[MicroSize];
+	thread_local uint32_t microGeneration = ~0u;
+	thread_local int microCounter = -1;
+
+	uint64_t Mix(uint64_t key)
+	{
+		key ^= key >> 33;
+		key *= 0xff51afd7ed558ccdull;
+		key ^= key >> 33;
+		return key;
+	}
+}
+
+TextureCache& TextureCache::Get()
+{
+	static TextureCache cache;
+	return cache;
+}
+
+TextureCache::TextureCache()
+{
+	SetBudget(DefaultBudget);
+}
+
+TextureCache::~TextureCache()
+{
+	free(storage);
+}
+
+void TextureCache::SetBudget(size_t bytes)
+{
+	setCount = (int)std::max<size_t>(1, bytes / (PageBytes * Ways));
+	const int frameCount = setCount * Ways;
+
+	// calloc'd memory is not committed until written, so the process
+	// only grows by the frames actually filled.
+	free(storage);
+	storage = static_cast<std::atomic<uint32_t>*>(calloc((size_t)frameCount * PageTexels, sizeof(std::atomic<uint32_t>)));
+	frames.reset(new Frame[frameCount]);
+	for (int i = 0; i < frameCount; i++)
+		frames[i].texels = storage + (size_t)i * PageTexels;
+	setLocks.reset(new std::mutex[setCount]);
+	hands.reset(new int[setCount]());
+	residentFrames = 0;
+	generation++;
+}
+
+bool TextureCache::TryRead(const Frame& frame, uint64_t key, const int* index, int count, uint32_t* texels)
+{
+	const uint32_t sequence = frame.sequence.load(std::memory_order_acquire);
+	if ((sequence & 1) || frame.key.load(std::memory_order_relaxed) != key)
+		return false;
+
+	for (int i = 0; i < count; i++)
+		texels[i] = frame.texels[index[i]].load(std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_acquire);
+	return frame.sequence.load(std::memory_order_relaxed) == sequence;
+}
+
+void TextureCache::CountMicroHit()
+{
+	// Each thread counts on its own cache line, so the hot path does not
+	// contend on one counter; threads past CounterSlots share them.
+	if (microCounter < 0)
+		microCounter = (int)(nextCounter.fetch_add(1, std::memory_order_relaxed) % CounterSlots);
+	microHits[microCounter].count.fetch_add(1, std::memory_order_relaxed);
+}
+
+void TextureCache::Read(const Texture& texture, uint32_t page, const int* index, int count, uint32_t* texels)
+{
+	const uint64_t key = ((uint64_t)texture.id << 40) | page;
+	if (microGeneration != generation)
+	{
+		for (MicroEntry& entry : micro)
+			entry = MicroEntry();
+		microGeneration = generation;
+	}
+
+	const uint64_t hash = Mix(key);
+	MicroEntry& entry = micro[hash & (MicroSize - 1)];
+	if (entry.key == key && TryRead(*static_cast<const Frame*>(entry.frame), key, index, count, texels))
+	{
+		CountMicroHit();
+		return;
+	}
+
+	const int set = (int)((hash >> 8) % setCount);
+	Frame* ways = &frames[set * Ways];
+	bool missed = false;
+	while (true)
+	{
+		for (int w = 0; w < Ways; w++)
+		{
+			Frame& frame = ways[w];
+			if (frame.key.load(std::memory_order_relaxed) == key && TryRead(frame, key, index, count, texels))
+			{
+				frame.referenced.store(true, std::memory_order_relaxed);
+				entry.key = key;
+				entry.frame = &frame;
+				if (!missed)
+					hits.fetch_add(1, std::memory_order_relaxed);
+				return;
+			}
+		}
+
+		missed = true;
+		Load(set, key, texture, page);
+	}
+}
+
+void TextureCache::Load(int set, uint64_t key, const Texture& texture, uint32_t page)
+{
+	std::lock_guard<std::mutex> lock(setLocks[set]);
+	Frame* ways = &frames[set * Ways];
+
+	// Another thread may have brought it in while this one waited.
+	for (int w = 0; w < Ways; w++)
+	{
+		if (ways[w].key.load(std::memory_order_relaxed) == key)
+			return;
+	}
+
+	// CLOCK: skip frames used since the hand last passed, clearing their bit
+	Frame* victim = nullptr;
+	while (victim == nullptr)
+	{
+		Frame& frame = ways[hands[set]];
+		hands[set] = (hands[set] + 1) % Ways;
+		if (frame.key.load(std::memory_order_relaxed) == 0 || !frame.referenced.exchange(false, std::memory_order_relaxed))
+			victim = &frame;
+	}
+
+	uint32_t buffer[PageTexels];
+	texture.ReadPage(page, buffer);
+	misses.fetch_add(1, std::memory_order_relaxed);
+	if (victim->key.load(std::memory_order_relaxed) != 0)
+		evictions.fetch_add(1, std::memory_order_relaxed);
+	else
+		residentFrames.fetch_add(1, std::memory_order_relaxed);
+
+	// Odd sequence while the frame is rewritten, so readers retry
+	const uint32_t sequence = victim->sequence.load(std::memory_order_relaxed);
+	victim->sequence.store(sequence + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	victim->key.store(key, std::memory_order_relaxed);
+	for (int i = 0; i < PageTexels; i++)
+		victim->texels[i].store(buffer[i], std::memory_order_relaxed);
+	victim->referenced.store(true, std::memory_order_relaxed);
+	victim->sequence.store(sequence + 2, std::memory_order_release);
+}
+
+TextureCache::Stats TextureCache::GetStats() const
+{
+	Stats stats;
+	stats.microHits = 0;
+	for (const Counter& counter : microHits)
+		stats.microHits += counter.count.load();
+	stats.hits = hits.load();
+	stats.misses = misses.load();
+	stats.evictions = evictions.load();
+	stats.budget = (size_t)setCount * Ways * PageBytes;
+	stats.resident = residentFrames.load() * PageBytes;
+	return stats;
+}
@@ -0,0 +1,85 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+
+class Texture;
+
+////////////////////////////////////////////////////////////////////////
+// TextureCache: a fixed memory budget of page frames shared by every
+// texture.  A page is 32x32 texels of one mip level; it is read from
+// the texture's tiled file the first time a lookup needs it, and frames
+// are reused CLOCK-style within 8-way sets once the budget is full.
+//
+// Lookups take no locks.  A frame's sequence number is odd while it is
+// being refilled, and a reader that sees it change retries.  Each
+// thread also keeps a small direct-mapped table of recent pages.
+////////////////////////////////////////////////////////////////////////
+class TextureCache
+{
+public:
+	static const int PageBits = 5;
+	static const int PageSize = 1 << PageBits;		// texels on a side
+	static const int PageTexels = PageSize * PageSize;
+	static const size_t PageBytes = PageTexels * sizeof(uint32_t);
+
+	struct Stats
+	{
+		uint64_t microHits;		// found in the thread's own table
+		uint64_t hits;			// found in the shared frames
+		uint64_t misses;		// read from disk
+		uint64_t evictions;
+		size_t budget;			// bytes of frames
+		size_t resident;		// bytes of frames holding a page
+	};
+
+	static TextureCache& Get();
+
+	// Frames are reallocated, so call before rendering starts.
+	void SetBudget(size_t bytes);
+
+	// RGBA8 texels at the given indices within one page; page numbers
+	// are per texture.
+	void Read(const Texture& texture, uint32_t page, const int* index, int count, uint32_t* texels);
+
+	Stats GetStats() const;
+
+private:
+	static const int Ways = 8;
+	static const int CounterSlots = 64;
+
+	struct Frame
+	{
+		std::atomic<uint64_t> key{ 0 };		// texture id and page; 0 is empty
+		std::atomic<uint32_t> sequence{ 0 };
+		std::atomic<bool> referenced{ false };
+		std::atomic<uint32_t>* texels = nullptr;	// into storage
+	};
+
+	struct alignas(64) Counter
+	{
+		std::atomic<uint64_t> count{ 0 };
+	};
+
+	TextureCache();
+	~TextureCache();
+	static bool TryRead(const Frame& frame, uint64_t key, const int* index, int count, uint32_t* texels);
+	void Load(int set, uint64_t key, const Texture& texture, uint32_t page);
+	void CountMicroHit();
+
+	std::unique_ptr<Frame[]> frames;
+	std::atomic<uint32_t>* storage = nullptr;
+	std::unique_ptr<std::mutex[]> setLocks;		// held only to refill a frame
+	std::unique_ptr<int[]> hands;
+	int setCount = 0;
+	uint32_t generation = 0;		// invalidates the per-thread tables
+
+	Counter microHits[CounterSlots];		// per thread
+	std::atomic<uint32_t> nextCounter{ 0 };
+	std::atomic<uint64_t> hits{ 0 };
+	std::atomic<uint64_t> misses{ 0 };
+	std::atomic<uint64_t> evictions{ 0 };
+	std::atomic<size_t> residentFrames{ 0 };
+};
@@ -0,0 +1,41 @@
+#include "VisibilityCache.h"
+
+VisibilityCache::VisibilityCache(int resolution_, int minRecords_, int minDepth_, float validate_)
+	: resolution(resolution_), minRecords(minRecords_), minDepth(minDepth_), validate(validate_),
+	cells(SpatialHash::Capacity)
+{
+}
+
+void VisibilityCache::Start(const std::vector<Shape*>& shapes)
+{
+	grid.Start(shapes, resolution);
+}
+
+int VisibilityCache::Find(const vec3& point, const vec3& normal, int light)
+{
+	if (light < 0 || light >= (1 << LightBits))
+		return -1;
+	return grid.Find(grid.Key(point, normal, (uint64_t)light, LightBits), true);
+}
+
+bool VisibilityCache::Known(int c, bool& visible) const
+{
+	// Read the count first: a ray added meanwhile may show in visible
+	// but not in rays, which only makes a cell look mixed.
+	const Cell& cell = cells[c];
+	const uint32_t rays = cell.rays.load(std::memory_order_relaxed);
+	const uint32_t seen = cell.visible.load(std::memory_order_relaxed);
+	if (rays < (uint32_t)minRecords || (seen != 0 && seen != rays))
+		return false;
+
+	visible = seen != 0;
+	return true;
+}
+
+void VisibilityCache::Add(int c, bool visible)
+{
+	Cell& cell = cells[c];
+	if (visible)
+		cell.visible.fetch_add(1, std::memory_order_relaxed);
+	cell.rays.fetch_add(1, std::memory_order_relaxed);
+}
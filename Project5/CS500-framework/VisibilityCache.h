@@ -0,0 +1,60 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <vector>
+#include "geom.h"
+#include "SpatialHash.h"
+
+class Shape;
+
+////////////////////////////////////////////////////////////////////////
+// VisibilityCache: whether a light is seen from cells of a world-space
+// grid, learned from the shadow rays traced there.  A cell is one of a
+// SpatialHash's, tagged with the light's index.  It counts the shadow
+// rays toward its light and how many got through.
+//
+// Past the first minDepth - 1 vertices, where a path's contributions
+// weigh little, NEE asks the cache before tracing.  A cell with
+// minRecords rays that all agreed answers in their place; any other
+// traces and adds its answer.  A validate fraction of the answers is
+// traced anyway, so a cell that was wrong soon sees both outcomes and
+// stops answering.  Penumbrae are always traced, so the bias is left
+// to occluders too thin for any cell's rays to find.  The environment
+// is never cached, as what it shows depends on the direction sampled.
+////////////////////////////////////////////////////////////////////////
+class VisibilityCache
+{
+public:
+	VisibilityCache(int resolution, int minRecords, int minDepth, float validate);
+
+	// Sizes the cells to the shapes' bounds; call before rendering.
+	void Start(const std::vector<Shape*>& shapes);
+
+	// The cell at point facing normal for a light, or -1 if the table is
+	// full or the light's index does not fit a key
+	int Find(const vec3& point, const vec3& normal, int light);
+
+	// Whether the cell's rays all agreed, often enough, and if so on what
+	bool Known(int cell, bool& visible) const;
+
+	void Add(int cell, bool visible);
+
+	size_t CellCount() const { return grid.Count(); }
+
+	int resolution;			// cells along the longest side of the scene
+	int minRecords;			// agreeing rays before a cell answers
+	int minDepth;			// first vertex it answers for
+	float validate;			// share of answers traced anyway
+
+private:
+	static const int LightBits = 13;
+
+	struct Cell
+	{
+		std::atomic<uint32_t> rays{ 0 };
+		std::atomic<uint32_t> visible{ 0 };
+	};
+
+	SpatialHash grid;
+	std::vector<Cell> cells;	// by the grid's slots
+};
@@ -26,6 +26,7 @@
 
 #include "geom.h"
 #include "raytrace.h"
+#include "TextureCache.h"
 
 // Read a scene file by parsing each line as a command and calling
 // scene->Command(...) with the results.
@@ -71,8 +72,50 @@ int main(int argc, char** argv)
 
 	Scene* scene = new Scene();
 
-	// Read the command line argument
-	std::string inName = (argc > 1) ? argv[1] : "testscene.scn";
+	// Read the command line: the scene file plus options
+	//   --passes n   number of passes (default 8192)
+	//   --denoise    also write a denoised image and its feature buffers
+	//   --preview [n]  first write quick previews from 1/n resolution (default 8)
+	//   --crop x0 y0 x1 y1  render only this rectangle (top-left origin, x1 y1 exclusive)
+	//   --mask file         render only pixels that are bright in this image
+	//   --composite file    take the pixels not rendered from this .hdr
+	//   --reference file    print the error against this .hdr as the passes go
+	//   --nocache    ignore the scene's radiance and visibility caches
+	std::string inName = "testscene.scn";
+	for (int i = 1; i < argc; i++) {
+		const std::string arg = argv[i];
+		if (arg == "--denoise")
+			scene->options.denoise = true;
+		else if (arg == "--passes" && i + 1 < argc) {
+			const int passes = atoi(argv[++i]);
+			scene->options.passes = (passes > 0) ? passes : 1;
+		}
+		else if (arg == "--preview") {
+			const int factor = (i + 1 < argc) ? atoi(argv[i + 1]) : 0;
+			if (factor > 0)
+				i++;
+			scene->options.preview = (factor > 0) ? factor : 8;
+		}
+		else if (arg == "--crop" && i + 4 < argc) {
+			scene->options.crop = true;
+			scene->options.cropX0 = atoi(argv[++i]);
+			scene->options.cropY0 = atoi(argv[++i]);
+			scene->options.cropX1 = atoi(argv[++i]);
+			scene->options.cropY1 = atoi(argv[++i]);
+		}
+		else if (arg == "--mask" && i + 1 < argc)
+			scene->options.mask = argv[++i];
+		else if (arg == "--composite" && i + 1 < argc)
+			scene->options.composite = argv[++i];
+		else if (arg == "--reference" && i + 1 < argc)
+			scene->options.reference = argv[++i];
+		else if (arg == "--nocache")
+			scene->options.noCache = true;
+		else if (arg.compare(0, 2, "--") == 0)
+			std::cerr << "Unknown option: " << arg << std::endl;
+		else
+			inName = arg;
+	}
 	std::string hdrName = inName;
 	hdrName.replace(hdrName.size() - 3, hdrName.size(), "hdr");
 	scene->hdrName = hdrName;
@@ -81,6 +124,7 @@ int main(int argc, char** argv)
 	ReadScene(inName, scene);
 
 	scene->Finit();
+	scene->SetupRegion();
 
 	// Allocate and clear an image array
 	Color* image = new Color[scene->width * scene->height];
@@ -89,10 +133,19 @@ int main(int argc, char** argv)
 			image[y * scene->width + x] = Color(0, 0, 0);
 
 	// RayTrace the image
-	scene->TraceImage(image, 8192);
+	scene->TraceImage(image, scene->options.passes);
 
 	end = time(NULL);
 	double result = (double)(end - start);
 	std::cout << "---------------------" << std::endl;
 	std::cout << "Taking Time: " << result << " Seconds" << std::endl;
+
+	const TextureCache::Stats stats = TextureCache::Get().GetStats();
+	if (stats.misses > 0) {
+		const uint64_t lookups = stats.microHits + stats.hits + stats.misses;
+		printf("Texture cache: %.2f%% hits (%.2f%% per-thread), %llu misses, %llu evictions, %.1f of %.1f MB resident\n",
+			100.0 * (stats.microHits + stats.hits) / lookups, 100.0 * stats.microHits / lookups,
+			(unsigned long long)stats.misses, (unsigned long long)stats.evictions,
+			stats.resident / 1048576.0, stats.budget / 1048576.0);
+	}
 }
@@ -2,6 +2,7 @@
 // Provides the framework for a raytracer.
 ////////////////////////////////////////////////////////////////////////
 
+#include <chrono>
 #include <vector>
 #include <fstream>
 
@@ -28,6 +29,24 @@
 #include "Camera.h"
 #include "Helper.h"
 #include "rgbe.h"
+#include "TextureCache.h"
+#include "Denoiser.h"
+#include "Preview.h"
+#include "Ray.h"
+#include "HDRReader.h"
+#include "PhotonMap.h"
+#include "Bidirectional.h"
+#include "Metropolis.h"
+#include "PathGuide.h"
+#include "RadianceCache.h"
+#include "Restir.h"
+#include "PrimaryHits.h"
+#include "Splitting.h"
+#include "VisibilityCache.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 Scene::Scene()
 {
@@ -38,39 +57,36 @@ void Scene::Finit()
 {
 	bvh = new AccelerationBvh(staticRayTrace->shapes);
 	staticRayTrace->bvh = bvh;
+	staticRayTrace->lightDistribution.Build(staticRayTrace->lights, staticRayTrace->shapes);
+	if (staticRayTrace->guide != nullptr)
+		staticRayTrace->guide->Start(staticRayTrace->shapes);
+	if (staticRayTrace->radianceCache != nullptr && options.noCache)
+	{
+		delete staticRayTrace->radianceCache;
+		staticRayTrace->radianceCache = nullptr;
+	}
+	if (staticRayTrace->radianceCache != nullptr)
+		staticRayTrace->radianceCache->Start(staticRayTrace->shapes);
+	if (staticRayTrace->visibilityCache != nullptr && options.noCache)
+	{
+		delete staticRayTrace->visibilityCache;
+		staticRayTrace->visibilityCache = nullptr;
+	}
+	if (staticRayTrace->visibilityCache != nullptr)
+		staticRayTrace->visibilityCache->Start(staticRayTrace->shapes);
 }
 
 void Scene::triangleMesh(MeshData* mesh)
 {
-	staticRayTrace->AddModel(mesh, currentMat);
-}
-
-Texture::Texture(const std::string& bpath) : id(0)
-{
-	// Replace backslashes with forward slashes -- Good for Linux, and maybe Windows?
-	std::string path = bpath;
-	std::string bs = "\\";
-	std::string fs = "/";
-	while (path.find(bs) != std::string::npos) {
-		path.replace(path.find(bs), 1, fs);
-	}
-
-	// Does the file exist?
-	std::ifstream find_it(path.c_str());
-	if (find_it.fail()) {
-		std::cerr << "Texture file not found: " << path << std::endl;
-		exit(-1);
-	}
-	else {
-		// Read image, and check for success
-		stbi_set_flip_vertically_on_load(true);
-		image = stbi_load(path.c_str(), &width, &height, &depth, 4);
-		printf("%d %d %d %s\n", depth, width, height, path.c_str());
-		if (!image) {
-			printf("\nRead error on file %s:\n  %s\n\n", path.c_str(), stbi_failure_reason());
-			exit(-1);
-		}
+	// Meshes keep the scene's current BRDF but take the model's diffuse texture.
+	Material* mat = currentMat;
+	if (mesh->mat != nullptr && mesh->mat->tex != nullptr && !currentMat->isLight())
+	{
+		mat = new Material(*currentMat);
+		mat->tex = mesh->mat->tex;
 	}
+
+	staticRayTrace->AddModel(mesh, mat);
 }
 
 quat Orientation(int i,
@@ -193,9 +209,159 @@ void Scene::Command(const std::vector<std::string>& strings,
 
 	else if (c == "ibl")
 	{
-		auto shape = new IBL(vec3(f[1], f[2], f[3]), f[4], currentMat);
-		staticRayTrace->ibl = shape;
-		staticRayTrace->AddShape(shape);
+		// ibl x y z r [path]: the environment map defaults to background.hdr.
+		// The environment is a light, so it needs a light material.
+		if (!currentMat->isLight())
+			fprintf(stderr, "ERROR: ibl needs a light material; ignoring it\n");
+		else
+		{
+			const std::string path = (strings.size() > 5) ? strings[5] : "background.hdr";
+			auto shape = new IBL(vec3(f[1], f[2], f[3]), f[4], path, currentMat);
+			staticRayTrace->SetEnvironment(shape);
+		}
+	}
+
+	else if (c == "roulette") {
+		// syntax: roulette minDepth maxDepth survival
+		// Path termination; maxDepth 0 is no limit, and survival is a
+		// probability or the word throughput (default: roulette 0 0 throughput).
+		staticRayTrace->minDepth = (f.size() > 1) ? (int)f[1] : 0;
+		staticRayTrace->maxDepth = (f.size() > 2) ? (int)f[2] : 0;
+		staticRayTrace->throughputRoulette = f.size() <= 3 || strings[3] == "throughput";
+		if (!staticRayTrace->throughputRoulette)
+			staticRayTrace->survival = f[3];
+	}
+
+	else if (c == "clamp") {
+		// syntax: clamp sampleMax indirectMax
+		// Largest radiance of a path sample, and of each contribution
+		// after the first bounce; 0 leaves it unclamped (the default).
+		staticRayTrace->clampSample = (f.size() > 1) ? f[1] : 0.0f;
+		staticRayTrace->clampIndirect = (f.size() > 2) ? f[2] : 0.0f;
+	}
+
+	else if (c == "regularize") {
+		// syntax: regularize alpha
+		// Least microfacet roughness of vertices past a diffuse bounce
+		// (0.0 to 1.0, default 0.0: not regularized)
+		staticRayTrace->regularize = (f.size() > 1) ? f[1] : 0.0f;
+	}
+
+	else if (c == "photons") {
+		// syntax: photons count radius alpha
+		// Caustics by progressive photon mapping: photons emitted per pass,
+		// the first pass's gather radius (0 to size it from the scene) and
+		// how slowly it shrinks (0 to 1) (default: photons 100000 0 0.7).
+		const int count = (f.size() > 1) ? (int)f[1] : 100000;
+		const float radius = (f.size() > 2) ? f[2] : 0.0f;
+		const float alpha = (f.size() > 3) ? f[3] : 0.7f;
+		staticRayTrace->photons = new PhotonMap(count, radius, alpha);
+	}
+
+	else if (c == "bdpt") {
+		// syntax: bdpt maxDepth
+		// Bidirectional path tracing with paths of at most maxDepth bounces (default 10)
+		staticRayTrace->bidirectional = new Bidirectional(*staticRayTrace, (f.size() > 1) ? (int)f[1] : 10);
+	}
+
+	else if (c == "mlt") {
+		// syntax: mlt chains bootstrap largeStep sigma seed
+		// Primary sample space Metropolis light transport: Markov chains,
+		// independent paths to normalize by, the probability of a large
+		// step, the size of a small one, and the seed everything follows
+		// from (default: mlt 1000 100000 0.3 0.01 0).
+		const int chains = (f.size() > 1) ? (int)f[1] : 1000;
+		const int bootstrap = (f.size() > 2) ? (int)f[2] : 100000;
+		const float largeStep = (f.size() > 3) ? f[3] : 0.3f;
+		const float sigma = (f.size() > 4) ? f[4] : 0.01f;
+		const uint64_t seed = (f.size() > 5) ? (uint64_t)f[5] : 0;
+		staticRayTrace->metropolis = new Metropolis(chains, bootstrap, largeStep, sigma, seed);
+	}
+
+	else if (c == "guide") {
+		// syntax: guide trainingPasses fraction splitThreshold
+		// Path guiding learned over the first trainingPasses passes, in
+		// iterations of 1, 2, 4, ... passes; later ones benefit too.  A
+		// fraction of extension rays follow the guide, and a region of
+		// the scene splits once it records splitThreshold * sqrt(passes)
+		// rays in an iteration (default: guide 63 0.3 4000).
+		const int trainingPasses = (f.size() > 1) ? (int)f[1] : 63;
+		const float fraction = (f.size() > 2) ? f[2] : 0.3f;
+		const float splitThreshold = (f.size() > 3) ? f[3] : 4000.0f;
+		staticRayTrace->guide = new PathGuide(trainingPasses, fraction, splitThreshold);
+	}
+
+	else if (c == "radiancecache") {
+		// syntax: radiancecache resolution minRecords
+		// Paths that have bounced off a diffuse surface end at the next
+		// one in indirect light cached on a grid with resolution cells
+		// along the scene's longest side, once a cell has minRecords
+		// records.  Coarser cells and fewer records trade more bias for
+		// less noise (default: radiancecache 32 32; --nocache ignores it).
+		const int resolution = (f.size() > 1) ? (int)f[1] : 32;
+		const int minRecords = (f.size() > 2) ? (int)f[2] : 32;
+		staticRayTrace->radianceCache = new RadianceCache(resolution, minRecords);
+	}
+
+	else if (c == "visibilitycache") {
+		// syntax: visibilitycache resolution minRecords minDepth validate
+		// Shadow rays from the minDepth-th vertex of a path on are
+		// answered by a grid with resolution cells along the scene's
+		// longest side, once minRecords rays traced in a cell toward a
+		// light all agreed; a validate share of them is traced anyway
+		// (default: visibilitycache 64 16 2 0.1; --nocache ignores it).
+		const int resolution = (f.size() > 1) ? (int)f[1] : 64;
+		const int minRecords = (f.size() > 2) ? (int)f[2] : 16;
+		const int minDepth = (f.size() > 3) ? (int)f[3] : 2;
+		const float validate = (f.size() > 4) ? f[4] : 0.1f;
+		staticRayTrace->visibilityCache = new VisibilityCache(resolution, minRecords, minDepth, validate);
+	}
+
+	else if (c == "restir") {
+		// syntax: restir candidates neighbours radius history
+		// Direct light at first hits by reservoir resampling: each pixel
+		// draws candidates light samples, then borrows the reservoirs of
+		// up to neighbours pixels within radius pixels and its own from
+		// the last pass, counted as at most history passes' worth
+		// (default: restir 4 5 10 4).  Ignored by bdpt and mlt.
+		const int candidates = (f.size() > 1) ? (int)f[1] : 4;
+		const int neighbours = (f.size() > 2) ? (int)f[2] : 5;
+		const float radius = (f.size() > 3) ? f[3] : 10.0f;
+		const int history = (f.size() > 4) ? (int)f[4] : 4;
+		staticRayTrace->restir = new Restir(candidates, neighbours, radius, history);
+	}
+
+	else if (c == "primaryhits") {
+		// syntax: primaryhits samples megabytes
+		// Camera rays go through samples fixed subpixel positions per
+		// pixel in turn; their first hits are traced in the first samples
+		// passes and read back after that.  Fewer positions are used if
+		// megabytes would not hold them (default: primaryhits 16 256).
+		// Used only when paths are traced one pixel at a time, without
+		// bdpt, mlt or restir, and not with motion blur.
+		const int samples = (f.size() > 1) ? (int)f[1] : 16;
+		const float megabytes = (f.size() > 2) ? f[2] : 256.0f;
+		staticRayTrace->primaryHits = new PrimaryHits(samples, megabytes);
+	}
+
+	else if (c == "split") {
+		// syntax: split lights continuations depth
+		// Paths take lights light samples at each of their first depth
+		// vertices, and continuations paths leave the first one, each
+		// carrying its share.  A count of 0 is chosen from the first two
+		// passes by the measured cost and variance of each kind of sample
+		// (default: split 0 0 1).  Ignored by bdpt; mlt keeps two of each.
+		const int lights = (f.size() > 1) ? (int)f[1] : 0;
+		const int continuations = (f.size() > 2) ? (int)f[2] : 0;
+		const int depth = (f.size() > 3) ? (int)f[3] : 1;
+		staticRayTrace->split = new Splitting(lights, continuations, depth);
+	}
+
+	else if (c == "texturecache") {
+		// syntax: texturecache megabytes
+		// Memory for texture pages shared by all textures (default 256).
+		const float megabytes = (f.size() > 1) ? f[1] : 256.0f;
+		TextureCache::Get().SetBudget((size_t)(megabytes * (1 << 20)));
 	}
 
 	else {
@@ -207,50 +373,581 @@ void Scene::Command(const std::vector<std::string>& strings,
 
 void Scene::TraceImage(Color* image, const int pass)
 {
-	vec3 X = staticRayTrace->camera->X;
-	vec3 Y = staticRayTrace->camera->Y;
-	vec3 Z = staticRayTrace->camera->Z;
-
-	vec3 eye = staticRayTrace->camera->eye;
-	float f_width = static_cast<float>(width);
-	float f_height = static_cast<float>(height);
 	int occasionallyStep = 30;
 
+	if (options.preview > 1)
+		TracePreview(options.preview);
+	const auto start = std::chrono::steady_clock::now();
+
+	// Metropolis chains wander between pixels, leaving no per-pixel samples to filter.
+	Metropolis* metropolis = staticRayTrace->metropolis;
+	if (options.denoise && metropolis != nullptr)
+		fprintf(stderr, "The denoiser does not work with mlt; not denoising\n");
+	Denoiser* denoiser = (options.denoise && metropolis == nullptr) ? new Denoiser(width, height) : nullptr;
+	PathStats stats;
+
+	// Light tracing and Metropolis land anywhere in the frame, so each
+	// thread splats into its own buffer and they are summed after every pass.
+	Bidirectional* bidirectional = staticRayTrace->bidirectional;
+	std::vector<std::vector<Color>> splats;
+	float splatScale = 0.0f;
+	int mutations = 0;
+	if (bidirectional != nullptr || metropolis != nullptr)
+	{
+#ifdef _OPENMP
+		splats.resize(omp_get_max_threads());
+#else
+		splats.resize(1);
+#endif
+		for (std::vector<Color>& splat : splats)
+			splat.assign(width * height, Color(0));
+	}
+
+	if (metropolis != nullptr)
+	{
+		// A pass makes about one mutation per pixel of the region's
+		// bounds, the space the chains' paths cover.
+		metropolis->Bootstrap(*this);
+		const int bounds = (region.x1 - region.x0) * (region.y1 - region.y0);
+		const int chains = (metropolis->chains > 0) ? metropolis->chains : 1;
+		mutations = (bounds + chains - 1) / chains;
+		splatScale = metropolis->Normalization() * bounds / ((float)mutations * chains);
+	}
+	else if (bidirectional != nullptr)
+	{
+		// One light subpath per pixel traced; each splat stands for a
+		// pixel's share of all of them.
+		int traced = 0;
+		for (int y = region.y0; y < region.y1; y++)
+			for (int x = region.x0; x < region.x1; x++)
+				traced += region.Contains(x, y, width) ? 1 : 0;
+		splatScale = (traced > 0) ? (float)(width * height) / traced : 0.0f;
+	}
+	else if (staticRayTrace->restir != nullptr)
+		staticRayTrace->restir->Resize(width, height);
+
+	// Stored first hits stand in for camera rays only in the plain pixel
+	// loop, and only while every shape stays where it was.
+	PrimaryHits* primary = (metropolis == nullptr && bidirectional == nullptr && staticRayTrace->restir == nullptr)
+		? staticRayTrace->primaryHits : nullptr;
+	if (primary != nullptr)
+	{
+		bool moving = false;
+		for (const Shape* shape : staticRayTrace->shapes)
+			moving = moving || shape->activeMotionBlur;
+		if (moving)
+			fprintf(stderr, "Motion blur moves first hits between passes; not keeping them\n");
+		else if (!primary->Resize(width, height))
+			fprintf(stderr, "Not even one first hit per pixel fits in %g MB; not keeping them\n", primary->megabytes);
+		if (moving || primary->Count() == 0)
+			primary = nullptr;
+	}
+
+	// Automatic splitting compares each pixel's samples from the first
+	// two passes, so the image is kept as it was before each.
+	Splitting* split = (metropolis == nullptr && bidirectional == nullptr) ? staticRayTrace->split : nullptr;
+	std::vector<Color> pilot[2];
+
 	for (int p = 0; p < pass; ++p)
 	{
-#pragma omp parallel for schedule(dynamic, 1) // Magic: Multi-thread y loop
-		for (int y = 0; y < height; y++)
+		if (split != nullptr && split->Measuring() && p < 2)
+			pilot[p].assign(image, image + width * height);
+
+		if (staticRayTrace->photons != nullptr)
+			staticRayTrace->photons->Build(*staticRayTrace);
+
+		if (metropolis != nullptr)
 		{
-			for (int x = 0; x < width; x++)
+#pragma omp parallel for schedule(dynamic, 1)
+			for (int c = 0; c < metropolis->chains; c++)
+			{
+#ifdef _OPENMP
+				Color* splat = splats[omp_get_thread_num()].data();
+#else
+				Color* splat = splats[0].data();
+#endif
+				metropolis->Advance(*this, c, mutations, splat);
+			}
+		}
+		else if (staticRayTrace->restir != nullptr && bidirectional == nullptr)
+			TraceRestirPass(image, denoiser, stats);
+		else
+		{
+#pragma omp parallel for schedule(dynamic, 1) // Magic: Multi-thread y loop
+			for (int y = region.y0; y < region.y1; y++)
 			{
-				float dx = 2.f * ((float)x + myrandomf(RNGen)) / f_width - 1.f;
-				float dy = 2.f * ((float)y + myrandomf(RNGen)) / f_height - 1.f;
+				PathStats rowStats;
+				for (int x = region.x0; x < region.x1; x++)
+				{
+					if (!region.mask.empty() && !region.mask[y * width + x])
+						continue;
+
+					const int k = (primary != nullptr) ? p % primary->Count() : 0;
+					const vec2 position = (primary != nullptr) ? primary->Position(x, y, k)
+						: vec2((float)x + myrandomf(RNGen), (float)y + myrandomf(RNGen));
+					Ray ray = CameraRay(position.x, position.y);
+					FirstHit hit;
+					Color color;
+					if (bidirectional != nullptr)
+					{
+#ifdef _OPENMP
+						Color* splat = splats[omp_get_thread_num()].data();
+#else
+						Color* splat = splats[0].data();
+#endif
+						color = bidirectional->Trace(ray, width, height, splat, denoiser ? &hit : nullptr);
+					}
+					else if (primary != nullptr)
+					{
+						Intersection P;
+						if (p < primary->Count())
+						{
+							P = staticRayTrace->Intersect(ray);
+							primary->Store(y * width + x, k, P);
+						}
+						else
+							P = primary->Load(y * width + x, k, ray, *staticRayTrace);
+						color = staticRayTrace->TraceRay(ray, denoiser ? &hit : nullptr, &rowStats, nullptr, &P);
+					}
+					else
+						color = staticRayTrace->TraceRay(ray, denoiser ? &hit : nullptr, &rowStats);
+
+					const bool valid = IsValidColor(color);
+					if (valid)
+						image[y * width + x] += color;
+					if (denoiser)
+						denoiser->Add(y * width + x, valid ? color : Color(0), hit);
+				}
+
+#pragma omp critical
+				stats.Add(rowStats);
+			}
+		}
 
-				Ray ray(eye, normalize(dx * X + dy * Y - Z));
-				Color color = staticRayTrace->TraceRay(ray);
+		if (staticRayTrace->guide != nullptr)
+			staticRayTrace->guide->EndPass();
 
-				if (IsValidColor(color))
-					image[y * width + x] += color;
+		// Splats outside the region are dropped, as its pixels come from elsewhere.
+		for (std::vector<Color>& splat : splats)
+		{
+			for (int i = 0; i < width * height; i++)
+			{
+				if (region.Contains(i % width, i / width, width) && IsValidColor(splat[i]))
+					image[i] += splatScale * splat[i];
+				splat[i] = Color(0);
+			}
+		}
+
+		if (split != nullptr && split->Measuring() && p == 1)
+		{
+			double squares = 0.0;
+			int pixels = 0;
+			for (int i = 0; i < width * height; i++)
+			{
+				if (!region.Contains(i % width, i / width, width))
+					continue;
+				const float d = Luminance(pilot[1][i] - pilot[0][i]) - Luminance(image[i] - pilot[1][i]);
+				squares += 0.5 * d * d;
+				pixels++;
 			}
+			split->Choose(stats, (pixels > 0) ? squares / pixels : 0.0);
 		}
 
 		if (p % occasionallyStep == occasionallyStep - 1)
 			WriteHDRImage(image, p);
+
+		if (!reference.empty() && ((p & (p + 1)) == 0 || p == pass - 1))
+		{
+			const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			printf("Error: %d passes, %.3f seconds, RMSE %g\n", p + 1, seconds, ReferenceError(image, p + 1));
+		}
 	}
 
 	WriteHDRImage(image, pass);
 	fprintf(stderr, "\n");
+	PrintPathStats(stats);
+
+	if (metropolis != nullptr)
+		printf("Metropolis: %d chains, mean luminance %g, %.1f%% of mutations accepted\n", metropolis->chains,
+			metropolis->Normalization(), 100.0 * metropolis->AcceptanceRate());
+
+	const PathGuide* guide = staticRayTrace->guide;
+	if (guide != nullptr && guide->Ready())
+		printf("Guide: %d iterations, %zu regions, %zu direction nodes\n", guide->iterations,
+			guide->LeafCount(), guide->DirectionNodeCount());
+
+	const RadianceCache* cache = staticRayTrace->radianceCache;
+	uint64_t paths = 0;
+	for (int d = 0; d <= PathStats::MaxDepth; d++)
+		paths += stats.ended[d];
+	if (cache != nullptr && paths > 0)
+		printf("Radiance cache: %zu cells, %.1f%% of paths ended in it\n", cache->CellCount(),
+			100.0 * stats.cached / paths);
+
+	if (split != nullptr)
+		printf("Splitting: %d light samples at %d vertices, %d continuations\n", split->lights, split->depth,
+			split->continuations);
+	if (split != nullptr && split->sharedCost > 0.0)
+		printf("  chosen from variance %g shared, %g per light sample, %g per continuation;"
+			" cost %.2f, %.2f, %.2f us\n", split->sharedVariance, split->lightVariance,
+			split->continuationVariance, split->sharedCost, split->lightCost, split->continuationCost);
+
+	const VisibilityCache* visibility = staticRayTrace->visibilityCache;
+	const uint64_t shadows = stats.shadowRays + stats.shadowCached;
+	if (visibility != nullptr && shadows > 0)
+		printf("Visibility cache: %zu cells, answered %.1f%% of %llu shadow queries\n", visibility->CellCount(),
+			100.0 * stats.shadowCached / shadows, (unsigned long long)shadows);
+
+	if (primary != nullptr)
+		printf("Primary hits: %d per pixel, %.1f MB\n", primary->Count(), primary->Bytes() / (1024.0 * 1024.0));
+
+	const PhotonMap* photons = staticRayTrace->photons;
+	if (photons != nullptr && photons->emitted > 0)
+		printf("Photons: %d per pass, %.2f%% kept as caustics, final radius %g\n", photons->photonsPerPass,
+			100.0 * photons->stored / photons->emitted, photons->radius);
+
+	if (denoiser)
+	{
+		WriteDenoisedImages(image, pass, *denoiser);
+		delete denoiser;
+	}
+}
+
+double Scene::ReferenceError(const Color* image, int passes)
+{
+	// Scaled as WriteHDRImage scales it
+	const float scale = 1.0f / (float)(passes / 2.5);
+	double sum = 0.0;
+	int count = 0;
+	for (int y = region.y0; y < region.y1; y++)
+		for (int x = region.x0; x < region.x1; x++)
+		{
+			if (!region.Contains(x, y, width))
+				continue;
+			const Color d = image[y * width + x] * scale - reference[y * width + x];
+			sum += dot(d, d) / 3.0;
+			count++;
+		}
+	return (count > 0) ? sqrt(sum / count) : 0.0;
+}
+
+// Each sweep finishes every pixel before the next begins, so reservoirs
+// are complete before neighbours borrow them.
+void Scene::TraceRestirPass(Color* image, Denoiser* denoiser, PathStats& stats)
+{
+	Restir& restir = *staticRayTrace->restir;
+
+#pragma omp parallel for schedule(dynamic, 1)
+	for (int y = region.y0; y < region.y1; y++)
+	{
+		for (int x = region.x0; x < region.x1; x++)
+		{
+			if (!region.Contains(x, y, width))
+				continue;
+
+			const int i = y * width + x;
+			restir.sample[i] = vec2((float)x + myrandomf(RNGen), (float)y + myrandomf(RNGen));
+			restir.Sample(*staticRayTrace, i, CameraRay(restir.sample[i].x, restir.sample[i].y));
+		}
+	}
+
+#pragma omp parallel for schedule(dynamic, 1)
+	for (int y = region.y0; y < region.y1; y++)
+		for (int x = region.x0; x < region.x1; x++)
+			if (region.Contains(x, y, width))
+				restir.Reuse(*staticRayTrace, x, y, region);
+
+#pragma omp parallel for schedule(dynamic, 1)
+	for (int y = region.y0; y < region.y1; y++)
+	{
+		PathStats rowStats;
+		for (int x = region.x0; x < region.x1; x++)
+		{
+			if (!region.Contains(x, y, width))
+				continue;
+
+			const int i = y * width + x;
+			vec3 direct;
+			const bool lit = restir.Shade(*staticRayTrace, i, direct);
+			FirstHit hit;
+			const Color color = staticRayTrace->TraceRay(CameraRay(restir.sample[i].x, restir.sample[i].y),
+				denoiser ? &hit : nullptr, &rowStats, lit ? &direct : nullptr, &restir.hit[i]);
+
+			const bool valid = IsValidColor(color);
+			if (valid)
+				image[i] += color;
+			if (denoiser)
+				denoiser->Add(i, valid ? color : Color(0), hit);
+		}
+
+#pragma omp critical
+		stats.Add(rowStats);
+	}
+}
+
+// Path lengths, and the share of paths still going at each depth
+void Scene::PrintPathStats(const PathStats& stats)
+{
+	uint64_t paths = 0, vertices = 0;
+	int last = 0;
+	for (int d = 0; d <= PathStats::MaxDepth; d++) {
+		paths += stats.ended[d];
+		vertices += d * stats.ended[d];
+		if (stats.ended[d] > 0)
+			last = d;
+	}
+	if (paths == 0)
+		return;
+
+	// Each shaded vertex traces a shadow ray and an extension ray, but
+	// for those the visibility cache answered.
+	printf("Paths: %llu, %.3f vertices each, %llu rays\n", (unsigned long long)paths,
+		(double)vertices / paths, (unsigned long long)(paths + 2 * vertices - stats.shadowCached));
+	printf("Alive at depth:");
+	uint64_t alive = paths;
+	for (int d = 1; d <= last; d++) {
+		alive -= stats.ended[d - 1];
+		if (alive * 1000 < paths) {
+			printf(" ... %d", last);
+			break;
+		}
+		printf(" %d:%.1f%%", d, 100.0 * alive / paths);
+	}
+	printf("\n");
+}
+
+Ray Scene::CameraRay(float x, float y) const
+{
+	const Camera* camera = staticRayTrace->camera;
+	float dx = 2.f * x / (float)width - 1.f;
+	float dy = 2.f * y / (float)height - 1.f;
+
+	Ray ray(camera->eye, normalize(dx * camera->X + dy * camera->Y - camera->Z));
+
+	// Angle one pixel subtends, which seeds the ray's cone
+	ray.spread = 2.0f * length(camera->Y) / (float)height;
+	return ray;
+}
+
+// Renders at 1/factor resolution, then 1/(factor/2), ... down to 1/2,
+// each level for as many samples as one full pass.  The upsampled image
+// replaces the output file after 1, 2, 4, ... passes of the coarsest
+// level and at the end of each finer one; the full render's first write
+// then supersedes it.
+void Scene::TracePreview(int factor)
+{
+	const auto start = std::chrono::steady_clock::now();
+	Preview preview(width, height);
+	std::vector<Color> out(width * height);
+
+	// Guides: what the ray through each pixel center hits, without shading
+#pragma omp parallel for schedule(dynamic, 4)
+	for (int y = region.y0; y < region.y1; y++)
+	{
+		for (int x = region.x0; x < region.x1; x++)
+		{
+			const Ray ray = CameraRay(x + 0.5f, y + 0.5f);
+			const Intersection P = staticRayTrace->Intersect(ray);
+			FirstHit hit;
+			hit.normal = (P.object != nullptr) ? P.normal : -ray.D;
+			hit.depth = (P.object != nullptr && P.object != staticRayTrace->ibl) ? P.t : 0.0f;
+			preview.SetGuide(y * width + x, hit);
+		}
+	}
+
+	for (int f = factor; f > 1; f /= 2)
+	{
+		preview.Start(f);
+		const int passes = f * f;
+		for (int p = 0; p < passes; p++)
+		{
+#pragma omp parallel for schedule(dynamic, 1)
+			for (int j = region.y0 / f; j < (region.y1 + f - 1) / f; j++)
+			{
+				for (int i = region.x0 / f; i < (region.x1 + f - 1) / f; i++)
+				{
+					// A jittered position anywhere in the block, which may be cut off at the edge
+					const int blockWidth = (width - i * f < f) ? width - i * f : f;
+					const int blockHeight = (height - j * f < f) ? height - j * f : f;
+					const float px = i * f + myrandomf(RNGen) * blockWidth;
+					const float py = j * f + myrandomf(RNGen) * blockHeight;
+					Ray ray = CameraRay(px, py);
+					ray.spread *= f;
+
+					FirstHit hit;
+					Color color = staticRayTrace->TraceRay(ray, &hit);
+					preview.Add(j * preview.blocksX + i, IsValidColor(color) ? color : Color(0), hit);
+				}
+			}
+
+			// A finer level is only better once it is complete.
+			const bool first = (f == factor) && (p & (p + 1)) == 0;
+			if (first || p == passes - 1)
+			{
+				preview.Upsample(p + 1, out.data());
+				WriteComposited(out.data(), 2.5f);	// same brightness as the full render
+				const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+				fprintf(stderr, "Preview 1/%d, %d passes: %.3f seconds\n", f, p + 1, seconds);
+			}
+		}
+	}
+}
+
+// Writes <name>_denoised.hdr, plus the feature buffers that guided it.
+void Scene::WriteDenoisedImages(const Color* image, int passes, const Denoiser& denoiser)
+{
+	const auto start = std::chrono::steady_clock::now();
+	std::vector<Color> out(width * height);
+	denoiser.Run(image, passes, out.data());
+	const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	printf("Denoised in %.3f seconds\n", seconds);
+
+	// Same brightness as the main image
+	WriteHDR(OutputName("_denoised"), out.data(), 2.5f);
+
+	std::vector<Color> albedo(width * height), normal(width * height), depth(width * height), variance(width * height);
+	for (int i = 0; i < width * height; i++) {
+		albedo[i] = denoiser.Albedo(i, passes);
+		normal[i] = 0.5f * denoiser.Normal(i) + 0.5f;
+		depth[i] = Color(denoiser.Depth(i, passes));
+		variance[i] = Color(denoiser.Variance(image, i, passes));
+	}
+	WriteHDR(OutputName("_albedo"), albedo.data(), 1.0f);
+	WriteHDR(OutputName("_normal"), normal.data(), 1.0f);
+	WriteHDR(OutputName("_depth"), depth.data(), 1.0f);
+	WriteHDR(OutputName("_variance"), variance.data(), 1.0f);
+}
+
+std::string Scene::OutputName(const std::string& suffix) const
+{
+	const size_t dot = hdrName.rfind('.');
+	if (dot == std::string::npos)
+		return hdrName + suffix;
+	return hdrName.substr(0, dot) + suffix + hdrName.substr(dot);
 }
 
 // Write the image as a HDR(RGBE) image.  
 void Scene::WriteHDRImage(Color* image, int currentPass)
+{
+	WriteComposited(image, 1.0f / (float)(currentPass / 2.5));	// magic number for visible brightness
+}
+
+// Writes hdrName: the region from pixels, everything else from background.
+void Scene::WriteComposited(const Color* pixels, float scale)
+{
+	if (background.empty()) {
+		WriteHDR(hdrName, pixels, scale);
+		return;
+	}
+
+	std::vector<Color> out(background);
+#pragma omp parallel for
+	for (int y = region.y0; y < region.y1; y++)
+		for (int x = region.x0; x < region.x1; x++)
+			if (region.Contains(x, y, width))
+				out[y * width + x] = pixels[y * width + x] * scale;
+	WriteHDR(hdrName, out.data(), 1.0f);
+}
+
+// Reads a width x height .hdr into a bottom-up array.
+static bool ReadFrame(const std::string& path, int width, int height, std::vector<Color>& pixels)
+{
+	HDRResult frame;
+	if (!HDRReader::load(path.c_str(), frame))
+		return false;
+	if (frame.width != width || frame.height != height) {
+		delete[] frame.cols;
+		return false;
+	}
+
+	// The file is top-down.
+	pixels.resize(width * height);
+	for (int y = 0; y < height; y++)
+		for (int x = 0; x < width; x++) {
+			const float* c = frame.cols + ((size_t)(height - 1 - y) * width + x) * 3;
+			pixels[y * width + x] = Color(c[0], c[1], c[2]);
+		}
+	delete[] frame.cols;
+	return true;
+}
+
+void Scene::SetupRegion()
+{
+	region = Region();
+	region.x1 = width;
+	region.y1 = height;
+
+	if (options.crop) {
+		// Flip to bottom-up and keep it inside the frame.
+		region.x0 = glm::clamp(options.cropX0, 0, width);
+		region.x1 = glm::clamp(options.cropX1, 0, width);
+		region.y0 = glm::clamp(height - options.cropY1, 0, height);
+		region.y1 = glm::clamp(height - options.cropY0, 0, height);
+	}
+
+	if (!options.mask.empty()) {
+		int w, h, n;
+		stbi_set_flip_vertically_on_load(true);
+		unsigned char* mask = stbi_load(options.mask.c_str(), &w, &h, &n, 1);
+		if (!mask || w != width || h != height) {
+			fprintf(stderr, "ERROR: mask %s must be a %dx%d image\n", options.mask.c_str(), width, height);
+			exit(-1);
+		}
+
+		// Shrink the bounds to the mask, so the loops skip empty rows and columns.
+		region.mask.assign(width * height, 0);
+		int x0 = width, y0 = height, x1 = 0, y1 = 0;
+		for (int y = region.y0; y < region.y1; y++) {
+			for (int x = region.x0; x < region.x1; x++) {
+				if (mask[y * width + x] < 128)
+					continue;
+				region.mask[y * width + x] = 1;
+				if (x < x0) x0 = x;
+				if (y < y0) y0 = y;
+				if (x >= x1) x1 = x + 1;
+				if (y >= y1) y1 = y + 1;
+			}
+		}
+		stbi_image_free(mask);
+		region.x0 = x0;
+		region.y0 = y0;
+		region.x1 = x1;
+		region.y1 = y1;
+	}
+
+	if (region.x0 >= region.x1 || region.y0 >= region.y1) {
+		fprintf(stderr, "ERROR: the crop and mask leave no pixels to render\n");
+		exit(-1);
+	}
+
+	if (options.crop || !options.mask.empty()) {
+		int count = 0;
+		for (int y = region.y0; y < region.y1; y++)
+			for (int x = region.x0; x < region.x1; x++)
+				count += region.Contains(x, y, width);
+		fprintf(stderr, "Rendering %d of %d pixels\n", count, width * height);
+	}
+
+	if (!options.composite.empty() && !ReadFrame(options.composite, width, height, background)) {
+		fprintf(stderr, "ERROR: cannot composite into %s; it must be a %dx%d .hdr\n", options.composite.c_str(), width, height);
+		exit(-1);
+	}
+
+	if (!options.reference.empty() && !ReadFrame(options.reference, width, height, reference)) {
+		fprintf(stderr, "ERROR: cannot compare with %s; it must be a %dx%d .hdr\n", options.reference.c_str(), width, height);
+		exit(-1);
+	}
+}
+
+void Scene::WriteHDR(const std::string& name, const Color* pixels, float scale)
 {
 	// Turn image from a 2D-bottom-up array of Vector3D to an top-down-array of floats
 	float* data = new float[width * height * 3];
-	float* dp = data;
+#pragma omp parallel for
 	for (int y = height - 1; y >= 0; --y) {
+		float* dp = data + (height - 1 - y) * width * 3;
 		for (int x = 0; x < width; ++x) {
-			Color pixel = image[y * width + x] / (float)(currentPass / 2.5);	// magic number for visible brightness
+			Color pixel = pixels[y * width + x] * scale;
 
 			*dp++ = pixel[0];
 			*dp++ = pixel[1];
@@ -262,7 +959,7 @@ void Scene::WriteHDRImage(Color* image, int currentPass)
 	rgbe_header_info info;
 	char errbuf[100] = { 0 };
 
-	FILE* fp = fopen(hdrName.c_str(), "wb");
+	FILE* fp = fopen(name.c_str(), "wb");
 	info.valid = false;
 	int r = RGBE_WriteHeader(fp, width, height, &info, errbuf);
 	if (r != RGBE_RETURN_SUCCESS)
@@ -273,7 +970,7 @@ void Scene::WriteHDRImage(Color* image, int currentPass)
 		printf("error: %s\n", errbuf);
 	fclose(fp);
 
-	delete data;
+	delete[] data;
 }
 
 bool Scene::IsValidColor(vec3 color)
@@ -1,6 +1,7 @@
 #pragma once
 #include <vector>
 #include "geom.h"
+#include "Texture.h"
 
 ///////////////////////////////////////////////////////////////////////
 // A framework for a raytracer.
@@ -8,18 +9,6 @@
 const float PI = 3.14159f;
 const float Radians = PI / 180.0f;    // Convert degrees to radians
 
-////////////////////////////////////////////////////////////////////////
-// Texture: encapsulates a BRDF and communication with a shader.
-////////////////////////////////////////////////////////////////////////
-class Texture
-{
-public:
-	unsigned int id;
-	int width, height, depth;
-	unsigned char* image;
-	Texture(const std::string& path);
-};
-
 ////////////////////////////////////////////////////////////////////////
 // Material: encapsulates a BRDF and communication with a shader.
 ////////////////////////////////////////////////////////////////////////
@@ -63,7 +52,7 @@ public:
 		alpha_other = abs(sqrtf(2.0f / (alpha_phong + 2)));
 	}
 
-	void setTexture(const std::string path) { tex = new Texture(path); }
+	void setTexture(const std::string path) { tex = Texture::Load(path); }
 };
 
 ////////////////////////////////////////////////////////////////////////
@@ -107,11 +96,53 @@ public:
 	//virtual void apply(const unsigned int program);
 };
 
+////////////////////////////////////////////////////////////////////////////////
+// RenderOptions: settings given on the command line
+struct RenderOptions
+{
+	int passes = 8192;
+	bool denoise = false;	// also writes the denoiser's feature buffers
+	int preview = 0;		// coarsest preview is 1/preview resolution; 0 for none
+
+	// Re-rendering part of the frame.  The crop is in pixels from the
+	// top-left corner, x1 and y1 exclusive; the mask is an image of the
+	// frame's size whose bright pixels are rendered.  Pixels not rendered
+	// come from the composite .hdr, or are black without one.
+	bool crop = false;
+	int cropX0 = 0, cropY0 = 0, cropX1 = 0, cropY1 = 0;
+	std::string mask;
+	std::string composite;
+
+	// An .hdr of the converged image; the error against it is printed
+	// with the time taken after 1, 2, 4, ... passes and at the end.
+	std::string reference;
+
+	// Ignores the scene's radiance and visibility caches, for renders
+	// without their bias
+	bool noCache = false;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// Region: the pixels a render covers, bottom-up like the image array
+struct Region
+{
+	int x0 = 0, y0 = 0, x1 = 0, y1 = 0;		// bounds; x1, y1 exclusive
+	std::vector<unsigned char> mask;		// one per frame pixel; empty for all
+
+	bool Contains(int x, int y, int width) const
+	{
+		return x >= x0 && x < x1 && y >= y0 && y < y1 && (mask.empty() || mask[y * width + x]);
+	}
+};
+
 ////////////////////////////////////////////////////////////////////////////////
 // Scene
 class StaticRayTrace;
 class AccelerationBvh;
 class Shape;
+class Denoiser;
+class Ray;
+struct PathStats;
 
 class Scene {
 public:
@@ -120,6 +151,10 @@ public:
 	Material* currentMat;
 	AccelerationBvh* bvh;
 	std::string hdrName;
+	RenderOptions options;
+	Region region;
+	std::vector<Color> background;		// composited outside the region, already scaled
+	std::vector<Color> reference;		// options.reference, already scaled
 
 	Scene();
 	void Finit();
@@ -140,7 +175,30 @@ public:
 	// and return the image.  This is the Ray Tracer!
 	void TraceImage(Color* image, const int pass);
 
+	// One pass with the first hits' direct light from staticRayTrace->restir
+	void TraceRestirPass(Color* image, Denoiser* denoiser, PathStats& stats);
+
+	// Sets region and background from the options; call once the screen size is known.
+	void SetupRegion();
+
+	// Quick upsampled low-resolution images, written before the full render
+	void TracePreview(int factor);
+
+	void PrintPathStats(const PathStats& stats);
+
+	// RMSE of the image after passes against the reference, over the region
+	double ReferenceError(const Color* image, int passes);
+
+	// Camera ray through the continuous pixel position (x, y)
+	Ray CameraRay(float x, float y) const;
+
 	void WriteHDRImage(Color* image, int currentPass);
+	void WriteDenoisedImages(const Color* image, int passes, const Denoiser& denoiser);
+	void WriteHDR(const std::string& name, const Color* pixels, float scale);
+	void WriteComposited(const Color* pixels, float scale);
+
+	// hdrName with suffix inserted before the extension
+	std::string OutputName(const std::string& suffix) const;
 
 	bool IsValidColor(vec3 color);
 };
@@ -7,6 +7,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <emmintrin.h>
 
 /* This file contains code to read and write four byte rgbe file format
  developed by Greg Ward.  It handles the conversions between rgbe and
@@ -300,37 +301,119 @@ int RGBE_ReadPixels(FILE *fp, float *data, int numpixels,
   return RGBE_RETURN_SUCCESS;
 }
 
+/* Four pixels at once, bit-identical to float2rgbe.  For a normal v,
+ * frexp(v)*256/v is exactly 2^(134 - biased exponent of v), so the scale
+ * is built from the exponent bits instead of frexp and a divide.  Blocks
+ * holding negative, huge, infinite or NaN components go through
+ * float2rgbe so even those keep their old bytes. */
+static void float2rgbe4(unsigned char *planes[4], int i, const float *data)
+{
+  static const float threshold = (float)1e-32 < 1e-32 ?
+    nextafterf((float)1e-32, 1.0f) : (float)1e-32;
+  const float *p = data + i*RGBE_DATA_SIZE;
+  __m128 red = _mm_setr_ps(p[0], p[3], p[6], p[9]);
+  __m128 green = _mm_setr_ps(p[1], p[4], p[7], p[10]);
+  __m128 blue = _mm_setr_ps(p[2], p[5], p[8], p[11]);
+
+  /* sign bit set or exponent of at least 2^127 */
+  __m128i limit = _mm_set1_epi32(0x7effffff);
+  __m128i bad = _mm_or_si128(
+    _mm_or_si128(_mm_cmpgt_epi32(_mm_castps_si128(red), limit),
+                 _mm_cmpgt_epi32(_mm_castps_si128(green), limit)),
+    _mm_or_si128(_mm_cmpgt_epi32(_mm_castps_si128(blue), limit),
+                 _mm_or_si128(_mm_cmplt_epi32(_mm_castps_si128(red), _mm_setzero_si128()),
+                   _mm_or_si128(_mm_cmplt_epi32(_mm_castps_si128(green), _mm_setzero_si128()),
+                                _mm_cmplt_epi32(_mm_castps_si128(blue), _mm_setzero_si128())))));
+  if (_mm_movemask_epi8(bad)) {
+    unsigned char rgbe[4];
+    int j, k;
+    for (j = 0; j < 4; j++) {
+      float2rgbe(rgbe, p[3*j+0], p[3*j+1], p[3*j+2]);
+      for (k = 0; k < 4; k++)
+        planes[k][i+j] = rgbe[k];
+    }
+    return;
+  }
+
+  __m128 v = _mm_max_ps(_mm_max_ps(red, green), blue);
+  __m128i biased = _mm_srli_epi32(_mm_castps_si128(v), 23);
+  __m128 scale = _mm_castsi128_ps(_mm_slli_epi32(
+    _mm_sub_epi32(_mm_set1_epi32(261), biased), 23));
+  __m128i zero = _mm_castps_si128(_mm_cmplt_ps(v, _mm_set1_ps(threshold)));
+
+  __m128i r = _mm_andnot_si128(zero, _mm_cvttps_epi32(_mm_mul_ps(red, scale)));
+  __m128i g = _mm_andnot_si128(zero, _mm_cvttps_epi32(_mm_mul_ps(green, scale)));
+  __m128i b = _mm_andnot_si128(zero, _mm_cvttps_epi32(_mm_mul_ps(blue, scale)));
+  __m128i e = _mm_andnot_si128(zero, _mm_add_epi32(biased, _mm_set1_epi32(2)));
+
+  /* every lane is in [0, 255]: pack to bytes, four per channel */
+  __m128i rg = _mm_packus_epi16(_mm_packs_epi32(r, g), _mm_setzero_si128());
+  __m128i be = _mm_packus_epi16(_mm_packs_epi32(b, e), _mm_setzero_si128());
+  int words[4] = { _mm_cvtsi128_si32(rg), _mm_cvtsi128_si32(_mm_srli_si128(rg, 4)),
+                   _mm_cvtsi128_si32(be), _mm_cvtsi128_si32(_mm_srli_si128(be, 4)) };
+  int k;
+  for (k = 0; k < 4; k++)
+    memcpy(&planes[k][i], &words[k], 4);
+}
+
 /* The code below is only needed for the run-length encoded files. */
 /* Run length encoding adds considerable complexity but does */
 /* save some space.  For each scanline, each channel (r,g,b,e) is */
 /* encoded separately for better compression. */
 
-static int RGBE_WriteBytes_RLE(FILE *fp, unsigned char *data, int numbytes,
-                               char *errbuf)
+/* First p >= cur where data[p..p+3] are equal, or numbytes if there is */
+/* none.  No earlier byte can match data[p], so a run always starts at p. */
+static int RGBE_FindRun(const unsigned char *data, int cur, int numbytes)
 {
-#define MINRUNLENGTH 4
-  int cur, beg_run, run_count, old_run_count, nonrun_count;
-  unsigned char buf[2];
+  int p = cur;
+  for (; p + 19 <= numbytes; p += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(data + p));
+    __m128i b = _mm_loadu_si128((const __m128i *)(data + p + 1));
+    __m128i c = _mm_loadu_si128((const __m128i *)(data + p + 2));
+    __m128i d = _mm_loadu_si128((const __m128i *)(data + p + 3));
+    int mask = _mm_movemask_epi8(_mm_and_si128(
+      _mm_and_si128(_mm_cmpeq_epi8(a, b), _mm_cmpeq_epi8(b, c)), _mm_cmpeq_epi8(c, d)));
+    if (mask) {
+      while (!(mask & 1)) {
+        mask >>= 1;
+        p++;
+      }
+      return p;
+    }
+  }
+  for (; p + 3 < numbytes; p++)
+    if (data[p] == data[p+1] && data[p] == data[p+2] && data[p] == data[p+3])
+      return p;
+  return numbytes;
+}
+
+/* Encodes into out, which must hold numbytes + numbytes/128 + 2 bytes, */
+/* and returns the number of bytes written.  The output matches the */
+/* original byte-at-a-time encoder: runs of at least 4 (up to 127), a */
+/* short run of 2 or 3 only right before one of those or the end, and */
+/* everything else as literal blocks of up to 128. */
+static int RGBE_EncodeBytes_RLE(unsigned char *out, const unsigned char *data,
+                                int numbytes)
+{
+  int cur, beg_run, run_count, nonrun_count;
+  unsigned char *start = out;
 
   cur = 0;
   while(cur < numbytes) {
-    beg_run = cur;
-    /* find next run of length at least 4 if one exists */
-    run_count = old_run_count = 0;
-    while((run_count < MINRUNLENGTH) && (beg_run < numbytes)) {
-      beg_run += run_count;
-      old_run_count = run_count;
-      run_count = 1;
-      while((data[beg_run] == data[beg_run + run_count]) 
-	    && (beg_run + run_count < numbytes) && (run_count < 127))
+    beg_run = RGBE_FindRun(data, cur, numbytes);
+    run_count = 0;
+    if (beg_run < numbytes) {
+      run_count = 4;
+      while((beg_run + run_count < numbytes) && (run_count < 127)
+	    && (data[beg_run] == data[beg_run + run_count]))
 	run_count++;
     }
     /* if data before next big run is a short run then write it as such */
-    if ((old_run_count > 1)&&(old_run_count == beg_run - cur)) {
-      buf[0] = 128 + old_run_count;   /*write short run*/
-      buf[1] = data[cur];
-      if (fwrite(buf,sizeof(buf[0])*2,1,fp) < 1)
-	return rgbe_error(rgbe_write_error,NULL, errbuf);
+    nonrun_count = beg_run - cur;
+    if ((nonrun_count == 2 || nonrun_count == 3)
+        && data[cur] == data[cur + 1] && data[cur] == data[beg_run - 1]) {
+      *out++ = 128 + nonrun_count;   /*write short run*/
+      *out++ = data[cur];
       cur = beg_run;
     }
     /* write out bytes until we reach the start of the next run */
@@ -338,69 +421,109 @@ static int RGBE_WriteBytes_RLE(FILE *fp, unsigned char *data, int numbytes,
       nonrun_count = beg_run - cur;
       if (nonrun_count > 128) 
 	nonrun_count = 128;
-      buf[0] = nonrun_count;
-      if (fwrite(buf,sizeof(buf[0]),1,fp) < 1)
-	return rgbe_error(rgbe_write_error,NULL, errbuf);
-      if (fwrite(&data[cur],sizeof(data[0])*nonrun_count,1,fp) < 1)
-	return rgbe_error(rgbe_write_error,NULL, errbuf);
+      *out++ = nonrun_count;
+      memcpy(out, &data[cur], nonrun_count);
+      out += nonrun_count;
       cur += nonrun_count;
     }
     /* write out next run if one was found */
-    if (run_count >= MINRUNLENGTH) {
-      buf[0] = 128 + run_count;
-      buf[1] = data[beg_run];
-      if (fwrite(buf,sizeof(buf[0])*2,1,fp) < 1)
-	return rgbe_error(rgbe_write_error,NULL, errbuf);
+    if (run_count > 0) {
+      *out++ = 128 + run_count;
+      *out++ = data[beg_run];
       cur += run_count;
     }
   }
-  return RGBE_RETURN_SUCCESS;
-#undef MINRUNLENGTH
+  return (int)(out - start);
 }
 
+/* Scanlines are converted and encoded in parallel, each into its own */
+/* slot of one buffer, then packed together and written in one call. */
 int RGBE_WritePixels_RLE(FILE *fp, float *data, int scanline_width,
 			 int num_scanlines, char *errbuf)
 {
-  unsigned char rgbe[4];
-  unsigned char *buffer;
-  int i, err;
+  unsigned char *output;
+  int *lengths;
+  size_t slot, total, written;
+  int y, failed = 0;
 
   if ((scanline_width < 8)||(scanline_width > 0x7fff))
     /* run length encoding is not allowed so write flat*/
     return RGBE_WritePixels(fp,data,scanline_width*num_scanlines);
-  buffer = (unsigned char *)malloc(sizeof(unsigned char)*4*scanline_width);
-  if (buffer == NULL) 
+  slot = 4 + 4*(size_t)(scanline_width + scanline_width/128 + 2);
+  output = (unsigned char *)malloc(slot*num_scanlines);
+  lengths = (int *)malloc(sizeof(int)*num_scanlines);
+  if (output == NULL || lengths == NULL) {
     /* no buffer space so write flat */
+    free(output);
+    free(lengths);
     return RGBE_WritePixels(fp,data,scanline_width*num_scanlines);
-  while(num_scanlines-- > 0) {
-    rgbe[0] = 2;
-    rgbe[1] = 2;
-    rgbe[2] = scanline_width >> 8;
-    rgbe[3] = scanline_width & 0xFF;
-    if (fwrite(rgbe, sizeof(rgbe), 1, fp) < 1) {
-      free(buffer);
-      return rgbe_error(rgbe_write_error,NULL, errbuf);
+  }
+
+#pragma omp parallel
+  {
+    unsigned char *buffer = (unsigned char *)malloc(4*(size_t)scanline_width + 12);
+    unsigned char *planes[4];
+    int i, x;
+    if (buffer != NULL) {
+      planes[0] = buffer;
+      planes[1] = buffer + scanline_width;
+      planes[2] = buffer + 2*scanline_width;
+      planes[3] = buffer + 3*scanline_width;
     }
-    for(i=0;i<scanline_width;i++) {
-      float2rgbe(rgbe,data[RGBE_DATA_RED],
-		 data[RGBE_DATA_GREEN],data[RGBE_DATA_BLUE]);
-      buffer[i] = rgbe[0];
-      buffer[i+scanline_width] = rgbe[1];
-      buffer[i+2*scanline_width] = rgbe[2];
-      buffer[i+3*scanline_width] = rgbe[3];
-      data += RGBE_DATA_SIZE;
+    else {
+#pragma omp atomic write
+      failed = 1;
     }
-    /* write out each of the four channels separately run length encoded */
-    /* first red, then green, then blue, then exponent */
-    for(i=0;i<4;i++) {
-      if ((err = RGBE_WriteBytes_RLE(fp,&buffer[i*scanline_width],
-				     scanline_width, errbuf)) != RGBE_RETURN_SUCCESS) {
-	free(buffer);
-	return err;
+
+#pragma omp for schedule(dynamic, 8)
+    for (y = 0; y < num_scanlines; y++) {
+      if (buffer == NULL)
+        continue;
+      const float *line = data + (size_t)y*scanline_width*RGBE_DATA_SIZE;
+      unsigned char *out = output + y*slot;
+      unsigned char *cur = out;
+
+      x = 0;
+      for (; x + 4 <= scanline_width; x += 4)
+        float2rgbe4(planes, x, line);
+      for (; x < scanline_width; x++) {
+        unsigned char rgbe[4];
+        float2rgbe(rgbe,line[x*RGBE_DATA_SIZE+RGBE_DATA_RED],
+                   line[x*RGBE_DATA_SIZE+RGBE_DATA_GREEN],
+                   line[x*RGBE_DATA_SIZE+RGBE_DATA_BLUE]);
+        for (i = 0; i < 4; i++)
+          planes[i][x] = rgbe[i];
       }
+
+      *cur++ = 2;
+      *cur++ = 2;
+      *cur++ = scanline_width >> 8;
+      *cur++ = scanline_width & 0xFF;
+      /* write out each of the four channels separately run length encoded */
+      /* first red, then green, then blue, then exponent */
+      for (i = 0; i < 4; i++)
+        cur += RGBE_EncodeBytes_RLE(cur, planes[i], scanline_width);
+      lengths[y] = (int)(cur - out);
     }
+    free(buffer);
+  }
+  if (failed) {
+    /* a thread had no scratch space, so its scanlines are missing */
+    free(output);
+    free(lengths);
+    return RGBE_WritePixels(fp,data,scanline_width*num_scanlines);
+  }
+
+  total = 0;
+  for (y = 0; y < num_scanlines; y++) {
+    memmove(output + total, output + y*slot, lengths[y]);
+    total += lengths[y];
   }
-  free(buffer);
+  written = fwrite(output, 1, total, fp);
+  free(output);
+  free(lengths);
+  if (written < total)
+    return rgbe_error(rgbe_write_error,NULL, errbuf);
   return RGBE_RETURN_SUCCESS;
 }
       
@@ -0,0 +1,80 @@
+////////////////////////////////////////////////////////////////////////
+// Accuracy of the FastMath.h approximations against libm.  Each function
+// is checked on 2M random inputs over the range the kernels use, and
+// the run fails if any error exceeds the bound FastMath.h states.
+//
+//   make fastmath_test && ./fastmath_test
+////////////////////////////////////////////////////////////////////////
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include "FastMath.h"
+
+static const int Samples = 1 << 21;
+
+// Largest error of a four-wide function over Samples draws; relative
+// errors are measured against max(|exact|, floor).
+template <typename Draw, typename Approx, typename Exact>
+static double MaxError(Draw draw, Approx approx, Exact exact, bool relative, double floor = 0.0)
+{
+	std::mt19937 rng(1234);
+	double worst = 0.0;
+	for (int i = 0; i < Samples; i += 4)
+	{
+		float a[4], b[4], r[4];
+		for (int k = 0; k < 4; k++)
+			draw(rng, a[k], b[k]);
+		_mm_storeu_ps(r, approx(_mm_loadu_ps(a), _mm_loadu_ps(b)));
+		for (int k = 0; k < 4; k++)
+		{
+			const double e = exact((double)a[k], (double)b[k]);
+			double error = std::abs((double)r[k] - e);
+			if (relative)
+				error /= std::max(std::abs(e), floor);
+			worst = std::max(worst, error);
+		}
+	}
+	return worst;
+}
+
+static bool Check(const char* name, double error, double bound)
+{
+	const bool pass = error <= bound;
+	printf("%-8s %.3g (bound %.3g) %s\n", name, error, bound, pass ? "ok" : "FAILED");
+	return pass;
+}
+
+int main()
+{
+	using Rng = std::mt19937;
+	const auto Uniform = [](Rng& rng, float lo, float hi) { return std::uniform_real_distribution<float>(lo, hi)(rng); };
+	bool pass = true;
+
+	pass &= Check("Exp4", MaxError(
+		[&](Rng& rng, float& x, float&) { x = Uniform(rng, -87.0f, 88.0f); },
+		[](__m128 x, __m128) { return Exp4(x); },
+		[](double x, double) { return std::exp(x); }, true), 1.2e-7);
+
+	// Spread over the exponents as well as the mantissa
+	pass &= Check("Log4", MaxError(
+		[&](Rng& rng, float& x, float&) { x = std::pow(10.0f, Uniform(rng, -30.0f, 30.0f)); },
+		[](__m128 x, __m128) { return Log4(x); },
+		[](double x, double) { return std::log(x); }, false), 7.7e-6);
+
+	pass &= Check("Atan2_4", MaxError(
+		[&](Rng& rng, float& y, float& x) { y = Uniform(rng, -1.0f, 1.0f); x = Uniform(rng, -1.0f, 1.0f); },
+		[](__m128 y, __m128 x) { return Atan2_4(y, x); },
+		[](double y, double x) { return std::atan2(y, x); }, false), 2.0e-6);
+
+	pass &= Check("Acos4", MaxError(
+		[&](Rng& rng, float& x, float&) { x = Uniform(rng, -1.0f, 1.0f); },
+		[](__m128 x, __m128) { return Acos4(x); },
+		[](double x, double) { return std::acos(x); }, false), 4.8e-7);
+
+	pass &= Check("Rsqrt4", MaxError(
+		[&](Rng& rng, float& x, float&) { x = std::pow(10.0f, Uniform(rng, -6.0f, 6.0f)); },
+		[](__m128 x, __m128) { return Rsqrt4(x); },
+		[](double x, double) { return 1.0 / std::sqrt(x); }, true), 3e-7);
+
+	return pass ? 0 : 1;
+}